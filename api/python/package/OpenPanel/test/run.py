@@ -36,6 +36,8 @@ class Tester(object):
         self.logger.error("test %s failed: %s" % (title, desc))
         
     def run(self):
+        self.testCore()
+        
         self.gatherModuleInfo()
         self.mainlogger.debug("modules=%s order=%s" % (self.modules, self.order))
         
@@ -61,6 +63,20 @@ class Tester(object):
         # if not self.DBManagerCleanup():
         #     print "FAIL DBManagerCleanup"
     
+    def testCore(self):
+        self.logger = logging.getLogger("core")
+        
+        # a continuation without a count lists everything, like a plain
+        # getrecords does
+        full = self.conn.rpc.getrecords(classid="User", parentid="")
+        page = self.conn.rpc.getrecords(classid="User", parentid="",
+                                        continuation="")
+        nfull = len(full["body"]["data"].get("User", {}))
+        npage = len(page["body"]["data"].get("User", {}))
+        if npage != nfull:
+            self.fail("getrecords-continuation-nocount",
+                      "%d of %d records on the first page" % (npage, nfull))
+    
     def gatherModuleInfo(self):
         modules = self.conn.rpc.listmodules()['body']['data']['modules']
         prereqs = dict()
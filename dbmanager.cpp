@@ -14,12 +14,18 @@
 #include <grace/md5.h>
 #include <sqlite3.h>
 
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <errno.h>
 #include "dbmanager.h"
 #include "opencore.h"
 #include "debug.h"
@@ -29,8 +35,6 @@
 // TODO: check that we handle all relevant table columns at all places
 // TODO: make sure 'wanted' and 'reality' are in all the necessary WHERE-clauses
 
-// TODO: handle SQLITE3_BUSY, possibly as simply as sqlite3_busy_timeout() plus returning the error upwards
-
 // TODO: when a reffed object/member changes, we need to smartly update -towards the modules- all other objects that reffed it
 // TODO: schema support
 // TODO: possibly consolidate fetch+find
@@ -38,10 +42,1033 @@
 
 // TODO: convert all powermirror sql usage to the right kind of join
 
-static lock<sqlite3*> dbhandle;
 static bool dbinitdone = false;
 static xmlschema schema;
 
+//  -------------------------------------------------------------------------
+/// Schema migrations, applied by checkschema(). Entry N takes a database
+/// from user_version N to N+1. sqlite/SCHEMA creates a database at the
+/// latest version, so a change here needs the same change there. Only
+/// ever append to this list.
+//  -------------------------------------------------------------------------
+static const char *dbmigrations[] =
+{
+	// 1: parent, owner and class lookups
+	"CREATE INDEX IF NOT EXISTS oparentclass ON objects (parent, class);"
+	"CREATE INDEX IF NOT EXISTS oowner ON objects (owner);"
+	"CREATE INDEX IF NOT EXISTS oclassmetaid ON objects (class, metaid);",
+	
+	// 2: listings only look at live rows, deleted ones have no content
+	"CREATE INDEX IF NOT EXISTS olive ON objects (parent, metaid) "
+	"WHERE content!='';",
+	
+	// 3: object usage per owner and class, kept up to date by triggers
+	"CREATE TABLE IF NOT EXISTS quotausage ("
+	"userid INTEGER NOT NULL, classid INTEGER NOT NULL, "
+	"usage INTEGER NOT NULL, PRIMARY KEY (userid, classid));"
+	"DELETE FROM quotausage;"
+	"INSERT INTO quotausage (userid, classid, usage) "
+	"SELECT owner, class, COUNT(id) FROM objects "
+	"WHERE owner IS NOT NULL GROUP BY owner, class;"
+	"CREATE TRIGGER IF NOT EXISTS quotainsert AFTER INSERT ON objects "
+	"WHEN NEW.owner IS NOT NULL BEGIN "
+	"INSERT INTO quotausage (userid, classid, usage) "
+	"SELECT NEW.owner, NEW.class, 0 WHERE NOT EXISTS (SELECT 1 FROM "
+	"quotausage WHERE userid=NEW.owner AND classid=NEW.class); "
+	"UPDATE quotausage SET usage=usage+1 "
+	"WHERE userid=NEW.owner AND classid=NEW.class; END;"
+	"CREATE TRIGGER IF NOT EXISTS quotadelete AFTER DELETE ON objects "
+	"WHEN OLD.owner IS NOT NULL BEGIN "
+	"UPDATE quotausage SET usage=usage-1 "
+	"WHERE userid=OLD.owner AND classid=OLD.class; END;"
+	"CREATE TRIGGER IF NOT EXISTS quotaupdate "
+	"AFTER UPDATE OF owner, class ON objects "
+	"WHEN OLD.owner IS NOT NEW.owner OR OLD.class IS NOT NEW.class BEGIN "
+	"UPDATE quotausage SET usage=usage-1 "
+	"WHERE userid=OLD.owner AND classid=OLD.class; "
+	"INSERT INTO quotausage (userid, classid, usage) "
+	"SELECT NEW.owner, NEW.class, 0 WHERE NEW.owner IS NOT NULL AND "
+	"NOT EXISTS (SELECT 1 FROM quotausage "
+	"WHERE userid=NEW.owner AND classid=NEW.class); "
+	"UPDATE quotausage SET usage=usage+1 "
+	"WHERE userid=NEW.owner AND classid=NEW.class; END;",
+	
+	// 4: searchable fields; the old searchkeys table was never filled.
+	// objects are indexed when their class first declares the fields
+	"DROP TABLE IF EXISTS searchkeys;"
+	"CREATE TABLE searchkeys (objectid INTEGER NOT NULL, "
+	"field TEXT NOT NULL, searchkey TEXT COLLATE NOCASE, "
+	"PRIMARY KEY (objectid, field));"
+	"CREATE INDEX IF NOT EXISTS sfieldkey ON searchkeys (field, searchkey);"
+	"CREATE TRIGGER IF NOT EXISTS searchdelete AFTER DELETE ON objects "
+	"BEGIN DELETE FROM searchkeys WHERE objectid=OLD.id; END;",
+	
+	NULL
+};
+
+/// First byte of object content in the binary format. Content without
+/// it is the old compact xml, which starts with '<'.
+#define DBCONTENT_MSGPACK '\x01'
+
+/// True if a value or any of its children carries attributes, which
+/// the binary content format can not hold.
+static bool dbhasattributes (const value &v)
+{
+	if (v.attributes().count()) return true;
+	foreach (child, v)
+	{
+		if (dbhasattributes (child)) return true;
+	}
+	return false;
+}
+
+/// Hex encoding for blob literals and continuation tokens.
+static string *dbhexencode (const string &s)
+{
+	returnclass (string) res retain;
+	static const char *hexdigits = "0123456789abcdef";
+	
+	for(unsigned int i=0; i < s.strlen(); i++)
+	{
+		unsigned char c = (unsigned char) s[i];
+		res.strcat(hexdigits[c >> 4]);
+		res.strcat(hexdigits[c & 15]);
+	}
+	
+	return &res;
+}
+
+/// Reverse of dbhexencode(), stops at the first character that is
+/// not a hex digit.
+static string *dbhexdecode (const string &s)
+{
+	returnclass (string) res retain;
+	
+	for(unsigned int i=0; (i+1) < s.strlen(); i+=2)
+	{
+		if(!isxdigit(s[i]) || !isxdigit(s[i+1])) break;
+		char hex[3] = { s[i], s[i+1], 0 };
+		res.strcat((char) strtol(hex, NULL, 16));
+	}
+	
+	return &res;
+}
+
+/// Condition matching a column against a search text or LIKE pattern.
+/// Exact matches compare twice: the NOCASE comparison finds the rows
+/// through the index, the binary one keeps the match case sensitive.
+static void dbsearchcond (DBQuery &q, const char *column,
+						  const string &pattern, dbsearchmode mode)
+{
+	q.add(column);
+	if(mode == DBSEARCH_EXACT)
+	{
+		q.add("=").arg(pattern).add(" AND ").add(column);
+		q.add("=").arg(pattern).add(" COLLATE BINARY");
+	}
+	else
+	{
+		q.add(" LIKE ").arg(pattern).add(" ESCAPE '\\'");
+	}
+}
+
+/// Bind arguments to a prepared statement, one per letter in types
+/// (see dbhotquerydef). Returns the first failing sqlite result, or
+/// SQLITE_OK.
+static int dbbindargs (sqlite3_stmt *st, const char *types,
+					   const value &args)
+{
+	int res = SQLITE_OK;
+	if (! types) return res;
+	
+	for (int i=0; (res == SQLITE_OK) && types[i]; ++i)
+	{
+		switch (types[i])
+		{
+			case 'i':
+				res = sqlite3_bind_int (st, i+1, args[i].ival());
+				break;
+			
+			case 'I':
+				if (args[i].sval().strlen())
+					res = sqlite3_bind_int (st, i+1, args[i].ival());
+				else
+					res = sqlite3_bind_null (st, i+1);
+				break;
+			
+			case 'c':
+			{
+				const string &content = args[i].sval();
+				if (content.strlen() && content[0] == DBCONTENT_MSGPACK)
+				{
+					res = sqlite3_bind_blob (st, i+1, content.str(),
+											 content.strlen(),
+											 SQLITE_TRANSIENT);
+					break;
+				}
+				res = sqlite3_bind_text (st, i+1, content.str(), -1,
+										 SQLITE_TRANSIENT);
+				break;
+			}
+			
+			default:
+				res = sqlite3_bind_text (st, i+1, args[i].cval(), -1,
+										 SQLITE_TRANSIENT);
+				break;
+		}
+	}
+	
+	return res;
+}
+
+/// Wall clock in microseconds, for benchmarkContent.
+static long long dbusecnow (void)
+{
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return ((long long) tv.tv_sec * 1000000LL) + tv.tv_usec;
+}
+
+//  -------------------------------------------------------------------------
+/// Definition of a cached statement. The argument string has one
+/// character per placeholder: 'i' binds an integer, 's' binds text,
+/// 'I' binds an integer or NULL for an empty argument, and 'c' binds
+/// object content, which is a blob in the binary format.
+//  -------------------------------------------------------------------------
+struct dbhotquerydef
+{
+	const char *tag;
+	const char *args;
+	const char *sql;
+};
+
+static dbhotquerydef hotqueries[HQ_COUNT] =
+{
+	{ "findlocalid", "s",
+	  "SELECT /* findlocalid */ id, class FROM objects WHERE uuid=?" },
+	{ "findclassid", "s",
+	  "SELECT /* findclassid */ id FROM objects WHERE class=1 AND metaid=?" },
+	{ "haspower-owner", "i",
+	  "SELECT /* haspower */ owner FROM objects WHERE id=?" },
+	{ "haspower-mirror", "ii",
+	  "SELECT /* haspower */ userid, powerid FROM powermirror "
+	  "WHERE userid=? AND powerid=?" },
+	{ "fetchObject", "i",
+	  "SELECT /* fetchObject */ o.class class, o.parent parent, "
+	  "o.content content, o.metaid metaid, o.uuid uuid, o.owner owner, "
+	  "o2.uuid parentuuid, o3.uuid owneruuid, o3.metaid ownermetaid "
+	  "FROM objects o "
+	  "LEFT JOIN objects o2 ON o.parent=o2.id "
+	  "LEFT JOIN objects o3 ON o.owner=o3.id WHERE o.id=?" },
+	{ "_findmetaid", "i",
+	  "SELECT /* _findmetaid */ metaid FROM objects WHERE id=?" },
+	{ "fetchObject-chain", "i",
+	  "WITH RECURSIVE chain(id, depth) AS (SELECT ?, 0 UNION ALL "
+	  "SELECT o.parent, chain.depth+1 FROM objects o, chain "
+	  "WHERE o.id=chain.id AND o.parent!=0 AND o.parent!=o.id "
+	  "AND chain.depth < 64) "
+	  "SELECT /* fetchObject */ o.class class, o.parent parent, "
+	  "o.content content, o.metaid metaid, o.uuid uuid, o.owner owner, "
+	  "o2.uuid parentuuid, o3.uuid owneruuid, o3.metaid ownermetaid "
+	  "FROM chain JOIN objects o ON o.id=chain.id "
+	  "LEFT JOIN objects o2 ON o.parent=o2.id "
+	  "LEFT JOIN objects o3 ON o.owner=o3.id ORDER BY chain.depth" },
+	{ "getUserQuota-chain", "i",
+	  "WITH RECURSIVE chain(id, depth) AS (SELECT ?, 0 UNION ALL "
+	  "SELECT o.owner, chain.depth+1 FROM objects o, chain "
+	  "WHERE o.id=chain.id AND o.owner>0 AND o.owner!=o.id "
+	  "AND chain.depth < 64) "
+	  "SELECT /* getUserQuota */ q.classid classid, q.quota quota "
+	  "FROM chain JOIN classquota q ON q.userid=chain.id" },
+	{ "copyprototype-tree", "i",
+	  "WITH RECURSIVE tree(id, depth) AS (SELECT ?, 0 UNION ALL "
+	  "SELECT o.id, tree.depth+1 FROM tree CROSS JOIN objects o "
+	  "WHERE o.parent=tree.id AND o.id!=tree.id AND tree.depth < 64) "
+	  "SELECT /* copyprototype */ o.id id, o.parent parent, o.class class, "
+	  "o.content content, o.metaid metaid "
+	  "FROM tree CROSS JOIN objects o ON o.id=tree.id "
+	  "ORDER BY tree.depth, o.id" },
+	{ "copyprototype-insert", "ssiiIic",
+	  "INSERT /* copyprototype */ INTO objects "
+	  "(uuid, metaid, parent, owner, uniquecontext, class, content) "
+	  "VALUES (?, ?, ?, ?, ?, ?, ?)" }
+};
+
+/// Cache statistics; a miss means the statement had to be prepared.
+static unsigned int hothits[HQ_COUNT];
+static unsigned int hotmisses[HQ_COUNT];
+
+//  -------------------------------------------------------------------------
+/// Profile of one query tag. Queries are keyed by the comment they carry
+/// ("SELECT /* listObjects */ ..."), hot statements by their name in
+/// hotqueries. Slots are claimed once and never given back, so the
+/// counters are bumped without a lock. Times go into log2 buckets:
+/// bucket 0 holds 0 usecs, bucket n times below 2^n usecs.
+//  -------------------------------------------------------------------------
+#define DBPROF_SIZE 256
+#define DBPROF_TAGLEN 48
+#define DBPROF_BUCKETS 24
+
+#define DBPROF_FREE		0 ///< Slot unused.
+#define DBPROF_CLAIMED	1 ///< Tag being written.
+#define DBPROF_READY	2 ///< Tag valid, counting.
+
+struct dbprofslot
+{
+	char				 tag[DBPROF_TAGLEN]; ///< Query tag.
+	volatile int		 state; ///< One of the DBPROF_ values.
+	unsigned int		 calls; ///< Statements run.
+	unsigned int		 rows; ///< Rows returned.
+	unsigned int		 busy; ///< Statements that ended in SQLITE_BUSY.
+	unsigned int		 errors; ///< Statements that failed otherwise.
+	unsigned long long	 preptime; ///< Total prepare/bind time, usecs.
+	unsigned long long	 steptime; ///< Total step time, usecs.
+	unsigned int		 prep[DBPROF_BUCKETS]; ///< Prepare time histogram.
+	unsigned int		 step[DBPROF_BUCKETS]; ///< Step time histogram.
+};
+
+static dbprofslot dbprof[DBPROF_SIZE];
+
+/// Profile slots of the hot statements, resolved on first use.
+static dbprofslot *volatile hotprof[HQ_COUNT];
+
+// ==========================================================================
+// FUNCTION dbprofslotfor
+// ==========================================================================
+/// Find or claim the profile slot for a tag. Returns NULL if the table
+/// is full.
+static dbprofslot *dbprofslotfor (const char *tag)
+{
+	unsigned int h = 2166136261U;
+	for (const char *c = tag; *c; ++c) h = (h ^ (unsigned char) *c) * 16777619U;
+	
+	for (int n=0; n<DBPROF_SIZE; ++n)
+	{
+		dbprofslot *p = &dbprof[(h+n) % DBPROF_SIZE];
+		
+		if (p->state == DBPROF_FREE)
+		{
+			if (__sync_bool_compare_and_swap (&p->state, DBPROF_FREE,
+											  DBPROF_CLAIMED))
+			{
+				strncpy (p->tag, tag, DBPROF_TAGLEN-1);
+				__sync_synchronize ();
+				p->state = DBPROF_READY;
+				return p;
+			}
+		}
+		
+		// someone else is writing this tag, it may be ours
+		while (p->state == DBPROF_CLAIMED) __sync_synchronize ();
+		if (! strncmp (p->tag, tag, DBPROF_TAGLEN-1)) return p;
+	}
+	
+	return NULL;
+}
+
+// ==========================================================================
+// FUNCTION dbprofquery
+// ==========================================================================
+/// Profile slot for an ad-hoc query, by the first comment in its text.
+static dbprofslot *dbprofquery (const char *sql)
+{
+	char tag[DBPROF_TAGLEN];
+	int len = 0;
+	
+	const char *c = strstr (sql, "/*");
+	if (c)
+	{
+		for (c += 2; *c == ' '; ++c);
+		while (*c && (*c != ' ') && (*c != '*') && (len < DBPROF_TAGLEN-1))
+		{
+			tag[len++] = *c++;
+		}
+	}
+	
+	if (! len) return dbprofslotfor ("untagged");
+	tag[len] = 0;
+	return dbprofslotfor (tag);
+}
+
+// ==========================================================================
+// FUNCTION dbprofhot
+// ==========================================================================
+/// Profile slot for a hot statement.
+static dbprofslot *dbprofhot (dbhotquery q)
+{
+	dbprofslot *p = hotprof[q];
+	if (p) return p;
+	
+	p = dbprofslotfor (hotqueries[q].tag);
+	hotprof[q] = p;
+	return p;
+}
+
+// ==========================================================================
+// FUNCTION dbprofbucket
+// ==========================================================================
+static inline int dbprofbucket (long long usec)
+{
+	int n = 0;
+	while ((usec > 0) && (n < DBPROF_BUCKETS-1))
+	{
+		usec >>= 1;
+		n++;
+	}
+	return n;
+}
+
+// ==========================================================================
+// FUNCTION dbprofrecord
+// ==========================================================================
+/// Account for one statement. The result is the sqlite code of the
+/// last step, as reported by finalize or reset.
+static void dbprofrecord (dbprofslot *p, long long preptime,
+						  long long steptime, int rows, int result)
+{
+	if (! p) return;
+	
+	__sync_fetch_and_add (&p->calls, 1);
+	__sync_fetch_and_add (&p->rows, rows);
+	__sync_fetch_and_add (&p->preptime, preptime);
+	__sync_fetch_and_add (&p->steptime, steptime);
+	__sync_fetch_and_add (&p->prep[dbprofbucket (preptime)], 1);
+	__sync_fetch_and_add (&p->step[dbprofbucket (steptime)], 1);
+	
+	if (result == SQLITE_BUSY) __sync_fetch_and_add (&p->busy, 1);
+	else if (result != SQLITE_OK) __sync_fetch_and_add (&p->errors, 1);
+}
+
+// ==========================================================================
+// FUNCTION dbprofpercentile
+// ==========================================================================
+/// Upper bound in usecs of the bucket holding the given percentile.
+static unsigned int dbprofpercentile (const unsigned int *hist,
+									  unsigned int total, int pct)
+{
+	unsigned int want = ((unsigned long long) total * pct + 99) / 100;
+	unsigned int seen = 0;
+	
+	for (int i=0; i<DBPROF_BUCKETS; ++i)
+	{
+		seen += hist[i];
+		if (seen >= want) return i ? (1U << i) : 0;
+	}
+	
+	return 1U << (DBPROF_BUCKETS-1);
+}
+
+//  -------------------------------------------------------------------------
+/// A pooled sqlite connection. Prepared statements are bound to the
+/// handle they were prepared on, so every connection carries its own
+/// set of hot statements.
+//  -------------------------------------------------------------------------
+struct dbconnection
+{
+	sqlite3			*h; ///< The sqlite handle.
+	sqlite3_stmt	*hotstmt[HQ_COUNT]; ///< Prepared hot statements.
+	dbconnection	*next; ///< Link in the idle list.
+};
+
+/// The single connection used for mutations. Holding its lock is what
+/// makes a writer exclusive.
+static lock<dbconnection*> dbwriter;
+
+/// Idle reader connections. The lock only protects the list itself,
+/// queries on a reader run without any lock held.
+static lock<dbconnection*> dbreaders;
+static int dbreadercount = 0;
+static string dbpath;
+
+//  -------------------------------------------------------------------------
+/// Bounded map from object uuid to local id and class id. These never
+/// change during the lifetime of an object, so entries only have to go
+/// when the object is removed. Eviction uses the CLOCK approximation of
+/// LRU, which lets lookups run under a shared lock: a hit only sets the
+/// slot's reference bit instead of relinking a list.
+//  -------------------------------------------------------------------------
+#define DBIDCACHE_SIZE 8192
+
+class dbidcache
+{
+public:
+				 dbidcache (void)
+				 {
+				 	hand = 0;
+				 	used = 0;
+				 	gen = 0;
+				 	hits = misses = 0;
+				 	for (int i=0; i<DBIDCACHE_SIZE; ++i)
+				 	{
+				 		slots[i].localid = 0;
+				 		slots[i].classid = 0;
+				 		slots[i].ref = false;
+				 	}
+				 }
+				 
+				 /// Look up a uuid. Returns false on a miss.
+	bool		 get (const statstring &uuid, int &localid, int &classid)
+				 {
+				 	bool found = false;
+				 	
+				 	sharedsection (index)
+				 	{
+				 		if (index.o.exists (uuid))
+				 		{
+				 			slot &sl = slots[index.o[uuid].ival()];
+				 			localid = sl.localid;
+				 			classid = sl.classid;
+				 			sl.ref = true;
+				 			found = true;
+				 		}
+				 	}
+				 	
+				 	if (found) __sync_fetch_and_add (&hits, 1);
+				 	else __sync_fetch_and_add (&misses, 1);
+				 	return found;
+				 }
+				 
+				 /// Current invalidation generation. A lookup that missed
+				 /// passes this to put(), so that a result read from the
+				 /// database before an invalidation is not cached after it.
+	unsigned int generation (void) { return gen; }
+	
+				 /// Store a mapping.
+	void		 put (const statstring &uuid, int localid, int classid,
+					  unsigned int atgen)
+				 {
+				 	exclusivesection (index)
+				 	{
+				 		if (atgen != gen) breaksection return;
+				 		
+				 		int i;
+				 		if (index.o.exists (uuid))
+				 		{
+				 			i = index.o[uuid].ival();
+				 		}
+				 		else
+				 		{
+				 			i = victim ();
+				 			if (slots[i].uuid) index.o.rmval (slots[i].uuid);
+				 			else used++;
+				 			slots[i].uuid = uuid;
+				 			index.o[uuid] = i;
+				 		}
+				 		
+				 		slots[i].localid = localid;
+				 		slots[i].classid = classid;
+				 		slots[i].ref = true;
+				 	}
+				 }
+				 
+				 /// Drop a single uuid.
+	void		 remove (const statstring &uuid)
+				 {
+				 	exclusivesection (index)
+				 	{
+				 		gen++;
+				 		if (index.o.exists (uuid))
+				 		{
+				 			slot &sl = slots[index.o[uuid].ival()];
+				 			sl.uuid.clear();
+				 			sl.ref = false;
+				 			index.o.rmval (uuid);
+				 			used--;
+				 		}
+				 	}
+				 }
+				 
+				 /// Drop everything.
+	void		 clear (void)
+				 {
+				 	exclusivesection (index)
+				 	{
+				 		gen++;
+				 		for (int i=0; i<DBIDCACHE_SIZE; ++i)
+				 		{
+				 			slots[i].uuid.clear();
+				 			slots[i].ref = false;
+				 		}
+				 		index.o.clear();
+				 		used = 0;
+				 	}
+				 }
+				 
+				 /// Export counters.
+	void		 stats (value &into)
+				 {
+				 	into["hits"] = hits;
+				 	into["misses"] = misses;
+				 	into["size"] = used;
+				 	into["capacity"] = DBIDCACHE_SIZE;
+				 }
+
+protected:
+	struct slot
+	{
+		statstring	 uuid; ///< Empty if the slot is free.
+		int			 localid;
+		int			 classid;
+		bool		 ref; ///< Set on access, cleared by the clock hand.
+	};
+	
+				 /// Find a slot to (re)use, must hold the lock.
+	int			 victim (void)
+				 {
+				 	while (true)
+				 	{
+				 		int i = hand;
+				 		hand = (hand+1) % DBIDCACHE_SIZE;
+				 		if (! slots[i].uuid) return i;
+				 		if (! slots[i].ref) return i;
+				 		slots[i].ref = false;
+				 	}
+				 }
+	
+	lock<value>	 index; ///< uuid to slot number.
+	slot		 slots[DBIDCACHE_SIZE];
+	int			 hand;
+	int			 used;
+	unsigned int gen;
+	unsigned int hits;
+	unsigned int misses;
+};
+
+static dbidcache idcache;
+
+//  -------------------------------------------------------------------------
+/// Everything DBManager needs to know about a registered class, decoded
+/// once from the stored definition. Never modified after it has been
+/// published; a changed definition gets a new dbclassinfo.
+//  -------------------------------------------------------------------------
+struct dbclassinfo
+{
+	int			 id; ///< Local id of the class object.
+	string		 name; ///< Class name.
+	string		 module; ///< Name of the module that registered it.
+	value		 classdata; ///< The full class definition.
+	bool		 allchildren; ///< Modules get all children with an object.
+	bool		 worldreadable; ///< Anyone may read objects of this class.
+	string		 childrendep; ///< Child class to include, or empty.
+	string		 requires; ///< Required parent class, or empty.
+	string		 uniquein; ///< Uniqueness context, or empty.
+	value		 searchfields; ///< Fields marked searchable.
+	value		 plan[6]; ///< Field actions, indexed by dbview().
+};
+
+//  -------------------------------------------------------------------------
+/// Projection plans. Who looks at an object decides what happens to its
+/// fields: another module does not get fields marked privateformodule,
+/// users get password fields tagged or blanked. Every class compiles a
+/// plan for each combination when it is loaded, holding only the fields
+/// that do not stay as they are.
+//  -------------------------------------------------------------------------
+#define DBVIEW_FOREIGN	1 ///< Drop private fields.
+#define DBVIEW_TAG		2 ///< Tag password fields with a type attribute.
+#define DBVIEW_HIDE		4 ///< Blank password fields.
+
+#define DBFIELD_DROP	1 ///< Remove the field.
+#define DBFIELD_TAG		2 ///< Mark the field as a password.
+#define DBFIELD_HIDE	3 ///< Replace the value with an empty string.
+
+/// Plan index for a viewer: formodule viewers see passwords as stored.
+static inline int dbview (bool foreign, bool formodule, bool hidepw)
+{
+	int v = foreign ? DBVIEW_FOREIGN : 0;
+	if(!formodule) v |= hidepw ? DBVIEW_HIDE : DBVIEW_TAG;
+	return v;
+}
+
+// ==========================================================================
+// FUNCTION dbproject
+// ==========================================================================
+/// Apply a projection plan to freshly decoded object content, in place.
+/// A non-empty keep list removes every field not named in it first.
+static void dbproject (value &members, const value &plan, const value &keep)
+{
+	if(keep.count())
+	{
+		for(int i = members.count() - 1; i >= 0; --i)
+		{
+			if(!keep.exists(members[i].id())) members.rmindex(i);
+		}
+	}
+	
+	foreach(step, plan)
+	{
+		if(!members.exists(step.id())) continue;
+		
+		switch(step.ival())
+		{
+			case DBFIELD_DROP:
+				members.rmval(step.id());
+				break;
+			
+			case DBFIELD_TAG:
+				members[step.id()]("type") = "password";
+				break;
+			
+			case DBFIELD_HIDE:
+				members[step.id()] = "";
+				break;
+		}
+	}
+}
+
+//  -------------------------------------------------------------------------
+/// Class registry, indexed directly by the local id of the class. A new
+/// table is built for every change and swapped in, so readers never take
+/// a lock. Old tables are not freed, since a reader may still be looking
+/// at one. Classes only change during startup or when a module is
+/// upgraded, so the leftover memory stays small.
+//  -------------------------------------------------------------------------
+struct dbclasstable
+{
+	int			  size; ///< Number of slots in byid.
+	dbclassinfo **byid; ///< Class info by local id, NULL if unknown.
+	value		  byname; ///< Class name to local id.
+};
+
+static dbclasstable *volatile classtable = NULL;
+
+/// Serializes writers of the class table.
+static lock<int> classtablewrite;
+
+//  -------------------------------------------------------------------------
+/// Direct-mapped cache of object owners, indexed by local id. Every slot
+/// packs the object id and its owner into one 64 bit word, so it can be
+/// read and replaced atomically without a lock.
+//  -------------------------------------------------------------------------
+#define DBOWNERCACHE_SIZE 16384
+
+static unsigned long long ownercache[DBOWNERCACHE_SIZE];
+
+// ==========================================================================
+// FUNCTION dbownerslot
+// ==========================================================================
+static inline unsigned long long *dbownerslot (int oid)
+{
+	return &ownercache[((unsigned int) oid) % DBOWNERCACHE_SIZE];
+}
+
+// ==========================================================================
+// FUNCTION dbownerpack
+// ==========================================================================
+static inline unsigned long long dbownerpack (int oid, int owner)
+{
+	return (((unsigned long long)(unsigned int) oid) << 32) |
+			(unsigned int) owner;
+}
+
+// ==========================================================================
+// FUNCTION dbsetowner
+// ==========================================================================
+static void dbsetowner (int oid, int owner)
+{
+	unsigned long long *slot = dbownerslot (oid);
+	unsigned long long old;
+	
+	do
+	{
+		old = __sync_fetch_and_add (slot, 0);
+	} while (! __sync_bool_compare_and_swap (slot, old,
+											 dbownerpack (oid, owner)));
+}
+
+// ==========================================================================
+// FUNCTION dbforgetowner
+// ==========================================================================
+static void dbforgetowner (int oid)
+{
+	unsigned long long *slot = dbownerslot (oid);
+	unsigned long long old = __sync_fetch_and_add (slot, 0);
+	
+	if ((int) (old >> 32) == oid)
+		__sync_bool_compare_and_swap (slot, old, 0ULL);
+}
+
+//  -------------------------------------------------------------------------
+/// Ring of recent changes to the user hierarchy. Sessions replay the
+/// entries they have not seen yet against their power set. A session
+/// that fell further behind than the ring reaches reloads its set.
+//  -------------------------------------------------------------------------
+#define DBPOWERLOG_SIZE 256
+
+struct dbpowerchange
+{
+	int			 userid; ///< The user that was created or removed.
+	int			 creator; ///< User that created it.
+	bool		 removed; ///< True if userid was removed.
+};
+
+static dbpowerchange powerlog[DBPOWERLOG_SIZE];
+static lock<unsigned int> powergen;
+
+/// Bumped whenever a class quota or the owner of an object changes;
+/// sessions throw away their effective quotas when it moves.
+static unsigned int dbquotagen = 0;
+
+/// Bumped by dosqlite() after every statement that is not a read, and
+/// after every transaction that ends; see DBManager::writeGeneration.
+static unsigned int dbwritegen = 0;
+
+// ==========================================================================
+// FUNCTION dbdropcaches
+// ==========================================================================
+/// Called when a transaction is rolled back after inner scopes already
+/// fed the caches with rows that now never existed. Rare enough to just
+/// start over: the caches refill from the database, and every session
+/// reloads its power set.
+static void dbdropcaches (void)
+{
+	idcache.clear ();
+	
+	for (int i=0; i < DBOWNERCACHE_SIZE; ++i)
+		__sync_lock_test_and_set (&ownercache[i], 0ULL);
+	
+	exclusivesection (powergen)
+	{
+		powergen.o += DBPOWERLOG_SIZE + 1;
+	}
+	
+	__sync_add_and_fetch (&dbquotagen, 1);
+	__sync_add_and_fetch (&dbwritegen, 1);
+}
+
+//  -------------------------------------------------------------------------
+/// Group commit state. Everything below is guarded by dbwriter.
+//  -------------------------------------------------------------------------
+#define DBGROUPRESULTS 64
+
+static int dbgroupwindow = 0; ///< Milliseconds to gather writers, 0 is off.
+static bool dbgroupopen = false; ///< A BEGIN is open on the writer.
+static bool dbgroupleader = false; ///< A scope is waiting to commit it.
+static unsigned int dbgroupseq = 0; ///< Number of the open or last group.
+
+/// Group results; these are guarded by dbqlock as well, scopes waiting
+/// for their group sleep on dbgroupwake.
+static unsigned int dbgroupdone = 0; ///< Last group that was committed.
+static bool dbgroupfailed[DBGROUPRESULTS]; ///< Outcome of recent groups.
+static bool dbgroupstalled = false; ///< The writer thread waits for a group.
+
+//  -------------------------------------------------------------------------
+/// A write waiting for the writer thread: a statement, or a lease on the
+/// writer connection for a transaction scope if query is NULL. Jobs live
+/// on the stack of the caller, who stays until the thread is done with
+/// them.
+//  -------------------------------------------------------------------------
+struct dbwritejob
+{
+	const DBQuery	*query; ///< The statement, NULL for a lease.
+	value			 res; ///< Query result.
+	string			 error; ///< Error text on failure.
+	int				 errorcode; ///< Error code on failure.
+	int				 state; ///< One of the DBJOB_ values below.
+	long long		 queued; ///< Time the job was queued, usecs.
+	dbwritejob		*next; ///< Queue link.
+};
+
+#define DBJOB_QUEUED	0 ///< Waiting in the queue.
+#define DBJOB_RUNNING	1 ///< Taken by the writer thread.
+#define DBJOB_DONE		2 ///< Finished, or for a lease: granted.
+
+#define DBQ_DONE		0 ///< The writer thread handled the job.
+#define DBQ_TIMEOUT		1 ///< Nobody picked the job up in time.
+#define DBQ_INLINE		2 ///< No writer thread, run it yourself.
+
+/// Statements the writer thread commits together at most.
+#define DBWRITE_BATCH 128
+
+/// Milliseconds a caller waits for its turn in the write queue.
+#define DBWRITE_TIMEOUT 10000
+
+/// Milliseconds sqlite keeps retrying on a database locked by another
+/// process, with short sleeps of its own, before reporting busy.
+#define DBBUSY_TIMEOUT 5000
+
+/// Write queue state; everything below is guarded by dbqlock.
+static pthread_mutex_t dbqlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dbqwork = PTHREAD_COND_INITIALIZER; ///< Wakes the thread.
+static pthread_cond_t dbqdone = PTHREAD_COND_INITIALIZER; ///< Wakes callers.
+static pthread_cond_t dbgroupwake = PTHREAD_COND_INITIALIZER; ///< Group done.
+static dbwritejob *dbqhead = NULL;
+static dbwritejob *dbqtail = NULL;
+static pthread_t dbqthread; ///< The writer thread, if dbqrunning.
+static bool dbqrunning = false; ///< The writer thread takes jobs.
+static bool dbqstop = false; ///< The writer thread should finish up.
+static bool dbqleased = false; ///< A scope has the writer.
+
+static unsigned int dbqdepth = 0; ///< Jobs in the queue.
+static unsigned int dbqmaxdepth = 0; ///< Highest dbqdepth seen.
+static unsigned int dbqjobs = 0; ///< Statements run.
+static unsigned int dbqbatches = 0; ///< Transactions they took.
+static unsigned int dbqleases = 0; ///< Scopes granted.
+static unsigned int dbqtimeouts = 0; ///< Jobs that gave up waiting.
+static long long dbqwaittotal = 0; ///< Total queue wait, usecs.
+static long long dbqwaitmax = 0; ///< Longest queue wait, usecs.
+
+// ==========================================================================
+// FUNCTION dbdeadline
+// ==========================================================================
+/// Absolute time ms milliseconds from now, for pthread_cond_timedwait.
+static void dbdeadline (int ms, struct timespec &until)
+{
+	struct timeval now;
+	gettimeofday (&now, NULL);
+	
+	until.tv_sec = now.tv_sec + (ms / 1000);
+	until.tv_nsec = (now.tv_usec * 1000L) + ((ms % 1000) * 1000000L);
+	if (until.tv_nsec >= 1000000000L)
+	{
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000L;
+	}
+}
+
+// ==========================================================================
+// FUNCTION dbqsubmit
+// ==========================================================================
+/// Queue a job for the writer thread. A statement is waited for until
+/// it has run, a lease until it is granted. If the thread does not get
+/// to the job within DBWRITE_TIMEOUT it is taken out of the queue again
+/// and nothing happened.
+static int dbqsubmit (dbwritejob *j)
+{
+	struct timespec until;
+	int res = DBQ_DONE;
+	
+	dbdeadline (DBWRITE_TIMEOUT, until);
+	
+	j->state = DBJOB_QUEUED;
+	j->next = NULL;
+	j->queued = dbusecnow ();
+	
+	pthread_mutex_lock (&dbqlock);
+	
+	// the writer thread runs its own writes on the spot
+	if (! dbqrunning || pthread_equal (pthread_self (), dbqthread))
+	{
+		pthread_mutex_unlock (&dbqlock);
+		return DBQ_INLINE;
+	}
+	
+	if (dbqtail) dbqtail->next = j;
+	else dbqhead = j;
+	dbqtail = j;
+	if (++dbqdepth > dbqmaxdepth) dbqmaxdepth = dbqdepth;
+	pthread_cond_signal (&dbqwork);
+	
+	while (j->state == DBJOB_QUEUED)
+	{
+		if ((pthread_cond_timedwait (&dbqdone, &dbqlock, &until) == ETIMEDOUT)
+			&& (j->state == DBJOB_QUEUED))
+		{
+			dbwritejob *prev = NULL;
+			for (dbwritejob *q = dbqhead; q != j; q = q->next) prev = q;
+			
+			if (prev) prev->next = j->next;
+			else dbqhead = j->next;
+			if (dbqtail == j) dbqtail = prev;
+			
+			dbqdepth--;
+			dbqtimeouts++;
+			res = DBQ_TIMEOUT;
+			break;
+		}
+	}
+	
+	while (j->state == DBJOB_RUNNING)
+	{
+		pthread_cond_wait (&dbqdone, &dbqlock);
+	}
+	
+	pthread_mutex_unlock (&dbqlock);
+	return res;
+}
+
+// ==========================================================================
+// FUNCTION dbqrelease
+// ==========================================================================
+/// Hand a leased writer back to the writer thread. A group leader
+/// waiting for the queue to drain is woken up as well.
+static void dbqrelease (void)
+{
+	pthread_mutex_lock (&dbqlock);
+	dbqleased = false;
+	pthread_cond_signal (&dbqwork);
+	pthread_cond_broadcast (&dbqdone);
+	pthread_mutex_unlock (&dbqlock);
+}
+
+// ==========================================================================
+// FUNCTION dbpublishclass
+// ==========================================================================
+static void dbpublishclass (dbclassinfo *ci)
+{
+	exclusivesection (classtablewrite)
+	{
+		dbclasstable *old = classtable;
+		dbclasstable *t = new dbclasstable;
+		
+		t->size = (old && old->size > ci->id) ? old->size : ci->id + 64;
+		t->byid = new dbclassinfo* [t->size];
+		memset (t->byid, 0, t->size * sizeof (dbclassinfo *));
+		
+		if (old)
+		{
+			memcpy (t->byid, old->byid, old->size * sizeof (dbclassinfo *));
+			t->byname = old->byname;
+		}
+		
+		t->byid[ci->id] = ci;
+		t->byname[ci->name] = ci->id;
+		
+		// make sure the table is complete before anyone can see it
+		__sync_synchronize ();
+		classtable = t;
+	}
+}
+
+// ==========================================================================
+// FUNCTION dbopenconnection
+// ==========================================================================
+static dbconnection *dbopenconnection (const string &path, string &err)
+{
+	dbconnection *c = new dbconnection;
+	memset (c, 0, sizeof (dbconnection));
+	
+	// Every connection is only used by one thread at a time, so sqlite
+	// does not have to do its own locking on it.
+	if (sqlite3_open_v2 (path.str(), &c->h, SQLITE_OPEN_READWRITE |
+						 SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX,
+						 NULL) != SQLITE_OK)
+	{
+		err = "sqlite3_open(%s) failed: %s" %format (path,
+												sqlite3_errmsg (c->h));
+		sqlite3_close (c->h);
+		delete c;
+		return NULL;
+	}
+	
+	sqlite3_exec (c->h, "PRAGMA temp_store=MEMORY", NULL, NULL, NULL);
+	sqlite3_busy_timeout (c->h, DBBUSY_TIMEOUT);
+	
+	// updateObject rewrites rows with REPLACE, which only fires the
+	// delete triggers on the replaced row with this switched on.
+	sqlite3_exec (c->h, "PRAGMA recursive_triggers=ON", NULL, NULL, NULL);
+	sqlite3_trace (c->h, _dbmanager_sqlite3_trace_rcvr, NULL);
+	return c;
+}
+
+// ==========================================================================
+// FUNCTION dbisreadquery
+// ==========================================================================
+static bool dbisreadquery (const char *query)
+{
+	while (isspace (*query)) query++;
+	return (strncasecmp (query, "SELECT", 6) == 0);
+}
+
 void _dbmanager_sqlite3_trace_rcvr(void *ignore, const char *query)
 {
 	CORE->log (log::debug, "DB", "sqlite3_trace: %s", query);
@@ -53,6 +1080,12 @@ DBManager::DBManager (void)
 	errorcode = 0;
 	god = false;
 	useruuid = "";
+	txdepth = 0;
+	txfailed = false;
+	txnested = false;
+	txgroup = 0;
+	txleased = false;
+	quotagen = 0;
 }
 
 DBManager::~DBManager (void)
@@ -62,33 +1095,47 @@ DBManager::~DBManager (void)
 
 bool DBManager::init (const char *dbfile)
 {
-    exclusivesection (dbhandle)
+    exclusivesection (dbwriter)
     {
         if(!dbinitdone)
         {
-            if(sqlite3_open(dbfile, &dbhandle) != SQLITE_OK)
+        	string err;
+        	
+        	dbwriter.o = dbopenconnection (dbfile, err);
+            if(! dbwriter.o)
         	{
         		// FIXME: need consistent reporting upwards
-        		lasterror = "sqlite3_open(%s) failed: %s" %format (dbfile, sqlite3_errmsg(dbhandle));
+        		lasterror = err;
         		errorcode = ERR_DBMANAGER_INITFAIL;
-        		sqlite3_close(dbhandle);
-        		dbhandle = NULL;
-        		return false;
+        		breaksection return false;
         	}
+        	
+        	// In WAL mode readers do not block the writer and the writer
+        	// does not block readers. The setting is persistent in the
+        	// database file, so the reader connections opened later pick
+        	// it up on their own.
+        	sqlite3_exec (dbwriter.o->h, "PRAGMA journal_mode=WAL",
+        				  NULL, NULL, NULL);
 
         	if(!checkschema())
         	{
         		lasterror="Schema error on db init!";
         		errorcode = ERR_DBMANAGER_INITFAIL;
-        		return false;
+        		breaksection return false;
         	}
-        	sqlite3_trace(dbhandle, _dbmanager_sqlite3_trace_rcvr, NULL);
 
         	schema.load("schema:sqlite.compact.schema.xml");
+        	dbpath = dbfile;
             dbinitdone = true;
+            
+            // readers can be used from here on
+            if(!loadclassregistry())
+            {
+            	errorcode = ERR_DBMANAGER_INITFAIL;
+            	breaksection return false;
+            }
         }
     }
-    value v = dosqlite("PRAGMA temp_store=MEMORY");
     return true;
 }
 
@@ -98,16 +1145,64 @@ void DBManager::deinit ()
     // sqlite3_close(dbhandle);
 }
 
+// ==========================================================================
+// METHOD DBManager::acquirereader
+// ==========================================================================
+dbconnection *DBManager::acquirereader (void)
+{
+	dbconnection *c = NULL;
+	string err;
+	
+	// Inside a transaction scope reads have to see the scope's own
+	// writes, so they use the writer connection we already hold.
+	if (txdepth) return dbwriter.o;
+	
+	exclusivesection (dbreaders)
+	{
+		c = dbreaders.o;
+		if (c) dbreaders.o = c->next;
+	}
+	
+	if (c) return c;
+	
+	// No idle connection, open a fresh one. The pool grows up to the
+	// number of threads that query concurrently.
+	c = dbopenconnection (dbpath, err);
+	if (! c)
+	{
+		lasterror = err;
+		errorcode = ERR_DBMANAGER_FAILURE;
+		return NULL;
+	}
+	
+	__sync_fetch_and_add (&dbreadercount, 1);
+	CORE->log (log::debug, "DB", "Opened reader connection #%i",
+			   dbreadercount);
+	return c;
+}
+
+// ==========================================================================
+// METHOD DBManager::releasereader
+// ==========================================================================
+void DBManager::releasereader (dbconnection *c)
+{
+	if (c == dbwriter.o) return;
+	
+	exclusivesection (dbreaders)
+	{
+		c->next = dbreaders.o;
+		dbreaders.o = c;
+	}
+}
+
 string *DBManager::findParent (const statstring &uuid)
 {
 	returnclass (string) res retain;
 
-	string query = "SELECT /* findParent */ parent FROM objects WHERE ";
-	value where;
-	where["uuid"]=uuid;
-	query.strcat(escapeforsql("=", " AND ", where));
+	DBQuery query ("SELECT /* findParent */ parent FROM objects WHERE uuid=");
+	query.arg(uuid.sval());
 	value dbres = dosqlite(query);
-	CORE->log(log::debug, "DB", "findParent SQL: %s" %format (query));
+	CORE->log(log::debug, "DB", "findParent SQL: %s" %format (query.text));
 	if(!dbres["rows"].count())
 	{
 		lasterror = "Object not found in findParent";
@@ -123,9 +1218,9 @@ string *DBManager::findParent (const statstring &uuid)
         res.clear();
         return &res;
     }
-	query = "";
-	query.printf("SELECT /* findParent */ uuid FROM objects WHERE id=%d", dbres["rows"][0]["parent"].ival());
-	dbres=dosqlite(query);
+	DBQuery pquery ("SELECT /* findParent */ uuid FROM objects WHERE id=");
+	pquery.arg(dbres["rows"][0]["parent"].ival());
+	dbres=dosqlite(pquery);
 	if(!dbres["rows"].count())
 	{
 		lasterror = "Parent object not found; unpossible!";
@@ -141,7 +1236,7 @@ string *DBManager::findParent (const statstring &uuid)
 string *DBManager::findObject (const statstring &parent, const statstring &ofclass, const statstring &withuuid, const statstring &withmetaid)
 {
 	returnclass (string) res retain;
-	string query;
+	DBQuery query;
 	value where;
 	int classid;
 	
@@ -158,7 +1253,7 @@ string *DBManager::findObject (const statstring &parent, const statstring &ofcla
 		return &res;
 	}
 
-	query="SELECT /* findObject */ id, uuid FROM objects WHERE ";
+	query.add("SELECT /* findObject */ id, uuid FROM objects WHERE ");
 	if(classid)
 		where["class"]=classid;
 	// FIXME: this bool, bool, compare to "" stuff is retarded
@@ -174,7 +1269,7 @@ string *DBManager::findObject (const statstring &parent, const statstring &ofcla
         return &res;
 	}
 	
-	query.strcat(escapeforsql("=", " AND ", where));
+	query.fields(" AND ", where);
   // CORE->log(log::debug, "DB", "findObject: classid: %d" %format (classid));
 	value v = dosqlite(query);
 	// DEBUG.storeFile("DB", "dbres", v, "findObject");
@@ -237,7 +1332,7 @@ bool DBManager::listObjectTree (value &into, const statstring &uuid)
 
 bool DBManager::_listObjectTree (value &into, int localid)
 {
-	string query;
+	DBQuery query;
 	
 	if(!localid)
 	{
@@ -245,172 +1340,554 @@ bool DBManager::_listObjectTree (value &into, int localid)
 		errorcode = ERR_DBMANAGER_INVAL;
 		return false;
 	}
-    query.printf("SELECT /* _listObjectTree */ id, uuid FROM objects WHERE (parent=%d OR owner=%d)", localid, localid);
-	value qres = dosqlite(query);
-	if(!qres)
+    query.add("SELECT /* _listObjectTree */ id, uuid FROM objects WHERE (parent=").arg(localid);
+    query.add(" OR owner=").arg(localid).add(")");
+	DBCursor cur (*this);
+	if(!cur.open(query))
 		return false;
 
-	foreach(row, qres["rows"])
+	while(cur.next())
 	{
-		if(!_listObjectTree(into, row["id"].ival()))
+		if(!_listObjectTree(into, cur.ival(0)))
 			return false;
 		
-		into.newval() = row["uuid"];
+		into.newval() = cur.cval(1);
 	}
 	
-	return true;
+	return !cur.failed();
 }
 
-bool DBManager::listObjects (value &into, const statstring &parent, const value &ofclass, bool formodule, int count, int offset)
+bool DBManager::listObjects (value &into, const statstring &parent, const value &ofclass, bool formodule, int count, int offset, const value &whitelist)
 {
-	value where;
-
-	if(parent != nokey && parent != "")
-	{
-	    where["o.parent"]=findlocalid(parent);
-	}
-	else
+	bool usemirror;
+	DBQuery access;
+	_listaccess(access, usemirror);
+	
+    // TODO: check that this doesn't return objects more than once, like getquotausage did before opencore@3c2367c81cb6
+	DBQuery base ("SELECT /* listObjects */ o.id id, o.class class, o.content content, o.metaid metaid, o.uuid uuid, o.parent parent, o2.uuid parentuuid, o3.uuid owneruuid, o3.metaid ownermetaid FROM ");
+	if(usemirror)
+		base.add("powermirror p, ");
+	base.add("objects o LEFT JOIN objects o2 ON o.parent=o2.id LEFT JOIN objects o3 ON o.owner=o3.id WHERE ");
+	base.add(access);
+	
+	DBQuery tail;
+	_listscope(tail, parent, ofclass);
+	tail.add(" ORDER BY o.metaid, o.id LIMIT ").arg(offset).add(",").arg(count);
+	
+	value keep;
+	foreach(w, whitelist) keep[w.sval()] = true;
+	
+	if(!_listObjectLevel(into, base, tail, emptyvalue, formodule, NULL, keep))
+		return false;
+	
+  // DEBUG.storeFile("DB", "res", into, "listObjects");
+	
+	return true;
+}
+
+// ==========================================================================
+// METHOD DBManager::listObjectPage
+// ==========================================================================
+bool DBManager::listObjectPage (value &into, const statstring &parent,
+								const value &ofclass, int count,
+								const string &after, string &next,
+								const value &whitelist)
+{
+	bool usemirror;
+	DBQuery access;
+	_listaccess(access, usemirror);
+	
+	DBQuery base ("SELECT /* listObjectPage */ o.id id, o.class class, o.content content, o.metaid metaid, o.uuid uuid, o.parent parent, o2.uuid parentuuid, o3.uuid owneruuid, o3.metaid ownermetaid FROM ");
+	if(usemirror)
+		base.add("powermirror p, ");
+	base.add("objects o LEFT JOIN objects o2 ON o.parent=o2.id LEFT JOIN objects o3 ON o.owner=o3.id WHERE ");
+	base.add(access);
+	
+	DBQuery tail;
+	_listscope(tail, parent, ofclass);
+	
+	// The token is the hex encoded "id:metaid" of the last row handed
+	// out, or just "id" if that row had no metaid. NULL metaids sort
+	// first, so everything with a metaid comes after them.
+	if(after.strlen())
+	{
+		string key = dbhexdecode(after);
+		int lastid = ::atoi(key.str());
+		if(lastid <= 0)
+		{
+			lasterror = "Invalid continuation token";
+			errorcode = ERR_DBMANAGER_INVAL;
+			return false;
+		}
+		
+		int sep = key.strchr(':');
+		if(sep < 0)
+		{
+			tail.add(" AND (o.metaid IS NOT NULL OR o.id>").arg(lastid);
+			tail.add(")");
+		}
+		else
+		{
+			string metaid = key.mid(sep+1);
+			tail.add(" AND (o.metaid>").arg(metaid);
+			tail.add(" OR (o.metaid=").arg(metaid);
+			tail.add(" AND o.id>").arg(lastid).add("))");
+		}
+	}
+	
+	tail.add(" ORDER BY o.metaid, o.id LIMIT ").arg(count);
+	
+	value keep;
+	foreach(w, whitelist) keep[w.sval()] = true;
+	
+	value page;
+	if(!_listObjectLevel(into, base, tail, emptyvalue, false, &page, keep))
+		return false;
+	
+	// a short page is the last one
+	next.crop();
+	if(count >= 0 && page["rows"].ival() >= count)
+		next = page["last"].sval();
+	
+	return true;
+}
+
+// ==========================================================================
+// METHOD DBManager::countObjects
+// ==========================================================================
+int DBManager::countObjects (const statstring &parent, const value &ofclass)
+{
+	bool usemirror;
+	DBQuery access;
+	_listaccess(access, usemirror);
+	
+	DBQuery query ("SELECT /* countObjects */ COUNT(DISTINCT o.id) FROM ");
+	if(usemirror)
+		query.add("powermirror p, ");
+	query.add("objects o WHERE ");
+	query.add(access);
+	_listscope(query, parent, ofclass);
+	
+	DBCursor cur (*this);
+	if(!cur.open(query) || !cur.next())
+		return -1;
+	
+	return cur.ival(0);
+}
+
+// ==========================================================================
+// METHOD DBManager::isSearchable
+// ==========================================================================
+bool DBManager::isSearchable (const statstring &ofclass, const statstring &field)
+{
+	if(field == "id" || field == "metaid")
+		return true;
+	
+	const dbclassinfo *ci = getclassinfo(findclassid(ofclass));
+	return ci && ci->searchfields.exists(field);
+}
+
+// ==========================================================================
+// METHOD DBManager::searchObjects
+// ==========================================================================
+bool DBManager::searchObjects (value &into, const statstring &parent,
+							   const statstring &ofclass,
+							   const statstring &field, const string &text,
+							   dbsearchmode mode, int count, int offset)
+{
+	bool usemirror;
+	DBQuery access;
+	_listaccess(access, usemirror);
+	
+	DBQuery base ("SELECT /* searchObjects */ o.id id, o.class class, o.content content, o.metaid metaid, o.uuid uuid, o.parent parent, o2.uuid parentuuid, o3.uuid owneruuid, o3.metaid ownermetaid FROM ");
+	if(usemirror)
+		base.add("powermirror p, ");
+	base.add("objects o LEFT JOIN objects o2 ON o.parent=o2.id LEFT JOIN objects o3 ON o.owner=o3.id WHERE ");
+	base.add(access);
+	
+	DBQuery tail;
+	_listscope(tail, parent, $(ofclass));
+	if(!_searchfilter(tail, ofclass, field, text, mode))
+	{
+		lasterror = "Field is not searchable";
+		errorcode = ERR_DBMANAGER_INVAL;
+		return false;
+	}
+	tail.add(" ORDER BY o.metaid, o.id LIMIT ").arg(offset).add(",").arg(count);
+	
+	return _listObjectLevel(into, base, tail, emptyvalue, false, NULL);
+}
+
+// ==========================================================================
+// METHOD DBManager::countSearch
+// ==========================================================================
+int DBManager::countSearch (const statstring &parent, const statstring &ofclass,
+							const statstring &field, const string &text,
+							dbsearchmode mode)
+{
+	bool usemirror;
+	DBQuery access;
+	_listaccess(access, usemirror);
+	
+	DBQuery query ("SELECT /* countSearch */ COUNT(DISTINCT o.id) FROM ");
+	if(usemirror)
+		query.add("powermirror p, ");
+	query.add("objects o WHERE ");
+	query.add(access);
+	_listscope(query, parent, $(ofclass));
+	if(!_searchfilter(query, ofclass, field, text, mode))
+		return -1;
+	
+	DBCursor cur (*this);
+	if(!cur.open(query) || !cur.next())
+		return -1;
+	
+	return cur.ival(0);
+}
+
+// ==========================================================================
+// METHOD DBManager::_searchfilter
+// ==========================================================================
+bool DBManager::_searchfilter (DBQuery &into, const statstring &ofclass,
+								const statstring &field,
+								const string &text, dbsearchmode mode)
+{
+	if(!isSearchable(ofclass, field))
+		return false;
+	
+	// Prefix and substring matches are LIKE patterns, which ignore case.
+	string pattern;
+	if(mode == DBSEARCH_EXACT)
+	{
+		pattern = text;
+	}
+	else
+	{
+		if(mode == DBSEARCH_SUBSTRING) pattern.strcat('%');
+		for(unsigned int i=0; i<text.strlen(); ++i)
+		{
+			if(text[i] == '%' || text[i] == '_' || text[i] == '\\')
+				pattern.strcat('\\');
+			pattern.strcat(text[i]);
+		}
+		pattern.strcat('%');
+	}
+	
+	if(field == "id" || field == "metaid")
+	{
+		// rows without a metaid are listed by their uuid
+		into.add(" AND (");
+		dbsearchcond(into, "o.metaid", pattern, mode);
+		if(field == "id")
+		{
+			into.add(" OR ((o.metaid IS NULL OR o.metaid='') AND ");
+			dbsearchcond(into, "o.uuid", pattern, mode);
+			into.add(")");
+		}
+		into.add(")");
+		return true;
+	}
+	
+	into.add(" AND o.id IN (SELECT objectid FROM searchkeys WHERE field=");
+	into.arg(field.sval());
+	into.add(" AND ");
+	dbsearchcond(into, "searchkey", pattern, mode);
+	into.add(")");
+	
+	return true;
+}
+
+// ==========================================================================
+// METHOD DBManager::_indexsearch
+// ==========================================================================
+bool DBManager::_indexsearch (int localid, int classid, const value &members)
+{
+	const dbclassinfo *ci = getclassinfo(classid);
+	if(!ci || !ci->searchfields.count())
+		return true;
+	
+	DBQuery dquery ("DELETE /* _indexsearch */ FROM searchkeys WHERE objectid=");
+	dquery.arg(localid);
+	if(!dosqlite(dquery))
+		return false;
+	
+	DBQuery query ("INSERT /* _indexsearch */ INTO searchkeys (objectid, field, searchkey) VALUES ");
+	int n = 0;
+	foreach(field, ci->searchfields)
+	{
+		if(!members.exists(field.id())) continue;
+		if(n++) query.add(",");
+		query.add("(").arg(localid).add(",").arg(field.id().sval());
+		query.add(",").arg(members[field.id()].sval()).add(")");
+	}
+	
+	if(!n) return true;
+	return dosqlite(query);
+}
+
+// ==========================================================================
+// METHOD DBManager::_reindexclass
+// ==========================================================================
+bool DBManager::_reindexclass (int classid)
+{
+	const dbclassinfo *ci = getclassinfo(classid);
+	if(!ci) return false;
+	
+	CORE->log(log::info, "DB", "Indexing search fields of class %s"
+			  %format (ci->name));
+	
+	if(!begin())
+		return false;
+	
+	DBQuery query ("DELETE /* _reindexclass */ FROM searchkeys WHERE objectid IN (SELECT id FROM objects WHERE class=");
+	query.arg(classid).add(")");
+	if(!dosqlite(query))
+	{
+		rollback();
+		return false;
+	}
+	
+	DBQuery squery ("SELECT /* _reindexclass */ id, content FROM objects WHERE class=");
+	squery.arg(classid).add(" AND content!=''");
+	
+	DBCursor cur (*this);
+	if(!cur.open(squery))
+	{
+		rollback();
+		return false;
+	}
+	
+	while(cur.next())
+	{
+		if(!_indexsearch(cur.ival(0), classid, deserialize(cur.sval(1))))
+		{
+			cur.close();
+			rollback();
+			return false;
+		}
+	}
+	
+	if(cur.failed())
+	{
+		rollback();
+		return false;
+	}
+	
+	cur.close();
+	return commit();
+}
+
+// ==========================================================================
+// METHOD DBManager::_listaccess
+// ==========================================================================
+void DBManager::_listaccess (DBQuery &into, bool &usemirror)
+{
+	// With a reasonably sized power set the permission check becomes a
+	// plain IN list on the owner and powermirror is left out entirely.
+	bool usepowerset = false;
+	int uid = 0;
+	if(!god)
+	{
+		uid = findlocalid (useruuid);
+		if(uid && uid == powerset.userid)
+		{
+			syncpowerset();
+			usepowerset = (powerset.count() <= 512);
+		}
+	}
+	
+	// The ids of the power set are our own integers and go into the
+	// text, binding a list that size would only add work.
+	usemirror = !usepowerset;
+	if(usepowerset)
+	{
+		string owners;
+		for(int i=0; i<powerset.count(); ++i)
+		{
+			if(i) owners.strcat(",");
+			owners.printf("%d", powerset[i]);
+		}
+		into.add("(o.owner IN (").add(owners).add(") OR o.id=").arg(uid);
+		into.add(")");
+	}
+	else
+	{
+		into.add("(o.owner=p.userid OR o.id=p.powerid)");
+		if(!god)
+			into.add(" AND p.powerid=").arg(uid);
+	}
+	into.add(" AND o.content!=''");
+}
+
+// ==========================================================================
+// METHOD DBManager::_listscope
+// ==========================================================================
+void DBManager::_listscope (DBQuery &into, const statstring &parent,
+							const value &ofclass)
+{
+	if(parent != nokey && parent != "")
+	{
+	    into.add(" AND o.parent=").arg(findlocalid(parent));
+	}
+	else
 	{
 	    if (ofclass == nokey)
 	    {
-            where["o.parent"]=0;
+            into.add(" AND o.parent=0");
         }
 	}
-		
-	if(!god)
-        where["p.powerid"]=findlocalid (useruuid);
-
-    // TODO: check that this doesn't return objects more than once, like getquotausage did before opencore@3c2367c81cb6
-	string query="SELECT /* listObjects */ o.id id, o.class class, o.content content, o.metaid metaid, o.uuid uuid, o.owner ownerid, o2.uuid parentuuid, o3.uuid owneruuid FROM powermirror p, objects o LEFT JOIN objects o2 ON o.parent=o2.id LEFT JOIN objects o3 ON o.owner=o3.id WHERE (o.owner=p.userid OR o.id=p.powerid) AND o.content!='' AND ";
-	query.strcat(escapeforsql("=", " AND ", where));
+	
 	if (ofclass != nokey)
     {
-        query.strcat(" AND o.class IN(");
-        bool firstiter=true;
+        string classids;
     	foreach (classname, ofclass)
     	{
-    	    if(firstiter)
-    			firstiter = false;
-    		else
-    			query.strcat(",");
+    	    if(classids.strlen())
+    			classids.strcat(",");
 			
-        	if(ofclass != nokey && ofclass != "")
-                query.strcat("%d" %format (findclassid(ofclass)));
+            classids.printf("%d", findclassid(classname));
     	}
 
-        query.strcat(" )");
+        into.add(" AND o.class IN(").add(classids).add(" )");
     }
-    
-	query.printf(" ORDER BY o.metaid LIMIT %d,%d", offset, count);
-	value dbres = dosqlite(query); // FIXME: handle failure
-    // value childclasses;
-    // if(!formodule)
-    // {
-    //  query="SELECT /* listObjects */ o.id id, o3.metaid childclass FROM powermirror p, objects o, objects o2, objects o3 WHERE o.id=o2.parent AND o2.class=o3.id AND ";
-    //         where.rmval("p.powerid");
-    //  query.strcat(escapeforsql("=", " AND ", where));
-    //  value ccres = dosqlite(query);
-    //  foreach(row, ccres["rows"])
-    //  {
-    //      childclasses[row["id"]][row["childclass"]] = 1;
-    //  }
-    // }
-//	res=dbres["rows"];
-	foreach(row, dbres["rows"])
+}
+
+// ==========================================================================
+// METHOD DBManager::_listObjectLevel
+// ==========================================================================
+bool DBManager::_listObjectLevel (value &level, const DBQuery &base,
+								  const DBQuery &tail, const value &wanted,
+								  bool formodule, value *page,
+								  const value &keep)
+{
+	// column order of the listObjects query
+	enum { LO_ID, LO_CLASS, LO_CONTENT, LO_METAID, LO_UUID, LO_PARENT,
+		   LO_PARENTUUID, LO_OWNERUUID, LO_OWNERMETAID };
+	
+	// At the top level rows go straight into level, below it they are
+	// grouped by the local id of their parent.
+	bool byparent = wanted.count();
+	value expand;
+	value nextwanted;
+	
+	DBQuery query = base;
+	query.add(tail);
+	
+	DBCursor cur (*this);
+	if(!cur.open(query))
+		return false;
+	
+	while(cur.next())
 	{
-		value resrow;
-        // this checking has been moved to an sql join; 
-        // TODO: that join does deny access to worldreadable classes, however.
-        // if(formodule)
-        // {
-        //  // OK!
-        // }
-        // else if(classhasattrib(row["class"].ival(), "worldreadable"))
-        // {
-        //  // OK!
-        // }
-        // else
-        // {
-        //  CORE->log(log::debug, "DB", "(%s) listObjects: not owner or no class rights, skipping object %d", DEBUG.uuid().cval(), row["id"].ival());
-        //  continue;
-        // }
-
-		int localclassid = row["class"].ival();
-		if(formodule)
-		{
-			value tmpv;
-			tmpv=deserialize(row["content"]);
-
-			resrow = tmpv;
-		}
-		else
-		{	
-		    if(god)
-                resrow=deserialize(row["content"]);
-			else
-			    resrow=hidepasswords(deserialize(row["content"]), row["class"]);
+		int localclassid = cur.ival(LO_CLASS);
+		const dbclassinfo *ci = getclassinfo(localclassid);
+		if(!ci) continue; // FIXME: handle failure
+		const string &classname = ci->name;
+		
+		// remember the key of the last row for a continuation token
+		if(page)
+		{
+			string key = "%i" %format (cur.ival(LO_ID));
+			if(!cur.isnull(LO_METAID))
+			{
+				key.strcat(':');
+				key.strcat(cur.cval(LO_METAID));
+			}
+			(*page)["last"] = dbhexencode(key);
+			(*page)["rows"] = (*page)["rows"].ival() + 1;
 		}
 		
-		resrow("type")="object";
-		resrow["class"]=_classNameFromUUID(row["class"]); // FIXME: handle failure
-		resrow["uuid"]=row["uuid"];
-		if(row["parentuuid"].sval().strlen())
-			resrow["parentid"]=row["parentuuid"];
-		if(row["owneruuid"].sval().strlen())
+		statstring pkey = cur.cval(LO_PARENT);
+		if(byparent)
 		{
-			resrow["ownerid"]=row["owneruuid"];
-			resrow["owner-metaid"]=_findmetaid(row["ownerid"]);
+			// a childrendep parent only wants the one class
+			const string &dep = wanted[pkey].sval();
+			if(dep.strlen() && dep != classname)
+				continue;
 		}
 		
-		if(row["metaid"].sval().strlen())
+		const char *metaid = cur.cval(LO_METAID);
+		string uuid = cur.cval(LO_UUID);
+		string idkey = *metaid ? metaid : uuid.str();
+		
+		value &container = byparent ? level[pkey] : level;
+		
+		// build the row in place, without a temporary copy
+		value &resrow = container[classname][idkey];
+		
+		resrow = deserialize(cur.sval(LO_CONTENT));
+		dbproject(resrow, ci->plan[dbview(false, formodule || god, true)],
+				  keep);
+		
+		resrow("type")="object";
+		resrow["class"]=classname;
+		resrow["uuid"]=uuid;
+		if(*cur.cval(LO_PARENTUUID))
+			resrow["parentid"]=cur.cval(LO_PARENTUUID);
+		if(*cur.cval(LO_OWNERUUID))
 		{
-			resrow["id"]=row["metaid"];
-			resrow["metaid"]=row["metaid"];
+			resrow["ownerid"]=cur.cval(LO_OWNERUUID);
+			resrow["owner-metaid"]=cur.cval(LO_OWNERMETAID);
 		}
-		else
+		
+		resrow["id"]=idkey;
+		if(*metaid)
 		{
-			resrow["id"]=row["uuid"];
+			resrow["metaid"]=metaid;
 		}
 
-        // if(!formodule)
-        // {
-        //  resrow["childclasses"] = childclasses[row["id"]];
-        // }
-		into[resrow["class"]][resrow["id"]]=resrow;
-		into[resrow["class"]]("type")="class";
+		container[classname]("type")="class";
 		
-		if(formodule && classhasattrib(row["class"].ival(), "allchildren"))
-		{	
-      // CORE->log(log::debug, "DB", "listObjects: doing "
-      //      "allchildren (%s)" %format (row["uuid"]));
-			value mergev;
-			if(listObjects(mergev, row["uuid"], nokey, formodule))
-			{
-				into[resrow["class"]][resrow["id"]] << mergev;
-			}
-			else
-			{
-				return false;
-			}
-		}
-		if(formodule && classhasattrib(row["class"].ival(), "childrendep"))
-		{	
-			string depclass = classgetattrib(row["class"].ival(), "childrendep");
-      // CORE->log(log::debug, "DB", "listObjects: doing childrendep "
-      //      "(%s, %s)" %format (depclass, row["uuid"]));
-			value mergev;
-			if(listObjects(mergev, row["uuid"], $(depclass), formodule))
-			{
-				into[resrow["class"]][resrow["id"]] << mergev;
-			}
-			else
-			{
-				return false;
-			}
+		// Children are not fetched here, one query per row is exactly
+		// what made module listings slow. Remember where they go and
+		// get the whole next level at once.
+		if(formodule && (ci->allchildren || ci->childrendep.strlen()))
+		{
+			statstring okey = cur.cval(LO_ID);
+			value &e = expand.newval();
+			e["pkey"] = pkey;
+			e["class"] = classname;
+			e["id"] = idkey;
+			e["okey"] = okey;
+			
+			nextwanted[okey] = ci->allchildren ? "" : ci->childrendep.str();
 		}
 	}
 	
-  // DEBUG.storeFile("DB", "res", into, "listObjects");
+	if(cur.failed())
+		return false;
+	
+	cur.close();
+	
+	if(!expand.count())
+		return true;
+	
+	// local ids straight from the cursor, no need to bind them
+	DBQuery nexttail (" AND o.parent IN(");
+	bool firstiter = true;
+	foreach(w, nextwanted)
+	{
+		if(firstiter)
+			firstiter = false;
+		else
+			nexttail.add(",");
+		
+		nexttail.add(w.id().sval());
+	}
+	nexttail.add(") ORDER BY o.metaid");
+	
+	value next;
+	if(!_listObjectLevel(next, base, nexttail, nextwanted, formodule, NULL))
+		return false;
+	
+	foreach(e, expand)
+	{
+		if(!next.exists(e["okey"].sval()))
+			continue;
+		
+		value &container = byparent ? level[e["pkey"].sval()] : level;
+		container[e["class"].sval()][e["id"].sval()] << next[e["okey"].sval()];
+	}
 	
 	return true;
 }
@@ -418,11 +1895,17 @@ bool DBManager::listObjects (value &into, const statstring &parent, const value
 statstring *DBManager::classNameFromUUID(const statstring &uuid)
 {
 	returnclass (statstring) res retain;
+	int classid;
 	
-	string query="SELECT /* classNameFromUUID */ class,metaid FROM objects WHERE ";
-	value where;
-	where["uuid"]=uuid;
-	query.strcat(escapeforsql("=", " AND ", where));
+	// Objects other than class definitions resolve through the id cache.
+	if(findlocalid(uuid, &classid) && classid != 1)
+	{
+		res = _classNameFromUUID(classid);
+		return &res;
+	}
+	
+	DBQuery query ("SELECT /* classNameFromUUID */ class,metaid FROM objects WHERE uuid=");
+	query.arg(uuid.sval());
 	value dbres=dosqlite(query);
 	if(!dbres)
 	{
@@ -457,7 +1940,8 @@ statstring *DBManager::classNameFromUUID(const statstring &uuid)
 // done!
 // NOTE: CoreSession absolutely relies on into[0] being the object the request
 // actually pointed to
-bool DBManager::fetchObject (value &into, const statstring &uuid, bool formodule)
+bool DBManager::fetchObject (value &into, const statstring &uuid, bool formodule,
+							 bool hidepasswords)
 {
 	int localid;
 	string module="";
@@ -473,26 +1957,49 @@ bool DBManager::fetchObject (value &into, const statstring &uuid, bool formodule
 		return false;
 	}
 
+	// column order of the HQ_FETCHOBJECT and HQ_FETCHCHAIN statements
+	enum { FO_CLASS, FO_PARENT, FO_CONTENT, FO_METAID, FO_UUID, FO_OWNER,
+		   FO_PARENTUUID, FO_OWNERUUID, FO_OWNERMETAID };
+
+	// For a module the whole ancestor chain comes back in one query,
+	// nearest first, so walking up is just reading the next row.
+	DBCursor cur (*this);
+	if(!cur.open(formodule ? HQ_FETCHCHAIN : HQ_FETCHOBJECT, $(localid)))
+	{
+		into.clear();
+		return false;
+	}
+	
+	// children listings are done after the chain is read
+	value expand;
+
 	while(1)
 	{
 		// if this object's class has a required-attribute, recurse upwards
 		// and check it.
-		string query;
-        query.printf("SELECT /* fetchObject */ o.class class, o.parent parent, o.content content, o.metaid metaid, o.uuid uuid, o.owner owner, o2.uuid parentuuid, o3.uuid owneruuid FROM objects o LEFT JOIN objects o2 ON o.parent=o2.id LEFT JOIN objects o3 ON o.owner=o3.id WHERE o.id=%d", localid);
-
-		value dbres = dosqlite(query);
-		if(!dbres["rows"].count())
+		if(!cur.next())
+		{
+			if(!cur.failed())
+			{
+				errorcode = ERR_DBMANAGER_NOTFOUND;
+				lasterror = "Object (localid=%i) not found while "
+							"recursing upwards" %format (localid);
+			}
+			into.clear();
+			return false;
+		}
+		
+		int classid = cur.ival(FO_CLASS);
+		int parentid = cur.ival(FO_PARENT);
+		const dbclassinfo *ci = getclassinfo(classid);
+		if(!ci)
 		{
 			errorcode = ERR_DBMANAGER_NOTFOUND;
-			lasterror = "Object (localid=%i) not found while "
-						"recursing upwards" %format (localid);
+			lasterror = "Class (localid=%i) not found" %format (classid);
 			into.clear();
 			return false;
 		}
-		value row=dbres["rows"][0];
-		// DEBUG.storeFile("DB", "objectrow", row, "fetchObject");
-
-		string id = _classNameFromUUID(row["class"]);
+		const string &id = ci->name;
 		
 		if(reqclass && reqclass != id)
 		{
@@ -502,130 +2009,76 @@ bool DBManager::fetchObject (value &into, const statstring &uuid, bool formodule
 			return false;
 		}
 
-		// query.crop();
-		// query.printf("SELECT /* fetchObject */ content FROM objects WHERE id=%d", row["class"].ival());
-		// value classdbres = dosqlite(query);
-		// value classdata;
-		// classdata.fromxml(classdbres["rows"][0]["content"].sval());
-		value classdata = getClassData(row["class"].ival());
-		// DEBUG.storeFile("DB", "classdata", classdata, "fetchObject");
-		
 		// stick it to me!
 		// because class A cannot require class B, indexing on classname
 		// here should be completely safe
 		// FIXME: check access
-		if(module == classdata("modulename").sval())
-		{	
-			if(formodule)
-			{
-				value tmp=deserialize(row["content"]);
-					into[id]=tmp;
-				}
-				else
-				{
-				into[id]=hidepasswords(deserialize(row["content"]), row["class"], true);
-			}
-		}
-		else
-		{
-			if(formodule)
-			{
-				value tmpv;
-				tmpv=deserialize(row["content"]);
-				into[id]=filter(tmpv, row["class"]);
-			}
-			else
-			{
-				value tmpv;
-				tmpv=deserialize(row["content"]);
-				into[id]=hidepasswords(filter(tmpv, row["class"]), row["class"], true);
-			}
-		}
-
-		into[id]["uuid"]=row["uuid"];
-		into[id]("type")="object";
-		into[id]("owner")=_findmetaid(row["owner"]);
-		into[id]["owner-metaid"]=into[id]("owner");
-		if(row["parentuuid"].sval().strlen())
-			into[id]["parentid"]=row["parentuuid"];
-		if(row["owneruuid"].sval().strlen())
-			into[id]["ownerid"]=row["owneruuid"];
+		value &obj = into[id];
+		obj=deserialize(cur.sval(FO_CONTENT));
+		dbproject(obj, ci->plan[dbview(module != ci->module, formodule,
+									   hidepasswords)], emptyvalue);
+
+		string objuuid = cur.cval(FO_UUID);
+		obj["uuid"]=objuuid;
+		obj("type")="object";
+		obj("owner")=cur.cval(FO_OWNERMETAID);
+		obj["owner-metaid"]=obj("owner");
+		if(*cur.cval(FO_PARENTUUID))
+			obj["parentid"]=cur.cval(FO_PARENTUUID);
+		if(*cur.cval(FO_OWNERUUID))
+			obj["ownerid"]=cur.cval(FO_OWNERUUID);
 		
-		if(row["metaid"].sval().strlen())
+		if(*cur.cval(FO_METAID))
 		{
-			into[id]["id"]=row["metaid"];
-			into[id]["metaid"]=row["metaid"];
+			obj["id"]=cur.cval(FO_METAID);
+			obj["metaid"]=cur.cval(FO_METAID);
 		}
 		else
 		{
-			into[id]["id"]=row["uuid"];
+			obj["id"]=objuuid;
 		}
-
+		
 		if(!module.strlen())
 		{
-			module=classdata("modulename");
+			module=ci->module;
 		}
 		
-		if (classdata.attribexists ("requires"))
-		{
-			reqclass = classdata ("requires");
-		}
-		else
-		{
-			reqclass = "";
-		}
+		reqclass = ci->requires;
 		
-		if(formodule && classdata.attribexists("allchildren") && module == classdata("modulename").sval())
+		if(formodule && ci->allchildren && module == ci->module)
 		{	
-      // CORE->log(log::debug, "DB", "fetchObject: doing "
-      //      "allchildren (%s)" %format (row["uuid"]));
-					  
-			value mergev;
-			if(listObjects(mergev, row["uuid"], nokey, formodule))
-			{
-				into[id] << mergev;
-			}
-			else
-			{
-				return false;
-			}
+			expand.newval() = $("class", id)->$("uuid", objuuid);
 		}
-		if(formodule && classdata.attribexists("childrendep"))
+		if(formodule && ci->childrendep.strlen())
 		{	
-      // DEBUG.storeFile("DB", "childrendep", classdata, "fetchObject");
-      // CORE->log(log::debug, "DB", "fetchObject: doing childrendep "
-      //     "(%s, %s)" %format (classdata("childrendep"), row["uuid"]));
-					 
-			value mergev;
-			if(listObjects(mergev, row["uuid"], $(classdata("childrendep")), formodule))
-			{
-				into[id] << mergev;
-			}
-			else
-			{
-				return false;
-			}
+			expand.newval() = $("class", id)->
+							  $("uuid", objuuid)->
+							  $("childrendep", ci->childrendep);
 		}
-        // if(!formodule)
-        //          {   
-        //                  value childclasses;
-        //                  query.crop();
-        //                  query.printf("SELECT /* fetchObject */ o.id id, o3.metaid childclass FROM objects o, objects o2, objects o3 WHERE o.id=o2.parent AND o2.class=o3.id AND o.id=%d", localid);
-        //              value ccres = dosqlite(query);
-        //              foreach(row, ccres["rows"])
-        //              {
-        //                  into[id]["childclasses"][row["childclass"]] = 1;
-        //              }
-        //          }
-		if(!formodule || !classdata.attribexists("requires") || !row["parent"].ival())
-		{
-      // CORE->log(log::debug, "DB", "fetchObject: NOT recursing "
-      //     "upward from %d" %format(localid));
+		if(!formodule || !ci->requires.strlen() || !parentid)
+		{
 			break;
 		}
-    // CORE->log(log::debug, "DB", "fetchObject: recursing upward "
-    //      "from %i to %i" %format (localid, row["parent"]));
-		localid = row["parent"].ival();
+		localid = parentid;
+	}
+	
+	// everything is read, hand the connection back before listing
+	cur.close();
+	
+	foreach(e, expand)
+	{
+		value mergev;
+		bool ok;
+		
+		if(e.exists("childrendep"))
+			ok = listObjects(mergev, e["uuid"].sval(), $(e["childrendep"]), formodule);
+		else
+			ok = listObjects(mergev, e["uuid"].sval(), nokey, formodule);
+		
+		if(!ok)
+			return false;
+		
+		into[e["class"].sval()] << mergev;
 	}
 	
 	// DEBUG.storeFile("DB", "result", into, "fetchObject");
@@ -635,15 +2088,12 @@ bool DBManager::fetchObject (value &into, const statstring &uuid, bool formodule
 
 bool DBManager::userisgone()
 {
-    value where;
-    string q;
+    DBQuery q;
     
     if (god)
         return false;
 
-    q.printf("SELECT /* userisgone */ id FROM objects WHERE ");
-	where["uuid"]=useruuid;
-	q.strcat(escapeforsql("=", " AND ", where));
+    q.add("SELECT /* userisgone */ id FROM objects WHERE uuid=").arg(useruuid);
 	value dbres = dosqlite(q);
 
 	// FIXME: also log out for delete
@@ -662,7 +2112,6 @@ string *DBManager::createObject(const statstring &parent, const value &withmembe
 {
 	returnclass (string) res retain;
 	value v;
-	string query;
 	int classid, parentid=0, ownerid=-1;
 	value members;
 	
@@ -698,11 +2147,8 @@ string *DBManager::createObject(const statstring &parent, const value &withmembe
 
 	if(parent)
 	{
-		string q;
-		q.printf("SELECT /* createObject parentid */ id,owner FROM objects WHERE ");
-		value where;
-		where["uuid"]=parent;
-		q.strcat(escapeforsql("=", " AND ", where));
+		DBQuery q ("SELECT /* createObject parentid */ id,owner FROM objects WHERE uuid=");
+		q.arg(parent.sval());
 		value uuiddbres = dosqlite(q);
 		parentid=uuiddbres["rows"][0]["id"].ival();
         ownerid=uuiddbres["rows"][0]["owner"].ival();
@@ -857,208 +2303,241 @@ string *DBManager::createObject(const statstring &parent, const value &withmembe
 		string proto, protoid;
         proto = classdata("prototype").str();
 		protoid.printf("%s%s%s", classdata("magicdelimiter").str(), classdata("prototype").str(), classdata("magicdelimiter").str());
-		string query = "SELECT /* createObject prototype */ id FROM objects WHERE ";
-		value where;
-		where["metaid"]=protoid;
-		where["class"]=classid;
-		where["uniquecontext"]=classid; // for sanity
-		query.strcat(escapeforsql("=", " AND ", where));
+		DBQuery query ("SELECT /* createObject prototype */ id FROM objects WHERE metaid=");
+		query.arg(protoid).add(" AND class=").arg(classid);
+		query.add(" AND uniquecontext=").arg(classid); // for sanity
 		value dbres = dosqlite(query);
 		if(dbres["rows"].count() == 1)
 		{
 			value replacements;
             replacements[proto] = metaid;
-			res=copyprototype(dbres["rows"][0]["id"], parentid, ownerid, replacements, true, members);
+            
+            // the whole copied tree goes in as one transaction
+            if(!begin())
+            {
+            	res.clear();
+            	return &res;
+            }
+			res=copyprototype(dbres["rows"][0]["id"], parentid, ownerid, replacements, members);
+			if(!res.strlen())
+			{
+				rollback();
+				return &res;
+			}
             if (immediate)
             {
                 reportSuccess(res);
             }
+            if(!commit())
+            {
+            	res.clear();
+            }
             
 			return &res;
 		}
 	}
 
-	exclusivesection (dbhandle)
+	value qres;
+	int newid;
+	
+	if(!begin())
 	{
- 	   value qres, disposeme;
-	    qres=_dosqlite("BEGIN TRANSACTION /* createObject */");
-	    if(!qres)
-	    {
-	      goto createObject_rollbackandbreak;
-	    }
-
-	  	query="INSERT /* createObject */ INTO objects ";
-	  	query.strcat(escapeforinsert(v));
-	  	qres = _dosqlite(query); // FIXME: handle errors
-	
-	  	if(!qres)
-	  	{
-	    	goto createObject_rollbackandbreak; // dosqlite has set a message for us
-	  		// TODO: replace with nicer message
-	  	}
-	
-	  	if(ofclass == "User")
-	  	{
-	  		if(!_setpowermirror(qres["insertid"].ival()))
-	  		{
-				goto createObject_rollbackandbreak;
-	  		}
-	  		if(useruuid == "")
-	  		{
-	  			string query;
-
-	  			query.crop();
-	  			query.printf("REPLACE INTO powermirror (userid,powerid) VALUES(0,%d)", qres["insertid"].ival());
-	  			value qres = _dosqlite(query);
-	  			if(!qres)
-	  			{
-	          		goto createObject_rollbackandbreak;
-	  			}
-	  		}
-	  	}
-	
-	  	res=v["uuid"].sval();
-
-	    qres = _dosqlite("COMMIT TRANSACTION /* createObject */");
-	    if (!qres)
-	    {
-	    	goto createObject_rollbackandbreak;
-	    }
-    
-	    goto createObject_success;
-    
-	createObject_rollbackandbreak:
-	    disposeme = _dosqlite("ROLLBACK TRANSACTION /* createObject */");
-	    res.clear();
-	    // fallthrough
-	createObject_success:
-	    return &res;
+		res.clear();
+		return &res;
 	}
-  // return &res;
-}
-
-string *DBManager::copyprototype(int fromid, int parentid, int ownerid, value &repl, bool rootobj, const value &members)
-{
-	returnclass (string) res retain;
-
-  // CORE->log(log::debug, "DB", "copyprototype %d -> child of "
-  //     "%d" %format (fromid, parentid));
 
-	// (a) copy fromid as child of parentid
-	// (b) find all children of fromid
-	// (c) call ourselves with each childid as fromid, the id from (a) as parentid
+	DBQuery query ("INSERT /* createObject */ INTO objects ");
+	query.values(v);
+	qres = _dosqlite(query);
 	
-	// columns:
-	// id|uuid|version|metaid|parent|owner|uniquecontext|class|content|reality|wanted|deleted|postponed
-	// we select on: id
-	// we copy: class, content
-	// we rework: metaid
-	string query;
-	query.printf("SELECT /* copyprototype */ uniquecontext, class, content, metaid FROM objects WHERE id=%d", fromid);
-	value dbres = dosqlite(query);
-	if(dbres["rows"].count() != 1)
+	if(!qres)
 	{
-		// this can't happen
-		errorcode = ERR_DBMANAGER_FAILURE;
-		lasterror = "Object disappeared / on the path of recursion / prototyping failed";
+		// dosqlite has set a message for us
+		rollback();
 		res.clear();
 		return &res;
 	}
-	value in = dbres["rows"][0];
 	
-	string iquery = "INSERT /* copyprototype */ INTO objects ";
-	value v;
-	int classid = in["class"];
-	v["class"] = classid;
-  // CORE->log(log::debug, "DB", "copyprototype: valueparsing "
-  //      "[%s]" %format (in["metaid"]));
-			  
-  // DEBUG.storeFile("DB", "repl", repl, "copyprototype");
-	v["metaid"] = strutil::valueparse(in["metaid"], repl);
-
-	// find class data
-	string classquery;
-	classquery.printf("SELECT /* copyprototype */ content FROM objects WHERE id=%d", classid);
-	value classdbres = dosqlite(classquery);
-	if(!classdbres["rows"].count())
+	newid = qres["insertid"].ival();
+	
+	if(!_indexsearch(newid, classid, members))
 	{
-		errorcode = ERR_DBMANAGER_NOTFOUND;
-		lasterror = "Class not found";
+		rollback();
 		res.clear();
 		return &res;
 	}
-
-	value classdata = deserialize(classdbres["rows"][0]["content"]);
-
-	// find uniqueness context
-	if(classdata.attribexists("uniquein"))
+	
+	if(ofclass == "User")
 	{
-		caseselector (classdata("uniquein").sval())
+		if(!_setpowermirror(newid))
 		{
-			incaseof("parent"):
-				v["uniquecontext"]=parentid;
-				break;
-			incaseof("class"):
-				if(classdata.attribexists("uniqueclass"))
-				{	
-					v["uniquecontext"]=findclassid(classdata("uniqueclass").sval());
-				}
-				else
-				{
-					v["uniquecontext"]=classid;
-				}	
-				break;
-			defaultcase:
-				errorcode = ERR_DBMANAGER_FAILURE;
-				lasterror = "uniquein-attribute defective";
+			rollback();
+			res.clear();
+			return &res;
+		}
+		if(useruuid == "")
+		{
+			DBQuery pquery ("REPLACE INTO powermirror (userid,powerid) VALUES(0,");
+			pquery.arg(newid).add(")");
+			if(!_dosqlite(pquery))
+			{
+				rollback();
 				res.clear();
 				return &res;
+			}
 		}
 	}
-
-	value incontent = deserialize(in["content"]);
-	value outcontent;
-	foreach(member, incontent)
-	{
-	    if (members[member.id()].sval().strlen())
-            outcontent[member.id()] = members[member.id()];
-        else
-        	outcontent[member.id()] = strutil::valueparse(member, repl);
-	}
-	v["content"] = serialize(outcontent);
-	v["uuid"] = strutil::uuid();
-	v["parent"] = parentid;
-    v["owner"]=ownerid;
-	iquery.strcat(escapeforinsert(v));
-	value idbres = dosqlite(iquery);
-	if(!idbres)
+	
+	if(!commit())
 	{
-		// pass error from dosqlite implicitly
 		res.clear();
 		return &res;
 	}
-	res = v["uuid"];
-	string cquery = "SELECT /* copyprototype */ id FROM objects WHERE ";
-	value where;
-	where["parent"] = fromid;
-	cquery.strcat(escapeforsql("=", " AND ", where));
-	value cdbres = dosqlite(cquery);
-	if(!cdbres)
+	
+	res=v["uuid"].sval();
+	
+	idcache.put(v["uuid"].sval(), newid, v["class"].ival(),
+				idcache.generation());
+	dbsetowner(newid, v["owner"].ival());
+	
+	if(ofclass == "User")
+		logpowerchange(newid, findlocalid(useruuid), false);
+	
+	return &res;
+}
+
+// ==========================================================================
+// METHOD DBManager::copyprototype
+// ==========================================================================
+string *DBManager::copyprototype(int fromid, int parentid, int ownerid, value &repl, const value &members, value *idmap)
+{
+	returnclass (string) res retain;
+	
+	// column order of the HQ_PROTOTREE statement
+	enum { PT_ID, PT_PARENT, PT_CLASS, PT_CONTENT, PT_METAID };
+	
+	// The whole prototype comes out in one query, parents before their
+	// children, so every row can be rewritten against the new ids of
+	// the rows before it.
+	value tree;
+	DBCursor cur (*this);
+	if(!cur.open(HQ_PROTOTREE, $(fromid)))
+		return &res;
+	
+	while(cur.next())
 	{
-		// pass error from dosqlite implicitly
-		res.clear();
+		value &row = tree.newval();
+		row["id"] = cur.ival(PT_ID);
+		row["parent"] = cur.ival(PT_PARENT);
+		row["class"] = cur.ival(PT_CLASS);
+		row["content"] = cur.sval(PT_CONTENT);
+		row["metaid"] = cur.cval(PT_METAID);
+	}
+	
+	bool failed = cur.failed();
+	cur.close();
+	if(failed)
+		return &res;
+	
+	if(!tree.count())
+	{
+		errorcode = ERR_DBMANAGER_FAILURE;
+		lasterror = "Prototype disappeared, prototyping failed";
 		return &res;
 	}
-	foreach(row, cdbres["rows"])
+	
+	if(!begin())
+		return &res;
+	
+	value newids;
+	
+	foreach(row, tree)
 	{
-		string childuuid = copyprototype(row["id"].ival(), idbres["insertid"].ival(), ownerid, repl, false, emptyvalue);
-		if(!childuuid)
+		int classid = row["class"].ival();
+		const dbclassinfo *ci = getclassinfo(classid);
+		if(!ci)
 		{
-			res.clear();
+			errorcode = ERR_DBMANAGER_NOTFOUND;
+			lasterror = "Class not found";
+			rollback();
 			return &res;
 		}
+		
+		bool isroot = (row["id"].ival() == fromid);
+		int newparent = isroot ? parentid
+							   : newids[row["parent"].sval()].ival();
+		
+		// find uniqueness context
+		string uniquecontext;
+		if(ci->uniquein == "parent")
+		{
+			uniquecontext.printf("%d", newparent);
+		}
+		else if(ci->uniquein == "class")
+		{
+			if(ci->classdata.attribexists("uniqueclass"))
+				uniquecontext.printf("%d", findclassid(ci->classdata("uniqueclass").sval()));
+			else
+				uniquecontext.printf("%d", classid);
+		}
+		else if(ci->uniquein.strlen())
+		{
+			errorcode = ERR_DBMANAGER_FAILURE;
+			lasterror = "uniquein-attribute defective";
+			rollback();
+			return &res;
+		}
+		
+		value incontent = deserialize(row["content"].sval());
+		value outcontent;
+		foreach(member, incontent)
+		{
+			if (isroot && members[member.id()].sval().strlen())
+				outcontent[member.id()] = members[member.id()];
+			else
+				outcontent[member.id()] = strutil::valueparse(member, repl);
+		}
+		
+		string uuid = strutil::uuid();
+		string metaid = strutil::valueparse(row["metaid"], repl);
+		string content = serialize(outcontent);
+		value args = $(uuid) ->
+					 $(metaid) ->
+					 $(newparent) ->
+					 $(ownerid) ->
+					 $(uniquecontext) ->
+					 $(classid) ->
+					 $(content);
+		
+		value qres = _dohotquery(HQ_PROTOINSERT, args);
+		if(!qres)
+		{
+			// pass error from _dohotquery implicitly
+			rollback();
+			return &res;
+		}
+		
+		int newid = qres["insertid"].ival();
+		if(!_indexsearch(newid, classid, outcontent))
+		{
+			rollback();
+			return &res;
+		}
+		
+		newids[row["id"].sval()] = newid;
+		if(isroot) res = uuid;
 	}
 	
+	if(!commit())
+	{
+		res.clear();
+		return &res;
+	}
+	
+	foreach(id, newids)
+		dbsetowner(id.ival(), ownerid);
+	
+	if(idmap) *idmap = newids;
 	return &res;
 }
 
@@ -1088,61 +2567,45 @@ bool DBManager::_checkdomainsuffix(const string &child, const string &parent, co
 
 bool DBManager::setpowermirror(int uid)
 {
-	string query;
-	
-	int userid = findlocalid( useruuid );
-	
-	query.crop();
-	query.printf("REPLACE INTO powermirror (userid,powerid) VALUES(%d,%d)", uid, userid);
-	value qres = dosqlite(query);
-	if(!qres)
-	{
+	if(!begin())
 		return false;
-	}
 	
-	query.crop();
-	query.printf("REPLACE INTO powermirror (userid,powerid) VALUES(%d,%d)", uid, uid);
-	qres = dosqlite(query);
-	if(!qres)
+	if(!_setpowermirror(uid))
 	{
+		rollback();
 		return false;
 	}
-
-	query.crop();
-	query.printf("REPLACE INTO powermirror (userid,powerid) SELECT %d, powerid FROM powermirror WHERE userid=%d", uid, userid);
-	qres = dosqlite(query);
-	if(!qres)
-	{
+	
+	if(!commit())
 		return false;
-	}
-
+	
+	logpowerchange(uid, findlocalid(useruuid), false);
 	return true;
 }
 
 bool DBManager::_setpowermirror(int uid)
 {
-	string query;
 	int userid = _findlocalid( useruuid );
 	
-	query.crop();
-	query.printf("REPLACE INTO powermirror (userid,powerid) VALUES(%d,%d)", uid, userid);
+	DBQuery query ("REPLACE INTO powermirror (userid,powerid) VALUES(");
+	query.arg(uid).add(",").arg(userid).add(")");
 	value qres = _dosqlite(query);
 	if(!qres)
 	{
 		return false;
 	}
 	
-	query.crop();
-	query.printf("REPLACE INTO powermirror (userid,powerid) VALUES(%d,%d)", uid, uid);
-	qres = _dosqlite(query);
+	DBQuery squery ("REPLACE INTO powermirror (userid,powerid) VALUES(");
+	squery.arg(uid).add(",").arg(uid).add(")");
+	qres = _dosqlite(squery);
 	if(!qres)
 	{
 		return false;
 	}
 
-	query.crop();
-	query.printf("REPLACE INTO powermirror (userid,powerid) SELECT %d, powerid FROM powermirror WHERE userid=%d", uid, userid);
-	qres = _dosqlite(query);
+	DBQuery cquery ("REPLACE INTO powermirror (userid,powerid) SELECT ");
+	cquery.arg(uid).add(", powerid FROM powermirror WHERE userid=").arg(userid);
+	qres = _dosqlite(cquery);
 	if(!qres)
 	{
 		return false;
@@ -1169,7 +2632,6 @@ bool DBManager::updateObject(const value &withmembers, const statstring &uuid, b
 {
 	value v;
     int localid;
-	string query;
 	value members;
 	
 	members=withmembers;
@@ -1203,8 +2665,8 @@ bool DBManager::updateObject(const value &withmembers, const statstring &uuid, b
 			return false;
 		}
         // check that the object to be deleted is not the owner of anything
-        query.crop();
-        query.printf("SELECT /* updateObject deleting owner? */ COUNT(id) FROM objects WHERE owner=%d", localid);
+        DBQuery query ("SELECT /* updateObject deleting owner? */ COUNT(id) FROM objects WHERE owner=");
+        query.arg(localid);
         value dbres = dosqlite(query);
         if(dbres["rows"][0][0].ival())
         {
@@ -1214,10 +2676,8 @@ bool DBManager::updateObject(const value &withmembers, const statstring &uuid, b
         }
     }
 
-    query="SELECT /* updateObject */ id, class, metaid, uniquecontext, parent, owner FROM objects WHERE ";
-	value where;
-	where["id"]=localid;
-	query.strcat(escapeforsql("=", " AND ", where));
+    DBQuery query ("SELECT /* updateObject */ id, class, metaid, uniquecontext, parent, owner FROM objects WHERE id=");
+	query.arg(localid);
     value dbres = dosqlite(query);
 	if(!dbres)
 	{
@@ -1279,9 +2739,26 @@ bool DBManager::updateObject(const value &withmembers, const statstring &uuid, b
 	v["owner"]=fetched["owner"];
 	v["id"]=localid;
 	
-	query="REPLACE /* updateObject */ INTO objects ";
-	query.strcat(escapeforinsert(v));
-	value qres = dosqlite(query); // FIXME: handle errors
+	// the REPLACE drops the old search keys along with the row
+	if(!begin())
+		return false;
+	
+	DBQuery rquery ("REPLACE /* updateObject */ INTO objects ");
+	rquery.values(v);
+	value qres = dosqlite(rquery);
+	
+	if(qres && !deleted && !_indexsearch(localid, updatedclassid, members))
+		qres.clear();
+	
+	if(!qres) rollback();
+	else if(!commit()) qres.clear();
+	
+	// A deleted object is on its way out, and the class id may have
+	// moved if the class was re-registered.
+	idcache.remove(uuid);
+	
+	if(qres && deleted && _classNameFromUUID(updatedclassid) == "User")
+		logpowerchange(localid, 0, true);
 	
 	if(!qres)
 	{
@@ -1299,114 +2776,777 @@ bool DBManager::updateObject(const value &withmembers, const statstring &uuid, b
 
 int DBManager::findclassid(const statstring &classname)
 {
-	string query;
-	value v;
-	string tmp;
+	dbclasstable *t = classtable;
 	
-	// query.printf("SELECT id FROM objects WHERE class=0 AND metaid='%S\'", classname.cval());
-	query="SELECT /* findclassid */ id FROM objects WHERE ";
-	value where;
-	where["class"]=1;
-	where["metaid"]=classname;
-	query.strcat(escapeforsql("=", " AND ", where));
-	v = dosqlite(query);
-  // DEBUG.storeFile("DB", "dbres", v, "findclassid");
+	if(t && t->byname.exists(classname))
+		return t->byname[classname].ival();
 	
-  // CORE->log(log::debug, "DB","findclassid: %i" %format(v["rows"][0]["id"]));
-  return v["rows"][0]["id"].ival(); // FIXME: check if it's there?
+	// not seen yet, load it into the registry
+	value v = dohotquery (HQ_FINDCLASSID, $(classname));
+	int classid = v["rows"][0]["id"].ival(); // FIXME: check if it's there?
+	if(classid) getclassinfo(classid);
+	return classid;
 }
 
 string *DBManager::_classNameFromUUID(const int classid)
 {
-	static lock<value> cache_classNameFromUUID;
-	string idstring;
 	returnclass (string) res retain;
-	value v;
-	string query;
+	const dbclassinfo *ci = getclassinfo(classid);
+	
+	if(ci) res = ci->name;
+	return &res; // FIXME: check if it's there?
+}
+
+// ==========================================================================
+// METHOD DBManager::getclassinfo
+// ==========================================================================
+const dbclassinfo *DBManager::getclassinfo(int classid)
+{
+	dbclasstable *t = classtable;
+	
+	if(t && classid >= 0 && classid < t->size && t->byid[classid])
+		return t->byid[classid];
+	
+	DBQuery query ("SELECT /* getclassinfo */ id, metaid, content FROM objects WHERE class=1 AND id=");
+	query.arg(classid);
+	DBCursor cur (*this);
+	if(!cur.open(query) || !cur.next())
+		return NULL;
+	
+	return loadclassinfo(cur.ival(0), cur.cval(1), cur.cval(2));
+}
+
+// ==========================================================================
+// METHOD DBManager::loadclassinfo
+// ==========================================================================
+const dbclassinfo *DBManager::loadclassinfo(int classid, const string &name,
+											const string &content)
+{
+	dbclassinfo *ci = new dbclassinfo;
+	
+	ci->id = classid;
+	ci->name = name;
+	ci->classdata.fromxml(content);
+	
+	const value &cd = ci->classdata;
+	ci->module = cd("modulename").sval();
+	ci->allchildren = cd.attribexists("allchildren");
+	ci->worldreadable = cd.attribexists("worldreadable");
+	ci->childrendep = cd("childrendep").sval();
+	ci->requires = cd("requires").sval();
+	ci->uniquein = cd("uniquein").sval();
 	
-	idstring.printf("%i", classid);
-	sharedsection(cache_classNameFromUUID)
+	foreach(field, cd)
 	{
-		if(cache_classNameFromUUID.exists(idstring))
+		bool ispassword = (field("type") == "password");
+		bool isprivate = field.attribexists("privateformodule");
+		
+		// password hashes stay out of the search index
+		if(field("searchable").bval() && !ispassword)
+			ci->searchfields[field.id()] = true;
+		
+		if(!ispassword && !isprivate) continue;
+		
+		for(int v=0; v<6; ++v)
 		{
-			res=cache_classNameFromUUID[idstring];
-			return &res;
+			if(isprivate && (v & DBVIEW_FOREIGN))
+				ci->plan[v][field.id()] = DBFIELD_DROP;
+			else if(ispassword && (v & DBVIEW_TAG))
+				ci->plan[v][field.id()] = DBFIELD_TAG;
+			else if(ispassword && (v & DBVIEW_HIDE))
+				ci->plan[v][field.id()] = DBFIELD_HIDE;
 		}
 	}
-	// query.printf("SELECT id FROM objects WHERE class=0 AND metaid='%S\'", classname.cval());
-	query.printf("SELECT /* _classNameFromUUID */ metaid FROM objects WHERE class=1 AND id=%d", classid);
-	v = dosqlite(query);
-    res=v["rows"][0]["metaid"].sval();
-	exclusivesection(cache_classNameFromUUID)
+	
+	dbpublishclass(ci);
+	return ci;
+}
+
+// ==========================================================================
+// METHOD DBManager::loadclassregistry
+// ==========================================================================
+bool DBManager::loadclassregistry(void)
+{
+	DBCursor cur (*this);
+	int count = 0;
+	
+	if(!cur.open("SELECT /* loadclassregistry */ id, metaid, content FROM objects WHERE class=1 AND id!=1"))
+		return false;
+	
+	while(cur.next())
 	{
-		cache_classNameFromUUID[idstring]=res;
+		loadclassinfo(cur.ival(0), cur.cval(1), cur.cval(2));
+		count++;
 	}
-	return &res; // FIXME: check if it's there?
+	
+	CORE->log(log::debug, "DB", "Loaded %i classes into registry" %format (count));
+	return !cur.failed();
 }
 
 string *DBManager::_findmetaid(const int id)
 {
 	returnclass (string) res retain;
 	value v;
-	string query;
 	
-	query.printf("SELECT /* _findmetaid */ metaid FROM objects WHERE id=%d", id);
-	v = dosqlite(query);
+	v = dohotquery (HQ_FINDMETAID, $(id));
     res=v["rows"][0]["metaid"].sval();
 	return &res; // FIXME: check if it's there?
 }
 
-value *DBManager::dosqlite (const statstring &query)
+// ==========================================================================
+// METHOD DBManager::dosqlite
+// ==========================================================================
+value *DBManager::dosqlite (const DBQuery &query)
 {
-    CORE->log (log::debug, "DB", "dosqlite: %s" %format (query));
+    CORE->log (log::debug, "DB", "dosqlite: %s" %format (query.text));
 
     returnclass (value) res retain;
+    
+    // Plain reads go to a pooled reader connection and run
+    // concurrently with everything else.
+    if (dbisreadquery (query.text.str()))
+    {
+    	dbconnection *c = acquirereader ();
+    	if (! c) return &res;
+    	
+    	res = _runsql (c, query);
+    	releasereader (c);
+    	return &res;
+    }
 	
-    exclusivesection (dbhandle)
+    // Inside a scope we already hold the writer.
+    if (txdepth)
+    {
+    	res = _dosqlite(query);
+    }
+    else
     {
-        res = _dosqlite(query);
+    	// Otherwise the writer thread runs it, together with whatever
+    	// else is waiting in the queue.
+    	dbwritejob job;
+    	job.query = &query;
+    	
+    	switch (dbqsubmit (&job))
+    	{
+    		case DBQ_DONE:
+    			res = job.res;
+    			if (! res)
+    			{
+    				lasterror = job.error;
+    				errorcode = job.errorcode;
+    			}
+    			break;
+    		
+    		case DBQ_TIMEOUT:
+    			lasterror = "Timed out waiting for the database writer";
+    			errorcode = ERR_DBMANAGER_FAILURE;
+    			return &res;
+    		
+    		default:
+    			_dowriteinline (query, res);
+    			break;
+    	}
     }
     
+    // Whatever the statement was, cached results from before it may
+    // be stale now. Inside a scope the commit bumps once more.
+    __sync_add_and_fetch (&dbwritegen, 1);
     return &res;
 }
 
-value *DBManager::_dosqlite (const statstring &query)
+// ==========================================================================
+// METHOD DBManager::_dowriteinline
+// ==========================================================================
+void DBManager::_dowriteinline (const DBQuery &query, value &res)
+{
+    if (! dbgroupwindow)
+    {
+    	exclusivesection (dbwriter)
+    	{
+    		res = _dosqlite(query);
+    	}
+    	return;
+    }
+    
+    // With group commit a transaction may be open on the writer while
+    // its commit is pending, so a lone write has to join it as a scope
+    // of its own and wait for the commit like everybody else.
+    if (! begin ()) return;
+    res = _dosqlite(query);
+    if (! res)
+    {
+    	rollback ();
+    	return;
+    }
+    if (! commit ()) res.clear();
+}
+
+// ==========================================================================
+// METHOD DBManager::begin
+// ==========================================================================
+bool DBManager::begin (void)
+{
+	// nested scopes are part of the outermost one
+	if (txdepth++) return true;
+	
+	txfailed = false;
+	txnested = false;
+	txleased = false;
+	
+	// Outside the writer thread a scope waits for its turn in the write
+	// queue, then has the writer to itself until it ends.
+	dbwritejob lease;
+	lease.query = NULL;
+	
+	switch (dbqsubmit (&lease))
+	{
+		case DBQ_DONE:
+			txleased = true;
+			break;
+		
+		case DBQ_TIMEOUT:
+			txdepth = 0;
+			lasterror = "Timed out waiting for the database writer";
+			errorcode = ERR_DBMANAGER_FAILURE;
+			return false;
+	}
+	
+	dbwriter.lockw ();
+	
+	if (! dbgroupopen)
+	{
+		// take the write lock right away, a deferred transaction could
+		// find another process has written in between and fail busy
+		if (! _dosqlite ("BEGIN IMMEDIATE /* begin */"))
+		{
+			txdepth = 0;
+			dbwriter.unlock ();
+			if (txleased) dbqrelease ();
+			return false;
+		}
+		dbgroupopen = true;
+		dbgroupseq++;
+	}
+	
+	// A savepoint per scope lets a failed scope back out without
+	// taking along the other scopes of an open group.
+	txgroup = dbgroupseq;
+	if (! _dosqlite ("SAVEPOINT scope"))
+	{
+		txdepth = 1;
+		txfailed = true;
+		rollback ();
+		return false;
+	}
+	
+	return true;
+}
+
+// ==========================================================================
+// METHOD DBManager::commit
+// ==========================================================================
+bool DBManager::commit (void)
+{
+	if (! txdepth) return false;
+	
+	if (--txdepth)
+	{
+		// the outermost scope decides
+		txnested = true;
+		return true;
+	}
+	
+	if (txfailed)
+	{
+		txdepth = 1;
+		rollback ();
+		return false;
+	}
+	
+	if (! _dosqlite ("RELEASE scope"))
+	{
+		txdepth = 1;
+		rollback ();
+		return false;
+	}
+	
+	bool ok;
+	unsigned int mygroup = txgroup;
+	
+	if (! dbgroupwindow)
+	{
+		ok = _dosqlite ("COMMIT /* commit */");
+		if (! ok) _dosqlite ("ROLLBACK /* commit */");
+		dbgroupopen = false;
+		dbwriter.unlock ();
+		if (txleased) dbqrelease ();
+		if ((! ok) && txnested) dbdropcaches ();
+		
+		// writes done inside an outer scope only show from here on
+		__sync_add_and_fetch (&dbwritegen, 1);
+		return ok;
+	}
+	
+	// Group commit: the first scope to finish waits while the scopes
+	// that were queued behind it run inside the same transaction, for
+	// no longer than the window, then commits for all of them.
+	struct timespec until;
+	bool leader = ! dbgroupleader;
+	dbgroupleader = true;
+	dbdeadline (dbgroupwindow, until);
+	dbwriter.unlock ();
+	if (txleased) dbqrelease ();
+	
+	if (leader)
+	{
+		// With nobody else queued there is nothing to wait for. Nor
+		// is there when the writer thread itself is in the group, it
+		// would not hand out the writer until the group is done.
+		pthread_mutex_lock (&dbqlock);
+		while ((dbqhead || dbqleased) && (! dbgroupstalled) &&
+			   (! pthread_equal (pthread_self (), dbqthread)))
+		{
+			if (pthread_cond_timedwait (&dbqdone, &dbqlock, &until)
+					== ETIMEDOUT) break;
+		}
+		pthread_mutex_unlock (&dbqlock);
+		
+		dbwriter.lockw ();
+		ok = _dosqlite ("COMMIT /* group commit */");
+		if (! ok) _dosqlite ("ROLLBACK /* group commit */");
+		dbgroupopen = false;
+		dbgroupleader = false;
+		
+		pthread_mutex_lock (&dbqlock);
+		dbgroupfailed[mygroup % DBGROUPRESULTS] = ! ok;
+		dbgroupdone = mygroup;
+		pthread_cond_broadcast (&dbgroupwake);
+		pthread_mutex_unlock (&dbqlock);
+		
+		dbwriter.unlock ();
+		
+		if (! ok) dbdropcaches ();
+		__sync_add_and_fetch (&dbwritegen, 1);
+		return ok;
+	}
+	
+	bool writerthread = false;
+	
+	pthread_mutex_lock (&dbqlock);
+	if (dbqrunning && pthread_equal (pthread_self (), dbqthread))
+	{
+		writerthread = true;
+		dbgroupstalled = true;
+		pthread_cond_broadcast (&dbqdone);
+	}
+	
+	while (dbgroupdone - mygroup >= 0x80000000U)
+	{
+		pthread_cond_wait (&dbgroupwake, &dbqlock);
+	}
+	
+	ok = ! dbgroupfailed[mygroup % DBGROUPRESULTS];
+	if (writerthread) dbgroupstalled = false;
+	pthread_mutex_unlock (&dbqlock);
+	
+	__sync_add_and_fetch (&dbwritegen, 1);
+	return ok;
+}
+
+// ==========================================================================
+// METHOD DBManager::rollback
+// ==========================================================================
+void DBManager::rollback (void)
+{
+	if (! txdepth) return;
+	
+	if (--txdepth)
+	{
+		// the outermost scope will roll back
+		txfailed = true;
+		return;
+	}
+	
+	_dosqlite ("ROLLBACK TO scope");
+	_dosqlite ("RELEASE scope");
+	
+	// Other scopes of the group still wait for their commit; the open
+	// transaction only goes if it was ours alone.
+	if (! dbgroupleader)
+	{
+		_dosqlite ("ROLLBACK /* rollback */");
+		dbgroupopen = false;
+	}
+	
+	dbwriter.unlock ();
+	if (txleased) dbqrelease ();
+	
+	if (txnested) dbdropcaches ();
+}
+
+// ==========================================================================
+// STATIC METHOD DBManager::setGroupCommit
+// ==========================================================================
+void DBManager::setGroupCommit (int ms)
+{
+	exclusivesection (dbwriter)
+	{
+		dbgroupwindow = (ms > 0) ? ms : 0;
+	}
+}
+
+// ==========================================================================
+// STATIC METHOD DBManager::writeGeneration
+// ==========================================================================
+unsigned int DBManager::writeGeneration (void)
+{
+	return __sync_fetch_and_add (&dbwritegen, 0);
+}
+
+// ==========================================================================
+// METHOD DBManager::runWriteBatch
+// ==========================================================================
+void DBManager::runWriteBatch (dbwritejob **jobs, int count)
+{
+	bool ok = begin ();
+	
+	for (int i=0; ok && (i<count); ++i)
+	{
+		dbwritejob *j = jobs[i];
+		
+		// a statement that fails does not take the rest of the batch
+		// along with it
+		if (count > 1) _dosqlite ("SAVEPOINT job");
+		
+		j->res = _dosqlite (*j->query);
+		if (! j->res)
+		{
+			j->error = lasterror;
+			j->errorcode = errorcode;
+			if (count > 1) _dosqlite ("ROLLBACK TO job");
+		}
+		
+		if (count > 1) _dosqlite ("RELEASE job");
+	}
+	
+	if (ok) ok = commit ();
+	
+	// the jobs' callers see their results from here on, or see them fail
+	__sync_add_and_fetch (&dbwritegen, 1);
+	if (ok) return;
+	
+	// nothing of the batch made it to disk
+	for (int i=0; i<count; ++i)
+	{
+		jobs[i]->res.clear ();
+		jobs[i]->error = lasterror;
+		jobs[i]->errorcode = ERR_DBMANAGER_FAILURE;
+	}
+}
+
+// ==========================================================================
+// STATIC METHOD DBManager::getWriterStats
+// ==========================================================================
+value *DBManager::getWriterStats (void)
+{
+	returnclass (value) res retain;
+	
+	pthread_mutex_lock (&dbqlock);
+	unsigned int waits = dbqjobs + dbqleases;
+	
+	res["running"] = dbqrunning;
+	res["depth"] = dbqdepth;
+	res["maxdepth"] = dbqmaxdepth;
+	res["statements"] = dbqjobs;
+	res["batches"] = dbqbatches;
+	res["leases"] = dbqleases;
+	res["timeouts"] = dbqtimeouts;
+	res["waitavg"] = waits ? (int) (dbqwaittotal / waits) : 0;
+	res["waitmax"] = (int) dbqwaitmax;
+	pthread_mutex_unlock (&dbqlock);
+	
+	return &res;
+}
+
+// ==========================================================================
+// METHOD DBManager::_dosqlite
+// ==========================================================================
+value *DBManager::_dosqlite (const DBQuery &query)
+{
+	return _runsql (dbwriter.o, query);
+}
+
+// ==========================================================================
+// METHOD DBManager::_runsql
+// ==========================================================================
+value *DBManager::_runsql (dbconnection *c, const DBQuery &query)
 {
 	returnclass (value) res retain;
 	sqlite3_stmt *qhandle;
 	int qres;
-	timestamp t1, t2, rt1, rt2;
-	int rowcount=0;
-	int colcount=0;
+	const char *sql = query.text.str();
+	dbprofslot *prof = dbprofquery (sql);
+	long long t1, t2, t3;
 	
-	t1 = kernel.time.unow();
-    // CORE->log (log::debug, "DB", "dosqlite: %s" %format (query));
+	t1 = dbusecnow();
+    // CORE->log (log::debug, "DB", "dosqlite: %s" %format (query.text));
 	
-	if(sqlite3_prepare(dbhandle.o, query.str(), -1, &qhandle, 0) != SQLITE_OK)
+	if((qres = sqlite3_prepare_v2(c->h, sql, -1, &qhandle, 0)) != SQLITE_OK)
 	{
+		dbprofrecord (prof, dbusecnow() - t1, 0, 0, qres);
 		errorcode = ERR_DBMANAGER_FAILURE;
 		lasterror.crop();
-		lasterror.printf("sqlite3_prepare(%s) failed: %s", query.str(), sqlite3_errmsg(dbhandle.o));
+		lasterror.printf("sqlite3_prepare(%s) failed: %s", sql, sqlite3_errmsg(c->h));
+		return &res; // empty
+	}
+	
+	if((qres = dbbindargs(qhandle, query.types.str(), query.args)) != SQLITE_OK)
+	{
+		sqlite3_finalize(qhandle);
+		dbprofrecord (prof, dbusecnow() - t1, 0, 0, qres);
+		errorcode = ERR_DBMANAGER_FAILURE;
+		lasterror.crop();
+		lasterror.printf("sqlite3_bind(%s) failed: %s", sql, sqlite3_errmsg(c->h));
+		return &res; // empty
+	}
+	
+	t2 = dbusecnow();
+	_stepstatement (c->h, qhandle, sql, res);
+
+	qres = sqlite3_finalize(qhandle);
+	t3 = dbusecnow();
+	dbprofrecord (prof, t2-t1, t3-t2, res["rows"].count(), qres);
+	
+	if (qres != SQLITE_OK)
+	{
+    // CORE->log (log::debug, "DB", "sqlite3_finalize(%s) failed (%s): "
+    //      "%s" %format (query, sqlite3_errmsg(c->h)));
+
+		lasterror.crop();
+		lasterror.printf("sqlite3_finalize(%s) failed: %s", sql, sqlite3_errmsg(c->h));
+		if (qres == SQLITE_CONSTRAINT)
+		{
+			lasterror = "object already exists";
+		}
+		errorcode = ERR_DBMANAGER_FAILURE;
+		res.clear();
+		return &res;
+	}
+	res["insertid"]=sqlite3_last_insert_rowid(c->h);
+	return &res;
+}
+
+// ==========================================================================
+// METHOD DBManager::dohotquery
+// ==========================================================================
+value *DBManager::dohotquery (dbhotquery q, const value &args)
+{
+    returnclass (value) res retain;
+    
+    // Only the reading hot statements come through here, the writing
+    // ones (copyprototype-insert) run on the writer through _dohotquery.
+    dbconnection *c = acquirereader ();
+    if (! c) return &res;
+    
+    res = _runhotquery (c, q, args);
+    releasereader (c);
+    return &res;
+}
+
+// ==========================================================================
+// METHOD DBManager::_dohotquery
+// ==========================================================================
+value *DBManager::_dohotquery (dbhotquery q, const value &args)
+{
+	return _runhotquery (dbwriter.o, q, args);
+}
+
+// ==========================================================================
+// METHOD DBManager::_runhotquery
+// ==========================================================================
+value *DBManager::_runhotquery (dbconnection *c, dbhotquery q,
+								const value &args)
+{
+	returnclass (value) res retain;
+	const dbhotquerydef &def = hotqueries[q];
+	sqlite3_stmt *qhandle;
+	int qres;
+	dbprofslot *prof = dbprofhot (q);
+	long long t1, t2, t3;
+	
+	t1 = dbusecnow ();
+	qhandle = _preparehot (c, q, args);
+	if (! qhandle)
+	{
+		dbprofrecord (prof, dbusecnow() - t1, 0, 0, SQLITE_ERROR);
 		return &res; // empty
 	}
+
+	t2 = dbusecnow ();
+	_stepstatement (c->h, qhandle, def.sql, res);
+
+	// sqlite3_reset reports the error of the last step, just like
+	// sqlite3_finalize does for one-shot statements.
+	qres = sqlite3_reset (qhandle);
+	sqlite3_clear_bindings (qhandle);
+	t3 = dbusecnow ();
+	dbprofrecord (prof, t2-t1, t3-t2, res["rows"].count(), qres);
+	
+	if ((qres == SQLITE_OK) && (! sqlite3_stmt_readonly (qhandle)))
+	{
+		res["insertid"] = sqlite3_last_insert_rowid (c->h);
+	}
+
+	if (qres != SQLITE_OK)
+	{
+		lasterror.crop();
+		lasterror.printf ("sqlite3_step(%s) failed: %s", def.sql,
+						  sqlite3_errmsg (c->h));
+		errorcode = ERR_DBMANAGER_FAILURE;
+		res.clear();
+	}
+
+	return &res;
+}
+
+// ==========================================================================
+// METHOD DBManager::_preparehot
+// ==========================================================================
+sqlite3_stmt *DBManager::_preparehot (dbconnection *c, dbhotquery q,
+									  const value &args)
+{
+	const dbhotquerydef &def = hotqueries[q];
+	sqlite3_stmt *qhandle = c->hotstmt[q];
+
+	if (qhandle)
+	{
+		__sync_fetch_and_add (&hothits[q], 1);
+	}
+	else
+	{
+		__sync_fetch_and_add (&hotmisses[q], 1);
+		if (sqlite3_prepare_v2 (c->h, def.sql, -1, &qhandle, 0) != SQLITE_OK)
+		{
+			errorcode = ERR_DBMANAGER_FAILURE;
+			lasterror.crop();
+			lasterror.printf ("sqlite3_prepare_v2(%s) failed: %s", def.sql,
+							  sqlite3_errmsg (c->h));
+			return NULL;
+		}
+		c->hotstmt[q] = qhandle;
+	}
+
+	if (dbbindargs (qhandle, def.args, args) != SQLITE_OK)
+	{
+		sqlite3_reset (qhandle);
+		sqlite3_clear_bindings (qhandle);
+		errorcode = ERR_DBMANAGER_FAILURE;
+		lasterror.crop();
+		lasterror.printf ("sqlite3_bind(%s) failed: %s", def.sql,
+						  sqlite3_errmsg (c->h));
+		return NULL;
+	}
+
+	return qhandle;
+}
+
+// ==========================================================================
+// STATIC METHOD DBManager::getStatementStats
+// ==========================================================================
+value *DBManager::getStatementStats (void)
+{
+	returnclass (value) res retain;
+
+	// Every pooled connection prepares its own copy, so the misses
+	// add up to the number of connections that ran the statement.
+	for (int i=0; i<HQ_COUNT; ++i)
+	{
+		res[hotqueries[i].tag] =
+			$("hits", hothits[i]) ->
+			$("misses", hotmisses[i]);
+	}
+
+	return &res;
+}
+
+// ==========================================================================
+// STATIC METHOD DBManager::getQueryProfile
+// ==========================================================================
+value *DBManager::getQueryProfile (void)
+{
+	returnclass (value) res retain;
 	
+	for (int i=0; i<DBPROF_SIZE; ++i)
+	{
+		const dbprofslot &p = dbprof[i];
+		if (p.state != DBPROF_READY) continue;
+		if (! p.calls) continue;
+		
+		value &r = res[p.tag];
+		r["calls"] = p.calls;
+		r["rows"] = p.rows;
+		r["busy"] = p.busy;
+		r["errors"] = p.errors;
+		r["preptotal"] = (unsigned int) (p.preptime / 1000); // msecs
+		r["steptotal"] = (unsigned int) (p.steptime / 1000);
+		r["prepavg"] = (unsigned int) (p.preptime / p.calls);
+		r["stepavg"] = (unsigned int) (p.steptime / p.calls);
+		r["stepp50"] = dbprofpercentile (p.step, p.calls, 50);
+		r["stepp95"] = dbprofpercentile (p.step, p.calls, 95);
+		r["stepp99"] = dbprofpercentile (p.step, p.calls, 99);
+		
+		// histograms by upper bound of the bucket in usecs
+		for (int b=0; b<DBPROF_BUCKETS; ++b)
+		{
+			string bound;
+			bound.printf ("%u", b ? (1U << b) : 0);
+			if (p.prep[b]) r["prephist"][bound] = p.prep[b];
+			if (p.step[b]) r["stephist"][bound] = p.step[b];
+		}
+	}
+	
+	return &res;
+}
+
+// ==========================================================================
+// STATIC METHOD DBManager::resetQueryProfile
+// ==========================================================================
+void DBManager::resetQueryProfile (void)
+{
+	// Tags stay where they are, statements that run while the counters
+	// are cleared may be counted partially.
+	for (int i=0; i<DBPROF_SIZE; ++i)
+	{
+		dbprofslot &p = dbprof[i];
+		if (p.state != DBPROF_READY) continue;
+		
+		p.calls = p.rows = p.busy = p.errors = 0;
+		p.preptime = p.steptime = 0;
+		for (int b=0; b<DBPROF_BUCKETS; ++b) p.prep[b] = p.step[b] = 0;
+	}
+}
+
+// ==========================================================================
+// METHOD DBManager::_stepstatement
+// ==========================================================================
+void DBManager::_stepstatement (sqlite3 *h, sqlite3_stmt *qhandle,
+								const char *query, value &res)
+{
+	int colcount=0;
+	int qres;
+
 	bool done=false;
 	while(!done)
 	{
-		rt1 = kernel.time.unow();
     	qres = sqlite3_step(qhandle);
 
 		switch(qres)
 		{
-			case SQLITE_BUSY:
-				sleep(1);
-				break;
-				
 			case SQLITE_ROW:
 				res["columncount"] = colcount = sqlite3_column_count(qhandle);
 				if(colcount == 0)
 				{
-					res["rowschanged"]=sqlite3_changes(dbhandle.o);
+					res["rowschanged"]=sqlite3_changes(h);
 					done=true;
 				}
 				else
@@ -1414,17 +3554,21 @@ value *DBManager::_dosqlite (const statstring &query)
 				    value row;
 				    for(int i=0; i < colcount; i++)
 				    {
-					    if(sqlite3_column_type(qhandle, i) != SQLITE_NULL)
+					    int ctype = sqlite3_column_type(qhandle, i);
+					    if(ctype == SQLITE_BLOB)
+					    {
+					    	// binary content, may contain NUL bytes
+					    	string blob;
+					    	blob.strcpy((const char *) sqlite3_column_blob(qhandle, i),
+					    				sqlite3_column_bytes(qhandle, i));
+						    row[sqlite3_column_name(qhandle, i)]=blob;
+					    }
+					    else if(ctype != SQLITE_NULL)
 						    row[sqlite3_column_name(qhandle, i)]=(const char *) sqlite3_column_text(qhandle, i);
                         // CORE->log (log::debug, "DB", "column text: %s" %format (sqlite3_column_text(qhandle,i)));
 				    }
 				    res["rows"].newval()=row;
-            		rowcount++;		
 				}
-				
-		        rt2 = kernel.time.unow();
-		        rt1 = rt2 - rt1;
-                CORE->log (log::debug, "DB", "row %d: %U usecs", rowcount, rt1.getusec());
 				break;
 
 			case SQLITE_DONE:
@@ -1434,107 +3578,390 @@ value *DBManager::_dosqlite (const statstring &query)
 			case SQLITE_MISUSE:  // fallthrough
 			case SQLITE_ERROR:
             default:
-                CORE->log (log::debug, "DB", "sqlite3_step(%s) failed: %s" %format (query, sqlite3_errmsg(dbhandle.o)));
+                CORE->log (log::debug, "DB", "sqlite3_step(%s) failed: %s" %format (query, sqlite3_errmsg(h)));
 				done=true;
 				break;
 		}
 	}
+}
+
+// ==========================================================================
+// CONSTRUCTOR DBCursor
+// ==========================================================================
+DBCursor::DBCursor (DBManager &pdb) : db (pdb)
+{
+	c = NULL;
+	st = NULL;
+	sql = "";
+	hot = false;
+	error = false;
+	prof = NULL;
+	preptime = steptime = 0;
+	rows = 0;
+	result = SQLITE_OK;
+}
+
+// ==========================================================================
+// DESTRUCTOR DBCursor
+// ==========================================================================
+DBCursor::~DBCursor (void)
+{
+	close ();
+}
+
+// ==========================================================================
+// METHOD DBCursor::open
+// ==========================================================================
+bool DBCursor::open (const DBQuery &query)
+{
+	close ();
+	CORE->log (log::debug, "DB", "cursor: %s" %format (query.text));
+	
+	c = db.acquirereader ();
+	if (! c) return false;
+	
+	long long t1 = dbusecnow ();
+	
+	if ((sqlite3_prepare_v2 (c->h, query.text.str(), -1, &st, 0) != SQLITE_OK)
+		|| (dbbindargs (st, query.types.str(), query.args) != SQLITE_OK))
+	{
+		dbprofrecord (dbprofquery (query.text.str()), dbusecnow() - t1, 0,
+					  0, SQLITE_ERROR);
+		db.errorcode = ERR_DBMANAGER_FAILURE;
+		db.lasterror = "sqlite3_prepare(%s) failed: %s"
+						%format (query.text, sqlite3_errmsg (c->h));
+		if (st) sqlite3_finalize (st);
+		st = NULL;
+		close ();
+		return false;
+	}
+	
+	sql = sqlite3_sql (st);
+	hot = false;
+	error = false;
+	prof = dbprofquery (sql);
+	preptime = dbusecnow() - t1;
+	return true;
+}
+
+bool DBCursor::open (dbhotquery q, const value &args)
+{
+	close ();
+	
+	c = db.acquirereader ();
+	if (! c) return false;
+	
+	long long t1 = dbusecnow ();
+	
+	st = db._preparehot (c, q, args);
+	if (! st)
+	{
+		dbprofrecord (dbprofhot (q), dbusecnow() - t1, 0, 0, SQLITE_ERROR);
+		close ();
+		return false;
+	}
+	
+	sql = sqlite3_sql (st);
+	hot = true;
+	error = false;
+	prof = dbprofhot (q);
+	preptime = dbusecnow() - t1;
+	return true;
+}
+
+// ==========================================================================
+// METHOD DBCursor::close
+// ==========================================================================
+void DBCursor::close (void)
+{
+	if (st)
+	{
+		// Cached statements stay with the connection, only their state
+		// and bindings are cleared.
+		if (hot)
+		{
+			sqlite3_reset (st);
+			sqlite3_clear_bindings (st);
+		}
+		else
+		{
+			sqlite3_finalize (st);
+		}
+		st = NULL;
+		
+		dbprofrecord (prof, preptime, steptime, rows, result);
+		prof = NULL;
+		preptime = steptime = 0;
+		rows = 0;
+		result = SQLITE_OK;
+	}
+	
+	if (c)
+	{
+		db.releasereader (c);
+		c = NULL;
+	}
+}
+
+// ==========================================================================
+// METHOD DBCursor::next
+// ==========================================================================
+bool DBCursor::next (void)
+{
+	if (! st) return false;
+	
+	while (true)
+	{
+		long long t1 = dbusecnow ();
+		int qres = sqlite3_step (st);
+		steptime += dbusecnow() - t1;
+		
+		switch (qres)
+		{
+			case SQLITE_ROW:
+				rows++;
+				return true;
+			
+			case SQLITE_DONE:
+				return false;
+			
+			default:
+				result = qres;
+				error = true;
+				db.errorcode = ERR_DBMANAGER_FAILURE;
+				db.lasterror = "sqlite3_step(%s) failed: %s"
+								%format (sql, sqlite3_errmsg (c->h));
+				CORE->log (log::debug, "DB", "%s" %format (db.lasterror));
+				return false;
+		}
+	}
+}
+
+// ==========================================================================
+// METHOD DBCursor::isnull
+// ==========================================================================
+bool DBCursor::isnull (int col)
+{
+	return (sqlite3_column_type (st, col) == SQLITE_NULL);
+}
+
+// ==========================================================================
+// METHOD DBCursor::ival
+// ==========================================================================
+int DBCursor::ival (int col)
+{
+	return sqlite3_column_int (st, col);
+}
+
+// ==========================================================================
+// METHOD DBCursor::cval
+// ==========================================================================
+const char *DBCursor::cval (int col)
+{
+	const char *res = (const char *) sqlite3_column_text (st, col);
+	return res ? res : "";
+}
+
+// ==========================================================================
+// METHOD DBCursor::sval
+// ==========================================================================
+string *DBCursor::sval (int col)
+{
+	returnclass (string) res retain;
 	
-	qres = sqlite3_finalize(qhandle);
-	if (qres != SQLITE_OK)
+	if (sqlite3_column_type (st, col) == SQLITE_BLOB)
 	{
-    // CORE->log (log::debug, "DB", "sqlite3_finalize(%s) failed (%s): "
-    //      "%s" %format (query, sqlite3_errmsg(dbhandle.o)));
-				  
-		lasterror.crop();
-		lasterror.printf("sqlite3_finalize(%s) failed: %s", query.cval(), sqlite3_errmsg(dbhandle.o));
-		if (qres == SQLITE_CONSTRAINT)
-		{
-			lasterror = "object already exists";
-		}
-		errorcode = ERR_DBMANAGER_FAILURE;
-		res.clear();
-		return &res;
+		res.strcpy ((const char *) sqlite3_column_blob (st, col),
+					sqlite3_column_bytes (st, col));
 	}
-	res["insertid"]=sqlite3_last_insert_rowid(dbhandle.o);
-	t2 = kernel.time.unow();
-	t1 = t2 - t1;
-  // CORE->log (log::debug, "DB", "dosqlite (%U usecs) returning result of: %s", t1.getusec(), query.cval()); 
+	else res = cval (col);
 	return &res;
 }
 
-bool DBManager::checkschema (void)
+// ==========================================================================
+// CONSTRUCTOR DBQuery
+// ==========================================================================
+DBQuery::DBQuery (void)
 {
-	return true; // FIXME: do actual check
 }
 
-// HACK: removed const so that sval() for the classid int works
-string *DBManager::escapeforsql (const statstring &glue, const statstring &sep, value &vars)
+DBQuery::DBQuery (const char *sql)
+{
+	text = sql;
+}
+
+DBQuery::DBQuery (const string &sql)
+{
+	text = sql;
+}
+
+// ==========================================================================
+// METHOD DBQuery::add
+// ==========================================================================
+DBQuery &DBQuery::add (const char *sql)
+{
+	text.strcat (sql);
+	return *this;
+}
+
+DBQuery &DBQuery::add (const string &sql)
+{
+	text.strcat (sql);
+	return *this;
+}
+
+DBQuery &DBQuery::add (const DBQuery &q)
+{
+	text.strcat (q.text);
+	types.strcat (q.types);
+	foreach (a, q.args) args.newval() = a;
+	return *this;
+}
+
+// ==========================================================================
+// METHOD DBQuery::arg
+// ==========================================================================
+DBQuery &DBQuery::arg (int i)
+{
+	text.strcat ('?');
+	types.strcat ('i');
+	args.newval() = i;
+	return *this;
+}
+
+DBQuery &DBQuery::arg (const string &s)
+{
+	text.strcat ('?');
+	types.strcat ('s');
+	args.newval() = s;
+	return *this;
+}
+
+// ==========================================================================
+// METHOD DBQuery::content
+// ==========================================================================
+DBQuery &DBQuery::content (const string &s)
+{
+	text.strcat ('?');
+	types.strcat ('c');
+	args.newval() = s;
+	return *this;
+}
+
+// ==========================================================================
+// METHOD DBQuery::column
+// ==========================================================================
+DBQuery &DBQuery::column (const value &v)
+{
+	// only object content can be in the binary format, any other text
+	// is text whatever its first byte
+	if (v.label() == "content") return content (v.sval());
+	return arg (v.sval());
+}
+
+// ==========================================================================
+// METHOD DBQuery::fields
+// ==========================================================================
+DBQuery &DBQuery::fields (const char *sep, const value &vars)
 {
-	returnclass (string) res retain;
 	bool firstiter = true;
 	
-	value repl;
-	repl["'"] = "''";
-	foreach(v, vars)
+	// Values are bound the way they were quoted before, as text, with
+	// column affinity taking care of ids.
+	foreach (v, vars)
 	{
-		if(firstiter)
-			firstiter = false;
-		else
-			res.strcat(sep.sval());
-		
-		// column-name
-		res.strcat(v.label().sval());
-
-		// glue
-		res.strcat(glue.sval());
+		if (firstiter) firstiter = false;
+		else text.strcat (sep);
 		
-		// value
-		res.strcat("'");
-		string escaped = new string(v.sval());
-		escaped.replace(repl);
-		res.strcat(escaped);
-		res.strcat("'");
+		text.strcat (v.label().sval());
+		text.strcat ('=');
+		column (v);
 	}
 	
-	return &res;
+	return *this;
 }
 
-string *DBManager::escapeforinsert (const value &vars)
+// ==========================================================================
+// METHOD DBQuery::values
+// ==========================================================================
+DBQuery &DBQuery::values (const value &vars)
 {
-	returnclass (string) res retain;
-	string res2;
 	bool firstiter = true;
 	
-	res = "(";
-	res2 = "VALUES(";
+	text.strcat ('(');
+	foreach (v, vars)
+	{
+		if (firstiter) firstiter = false;
+		else text.strcat (',');
+		text.strcat (v.label().sval());
+	}
 	
-	foreach(v, vars)
+	text.strcat (") VALUES(");
+	firstiter = true;
+	foreach (v, vars)
 	{
-		if(firstiter)
-			firstiter = false;
-		else
-		{
-			res.strcat(',');
-			res2.strcat(',');
-		}
-			
-		// column-name
-		res.strcat(v.label().sval());
+		if (firstiter) firstiter = false;
+		else text.strcat (',');
+		column (v);
+	}
+	
+	text.strcat (')');
+	return *this;
+}
 
-		// value
-		// FIXME: handle NULL
-		res2.strcat("'");
-		string escaped = sqlstringescape(v.sval());
-		res2.strcat(escaped);
-		res2.strcat("'");
+// ==========================================================================
+// METHOD DBManager::checkschema
+// ==========================================================================
+bool DBManager::checkschema (void)
+{
+	sqlite3 *h = dbwriter.o->h;
+	sqlite3_stmt *st;
+	int version = 0;
+	int latest = 0;
+	
+	while(dbmigrations[latest]) latest++;
+	
+	if(sqlite3_prepare_v2(h, "PRAGMA user_version", -1, &st, 0) != SQLITE_OK)
+	{
+		CORE->log (log::error, "DB", "Could not read schema version: %s"
+				   %format (sqlite3_errmsg(h)));
+		return false;
 	}
+	if(sqlite3_step(st) == SQLITE_ROW)
+		version = sqlite3_column_int(st, 0);
+	sqlite3_finalize(st);
 	
-	res.strcat(") ");
-	res.strcat(res2);
-	res.strcat(")");
+	if(version > latest)
+	{
+		CORE->log (log::error, "DB", "Database schema version %i is newer "
+				   "than this release knows (%i)" %format (version, latest));
+		return false;
+	}
 	
-	return &res;
+	// Each step goes in with its version bump in one transaction, so a
+	// failed step leaves the database at the previous version.
+	for(; version < latest; ++version)
+	{
+		string q;
+		char *err = NULL;
+		
+		q.printf("BEGIN; %s PRAGMA user_version=%d; COMMIT;",
+				 dbmigrations[version], version+1);
+		
+		if(sqlite3_exec(h, q.str(), NULL, NULL, &err) != SQLITE_OK)
+		{
+			CORE->log (log::error, "DB", "Schema migration to version %i "
+					   "failed: %s" %format (version+1, err ? err : "unknown"));
+			if(err) sqlite3_free(err);
+			sqlite3_exec(h, "ROLLBACK", NULL, NULL, NULL);
+			return false;
+		}
+		
+		CORE->log (log::info, "DB", "Schema migrated to version %i"
+				   %format (version+1));
+	}
+	
+	return true;
 }
 
 string *DBManager::serialize(const value &members)
@@ -1542,83 +3969,41 @@ string *DBManager::serialize(const value &members)
 	returnclass (string) res retain;
 	
 	DEBUG.storeFile ("DB", "members", members, "serialize");
-	res=members.toxml(value::compact, schema);
-	DEBUG.storeFile ("DB", "res", res, "serialize");
 	
-	return &res;
-}
-
-value *DBManager::deserialize(const string &content)
-{
-	returnclass (value) res retain;
+	// Attributes would be lost in msgpack, xml keeps them.
+	if(dbhasattributes(members))
+	{
+		res = members.toxml(value::compact, schema);
+		return &res;
+	}
 	
-	res.fromxml(content, schema);
+	string packed = members.tomsgpack();
+	res.strcat(DBCONTENT_MSGPACK);
+	res.strcat(packed);
 	
 	return &res;
 }
 
-value *DBManager::filter(const value &members, int localclassid)
+value *DBManager::deserialize(const string &content)
 {
 	returnclass (value) res retain;
 	
-	string query;
-	
-	query.printf("SELECT /* filter */ content FROM objects WHERE id=%d", localclassid);
-	value classdbres = dosqlite(query);
-	
-	// FIXME: check count()
-	value classdata;
-	classdata.fromxml(classdbres["rows"][0]["content"].sval());
-		
-	// string s = members.toxml();
-	// string s2 = classdata.toxml();
-	// CORE->log(log::debug, "DB", "(%s) deref: (%d, %s)", DEBUG.uuid().cval(), localclassid, s.cval());
-	// CORE->log(log::debug, "DB", "(%s) deref classdef: (%s)", DEBUG.uuid().cval(), s2.cval());
-	foreach(field, members)
-	{
-		if(!classdata[field.id()].attribexists("privateformodule"))
-		{
-			res[field.id()]=field;
-		}
-	}
+	// XML content always starts with '<', so a leading format byte
+	// can never be mistaken for an old-style row.
+	if(content.strlen() && content[0] == DBCONTENT_MSGPACK)
+		res.frommsgpack(content.mid(1));
+	else
+		res.fromxml(content, schema);
 	
 	return &res;
 }
 
-value *DBManager::hidepasswords(const value &members, int localclassid, bool tagonly)
+string *DBManager::serializeclass(const value &classdata)
 {
-	returnclass (value) res retain;
-	
-	string query;
+	returnclass (string) res retain;
 	
-  // CORE->log(log::debug, "DB", "hidepasswords: (%d, %s)", localclassid, tagonly ? "EGWEL" : "EGNIE");
-    // DEBUG.storeFile("DB", "members", members, "hidepasswords");
+	res=classdata.toxml(value::compact, schema);
 	
-	value classdata = getClassData(localclassid);
-		
-	// string s = members.toxml();
-	// string s2 = classdata.toxml();
-	// CORE->log(log::debug, "DB", "(%s) deref: (%d, %s)", DEBUG.uuid().cval(), localclassid, s.cval());
-	// CORE->log(log::debug, "DB", "(%s) deref classdef: (%s)", DEBUG.uuid().cval(), s2.cval());
-	foreach(field, members)
-	{
-		if(classdata[field.id()]("type") == "password")
-		{
-			if(tagonly)
-			{
-				res[field.id()]=field;
-				res[field.id()]("type") = "password";
-			}
-			else
-			{
-				res[field.id()] = "";
-			}
-		}
-		else
-		{
-			res[field.id()]=field;
-		}
-	}
 	return &res;
 }
 
@@ -1659,32 +4044,13 @@ bool DBManager::applyFieldWhiteList(value &objs, value &whitel)
 	return true;
 }
 
-string *DBManager::sqlstringescape(const string &s)
-{
-	returnclass (string) res retain;
-	
-	res=string(s);
-	value rep;
-
-    // according to the sqlite docs on their %q, this is the only replace we need
-	rep["'"]="''";
-
-	res.replace(rep);
-	
-	return &res;
-}
-
 bool DBManager::login(const statstring &username, const statstring &password)
 {	
 	md5checksum csum;
-	string query;
-	query = "SELECT /* login */ uuid, content FROM objects WHERE ";
-	value where;
-	where["metaid"]=username;
-	where["class"]=findclassid("User");
+	DBQuery query ("SELECT /* login */ uuid, content FROM objects WHERE metaid=");
+	query.arg(username.sval()).add(" AND class=").arg(findclassid("User"));
 	
     useruuid = "";
-	query.strcat(escapeforsql("=", " AND ", where));
 	value qres = dosqlite(query); // TODO: handle 'not found'
     if(qres["rows"].count())
 	{
@@ -1698,6 +4064,7 @@ bool DBManager::login(const statstring &username, const statstring &password)
 			if(uuid!="")
 			{
 				useruuid=uuid;
+				loadpowerset();
 				return true;
 			}
 		}
@@ -1716,16 +4083,16 @@ void DBManager::getCredentials(value &creds)
 
 void DBManager::setCredentials(const value &creds)
 {
+	god = false;
+	
 	if( creds.exists("useruuid") )
 	{
 		useruuid = creds["useruuid"];
 	}
 	else
 	{
-		string query="SELECT /* findlocalid */ uuid FROM objects WHERE ";
-		value where;
-		where["id"]=creds["userid"];
-		query.strcat(escapeforsql("=", " AND ", where));
+		DBQuery query ("SELECT /* findlocalid */ uuid FROM objects WHERE id=");
+		query.arg(creds["userid"].ival());
 		value dbres = dosqlite(query); 
 		if(!dbres["rows"].count() > 0)
 		{
@@ -1737,17 +4104,15 @@ void DBManager::setCredentials(const value &creds)
 			useruuid = "";
 		}
 	}
+	
+	loadpowerset();
 }
 
 bool DBManager::userLogin(const statstring &username)
 {	
-	string query;
-	query = "SELECT /* userLogin */ id, uuid FROM objects WHERE ";
-	value where;
-	where["metaid"]=username;
-	where["class"]=findclassid("User");
+	DBQuery query ("SELECT /* userLogin */ id, uuid FROM objects WHERE metaid=");
+	query.arg(username.sval()).add(" AND class=").arg(findclassid("User"));
 	
-	query.strcat(escapeforsql("=", " AND ", where));
 	value qres = dosqlite(query);
     if(!qres["rows"].count())
 	{
@@ -1761,6 +4126,7 @@ bool DBManager::userLogin(const statstring &username)
 	if(id)
 	{
 		useruuid=qres["rows"][0]["uuid"];
+		loadpowerset();
 		return true;
 	}
 	
@@ -1772,6 +4138,7 @@ bool DBManager::userLogin(const statstring &username)
 void DBManager::logout(void)
 {
 	useruuid="";
+	powerset.clear();
 }
 
 string &DBManager::getLastError(void)
@@ -1779,55 +4146,322 @@ string &DBManager::getLastError(void)
 	return lasterror;
 }
 
-int DBManager::getLastErrorCode(void)
+int DBManager::getLastErrorCode(void)
+{
+	return errorcode;
+}
+
+int DBManager::findlocalid(const statstring &uuid, int *classid)
+{
+	return _lookupid(uuid, classid, false);
+}
+
+int DBManager::_findlocalid(const statstring &uuid)
+{
+	return _lookupid(uuid, NULL, true);
+}
+
+// ==========================================================================
+// METHOD DBManager::_lookupid
+// ==========================================================================
+int DBManager::_lookupid(const statstring &uuid, int *classid, bool onwriter)
+{
+	int localid, cid;
+	unsigned int gen;
+	
+    if( !uuid ) 
+    {
+		lasterror.crop();
+		lasterror.printf("Localid for uuid '' not found");
+		return 0;
+    }
+    
+    if(idcache.get(uuid, localid, cid))
+    {
+    	if(classid) *classid = cid;
+    	return localid;
+    }
+    
+    gen = idcache.generation();
+   
+	value dbres;
+	if(onwriter) dbres = _dohotquery (HQ_FINDLOCALID, $(uuid));
+	else dbres = dohotquery (HQ_FINDLOCALID, $(uuid)); // FIXME: handle failure
+	
+	if(!dbres["rows"].count())
+	{
+		lasterror.crop();
+		lasterror.printf("Localid for uuid %s not found", uuid.cval());
+		return 0;
+	}
+	
+	localid = dbres["rows"][0]["id"].ival();
+	cid = dbres["rows"][0]["class"].ival();
+	
+	// The writer may be in the middle of a transaction that is rolled
+	// back later, so only committed rows seen by a reader get cached.
+	// Inside a scope the "reader" is the writer connection as well.
+	if(!onwriter && !txdepth) idcache.put(uuid, localid, cid, gen);
+	if(classid) *classid = cid;
+	return localid;
+}
+
+// ==========================================================================
+// STATIC METHOD DBManager::getIdCacheStats
+// ==========================================================================
+value *DBManager::getIdCacheStats (void)
+{
+	returnclass (value) res retain;
+	idcache.stats (res);
+	return &res;
+}
+
+// ==========================================================================
+// METHOD DBManager::migrateContent
+// ==========================================================================
+int DBManager::migrateContent (int &lastid, int batchsize)
+{
+	DBQuery query ("SELECT /* migrateContent */ id, content FROM objects WHERE id > ");
+	query.arg (lastid).add (" AND class <> 1 AND typeof(content) = 'text' ORDER BY id LIMIT ");
+	query.arg (batchsize);
+	
+	value dbres = dosqlite (query);
+	
+	foreach (row, dbres["rows"])
+	{
+		lastid = row["id"].ival();
+		
+		string content = row["content"].sval();
+		if ((! content.strlen()) || (content[0] != '<')) continue;
+		
+		value members = deserialize (content);
+		if (! members.count()) continue;
+		
+		// These stay xml, serialize() would write them back as is.
+		if (dbhasattributes (members)) continue;
+		
+		// Only replace the row if nobody wrote to it since we read it,
+		// an update in between already stored the binary format.
+		DBQuery uquery ("UPDATE /* migrateContent */ objects SET content=");
+		uquery.content (serialize (members));
+		uquery.add (" WHERE id=").arg (lastid);
+		uquery.add (" AND content=").content (content);
+		
+		value qres = dosqlite (uquery);
+		if (! qres)
+		{
+			lasterror = "Error converting content of object %i" %format (lastid);
+			return -1;
+		}
+	}
+	
+	return dbres["rows"].count();
+}
+
+// ==========================================================================
+// METHOD DBManager::benchmarkContent
+// ==========================================================================
+value *DBManager::benchmarkContent (int maxrows, int rounds)
+{
+	returnclass (value) res retain;
+	
+	DBQuery query ("SELECT /* benchmarkContent */ content FROM objects WHERE class <> 1 LIMIT ");
+	query.arg (maxrows);
+	
+	value dbres = dosqlite (query);
+	value objs, xmlrows, binrows;
+	int xmlbytes = 0, binbytes = 0;
+	
+	foreach (row, dbres["rows"])
+	{
+		value &o = objs.newval();
+		o = deserialize (row["content"].sval());
+		
+		string x = o.toxml (value::compact, schema);
+		string b = serialize (o);
+		xmlbytes += x.strlen();
+		binbytes += b.strlen();
+		xmlrows.newval() = x;
+		binrows.newval() = b;
+	}
+	
+	long long t1, t2, t3, t4, t5;
+	
+	t1 = dbusecnow ();
+	for (int r=0; r < rounds; ++r)
+		foreach (o, objs) { string x = o.toxml (value::compact, schema); }
+	
+	t2 = dbusecnow ();
+	for (int r=0; r < rounds; ++r)
+		foreach (o, objs) { string b = serialize (o); }
+	
+	t3 = dbusecnow ();
+	for (int r=0; r < rounds; ++r)
+		foreach (x, xmlrows) { value v = deserialize (x.sval()); }
+	
+	t4 = dbusecnow ();
+	for (int r=0; r < rounds; ++r)
+		foreach (b, binrows) { value v = deserialize (b.sval()); }
+	
+	t5 = dbusecnow ();
+	
+	res["rows"] = objs.count();
+	res["rounds"] = rounds;
+	res["xml"] = $("bytes", xmlbytes)->
+				 $("encode", (int) (t2 - t1))->
+				 $("decode", (int) (t4 - t3));
+	res["msgpack"] = $("bytes", binbytes)->
+					 $("encode", (int) (t3 - t2))->
+					 $("decode", (int) (t5 - t4));
+	
+	return &res;
+}
+
+// ==========================================================================
+// METHOD DBWriterThread::run
+// ==========================================================================
+void DBWriterThread::run (void)
+{
+	DBManager db;
+	dbwritejob *batch[DBWRITE_BATCH];
+	bool ok = db.init ();
+	
+	if (! ok)
+	{
+		CORE->log (log::error, "DB", "Writer thread: %s"
+				   %format (db.getLastError()));
+	}
+	
+	pthread_mutex_lock (&dbqlock);
+	dbqthread = pthread_self ();
+	dbqrunning = ok;
+	
+	while (true)
+	{
+		while ((! dbqhead) && (! dbqstop))
+		{
+			pthread_cond_wait (&dbqwork, &dbqlock);
+		}
+		
+		// the queue is drained before stopping
+		if (! dbqhead) break;
+		
+		long long now = dbusecnow ();
+		int count = 0;
+		
+		while (dbqhead && (count < DBWRITE_BATCH))
+		{
+			dbwritejob *j = dbqhead;
+			
+			// a scope gets the writer in between batches
+			if ((! j->query) && count) break;
+			
+			dbqhead = j->next;
+			if (! dbqhead) dbqtail = NULL;
+			dbqdepth--;
+			
+			long long waited = now - j->queued;
+			dbqwaittotal += waited;
+			if (waited > dbqwaitmax) dbqwaitmax = waited;
+			
+			if (! j->query)
+			{
+				dbqleases++;
+				dbqleased = true;
+				j->state = DBJOB_DONE;
+				pthread_cond_broadcast (&dbqdone);
+				
+				while (dbqleased) pthread_cond_wait (&dbqwork, &dbqlock);
+				break;
+			}
+			
+			j->state = DBJOB_RUNNING;
+			batch[count++] = j;
+		}
+		
+		if (! count) continue;
+		
+		pthread_mutex_unlock (&dbqlock);
+		db.runWriteBatch (batch, count);
+		pthread_mutex_lock (&dbqlock);
+		
+		for (int i=0; i<count; ++i) batch[i]->state = DBJOB_DONE;
+		dbqjobs += count;
+		dbqbatches++;
+		pthread_cond_broadcast (&dbqdone);
+	}
+	
+	dbqrunning = false;
+	pthread_mutex_unlock (&dbqlock);
+	
+	db.deinit ();
+	shutdownCondition.broadcast ();
+}
+
+// ==========================================================================
+// METHOD DBWriterThread::shutdown
+// ==========================================================================
+void DBWriterThread::shutdown (void)
 {
-	return errorcode;
+	pthread_mutex_lock (&dbqlock);
+	dbqstop = true;
+	pthread_cond_signal (&dbqwork);
+	pthread_mutex_unlock (&dbqlock);
+	
+	shutdownCondition.wait ();
 }
 
-int DBManager::findlocalid(const statstring &uuid)
+// ==========================================================================
+// METHOD DBContentMigrationThread::run
+// ==========================================================================
+void DBContentMigrationThread::run (void)
 {
-    if( !uuid ) 
-    {
-		lasterror.crop();
-		lasterror.printf("Localid for uuid '' not found");
-		return 0;
-    }
-   
-	string query="SELECT /* findlocalid */ id FROM objects WHERE ";
-	value where;
-	where["uuid"]=uuid;
-	query.strcat(escapeforsql("=", " AND ", where));
-	value dbres = dosqlite(query); // FIXME: handle failure
-	if(!dbres["rows"].count())
+	DBManager db;
+	int lastid = 0;
+	int total = 0;
+	bool done = false;
+	
+	if (! db.init ())
 	{
-		lasterror.crop();
-		lasterror.printf("Localid for uuid %s not found", uuid.cval());
-		return 0;
+		CORE->log (log::error, "DB", "Content migration: %s"
+				   %format (db.getLastError()));
+		done = true;
 	}
-	return dbres["rows"][0]["id"].ival();
-}
-
-int DBManager::_findlocalid(const statstring &uuid)
-{
-    if( !uuid ) 
-    {
-		lasterror.crop();
-		lasterror.printf("Localid for uuid '' not found");
-		return 0;
-    }
-
-	string query="SELECT /* findlocalid */ id FROM objects WHERE ";
-	value where;
-	where["uuid"]=uuid;
-	query.strcat(escapeforsql("=", " AND ", where));
-	value dbres = _dosqlite(query); // FIXME: handle failure
-	if(!dbres["rows"].count())
+	
+	while (true)
 	{
-		lasterror.crop();
-		lasterror.printf("Localid for uuid %s not found", uuid.cval());
-		return 0;
+		// Convert a batch every second, then idle until shutdown.
+		value ev = waitevent (done ? 60000 : 1000);
+		if (ev)
+		{
+			if (ev.type() == "shutdown")
+			{
+				db.deinit ();
+				shutdownCondition.broadcast();
+				return;
+			}
+		}
+		else if (! done)
+		{
+			int cnt = db.migrateContent (lastid, 64);
+			if (cnt < 0)
+			{
+				CORE->log (log::error, "DB", "Content migration stopped: %s"
+						   %format (db.getLastError()));
+				done = true;
+			}
+			else if (cnt == 0)
+			{
+				if (total)
+				{
+					CORE->log (log::info, "DB", "Content migration done, "
+							   "%i rows looked at" %format (total));
+				}
+				done = true;
+			}
+			else total += cnt;
+		}
 	}
-	return dbres["rows"][0]["id"].ival();
 }
 
 // only return false on real errors; 'we already have this class/version'
@@ -1835,7 +4469,6 @@ int DBManager::_findlocalid(const statstring &uuid)
 // FIXME: do something useful with modulename
 bool DBManager::registerClass(const value &classdata)
 {
-	string query;
 	value v;
 	string tmp;
 	
@@ -1863,11 +4496,8 @@ bool DBManager::registerClass(const value &classdata)
 		return false;
 	}
 
-    query="SELECT /* registerClass */ id,uuid FROM objects WHERE ";
-	value where;
-	where["class"]=1;
-	where["metaid"]=classdata ("name");
-	query.strcat(escapeforsql("=", " AND ", where));
+    DBQuery query ("SELECT /* registerClass */ id,uuid FROM objects WHERE class=1 AND metaid=");
+	query.arg(classdata("name").sval());
 	value dbres = dosqlite(query);
   // DEBUG.storeFile("DB", "dbres", dbres, "registerClass");
 	if(dbres["rows"].count()) // zero rows means this class is new
@@ -1881,44 +4511,61 @@ bool DBManager::registerClass(const value &classdata)
 			return false;
 		}
 		
-		value tv = $("content",serialize(classdata));
-		
-		query = "UPDATE /* registerClass */ objects SET ";
-		query.strcat (escapeforsql ("=", ",", tv));
-		query.strcat (" WHERE ");
-		
-		tv = $("uuid",classdata("uuid"));
+		const dbclassinfo *oldci = getclassinfo(row["id"].ival());
+		value oldsearch;
+		if(oldci) oldsearch = oldci->searchfields;
 		
-		query.strcat (escapeforsql ("=", " AND ", tv));
-		value qres = dosqlite(query); // FIXME: handle error
+		DBQuery uquery ("UPDATE /* registerClass */ objects SET content=");
+		uquery.content (serializeclass(classdata));
+		uquery.add (" WHERE uuid=").arg (classdata("uuid").sval());
+		value qres = dosqlite(uquery); // FIXME: handle error
 		if (!qres)
 		{
 			lasterror = "Error updating class definition";
 			return false;
 		}
+		
+		const dbclassinfo *ci = loadclassinfo(row["id"].ival(), classdata("name"), serializeclass(classdata));
+		
+		// objects stored before a field became searchable have no keys
+		bool reindex = (ci->searchfields.count() != oldsearch.count());
+		foreach(field, ci->searchfields)
+		{
+			if(!oldsearch.exists(field.id())) reindex = true;
+		}
+		
+		if(reindex && !_reindexclass(ci->id))
+			return false;
+		
 		return true;
 	}
 		
 	// apparently this class is new to us!
 	
-	query="INSERT /* registerClass */ INTO objects ";
+	DBQuery iquery ("INSERT /* registerClass */ INTO objects ");
 	v["uuid"]=classdata("uuid");
 	v["metaid"]=classdata("name");
 	v["uniquecontext"]=v["class"]=1; // predefined constant for Class Class
-	v["content"]=serialize(classdata);
+	v["content"]=serializeclass(classdata);
 	
     int oldid = findclassid(classdata("name"));
     
-	query.strcat(escapeforinsert(v));
-	value qres = dosqlite(query); // FIXME: handle error
+	iquery.values(v);
+	value qres = dosqlite(iquery); // FIXME: handle error
 	if(!qres)
 		return false;
+	
+	loadclassinfo(qres["insertid"].ival(), classdata("name"), v["content"]);
 		
     if (oldid)
     {
-        query.crop();
-        query.printf("UPDATE /* registerClass */ objects SET class=%d WHERE class=%d", qres["insertid"].ival(), oldid);
-        qres = dosqlite(query);
+        DBQuery cquery ("UPDATE /* registerClass */ objects SET class=");
+        cquery.arg(qres["insertid"].ival()).add(" WHERE class=").arg(oldid);
+        qres = dosqlite(cquery);
+        
+        // every cached object of this class now has a stale class id
+        idcache.clear();
+        
         if(! qres)
         {
         	return false;
@@ -1930,46 +4577,46 @@ bool DBManager::registerClass(const value &classdata)
 
 bool DBManager::reportSuccess(const statstring &uuid)
 {
-	string q;
-	value where;
+	DBQuery q;
 
-	q.printf("DELETE /* reportSuccess */ FROM objects WHERE content='' AND ");
-	where["uuid"]=uuid;
-	q.strcat(escapeforsql("=", " AND ", where));
+	q.add("DELETE /* reportSuccess */ FROM objects WHERE content='' AND uuid=").arg(uuid.sval());
 
+	int localid = findlocalid(uuid);
 	value dbres = dosqlite(q);
+	idcache.remove(uuid);
+	if(localid) dbforgetowner(localid);
 
     return true;
 }
 
 bool DBManager::reportDeleteFailure(const statstring &uuid)
 {
-	string q;
-	value where;
+	DBQuery q;
 
 	ALERT->alert("Object delete failed (%s), deleting from database anyway"% format(uuid));
 
-	q.printf("DELETE /* reportDeleteFailure */ FROM objects WHERE ");
-	where["uuid"]=uuid;
-	q.strcat(escapeforsql("=", " AND ", where));
+	q.add("DELETE /* reportDeleteFailure */ FROM objects WHERE uuid=").arg(uuid.sval());
 
+	int localid = findlocalid(uuid);
 	value dbres = dosqlite(q);
+	idcache.remove(uuid);
+	if(localid) dbforgetowner(localid);
 
     return true;
 }
 
 bool DBManager::reportCreateFailure(const statstring &uuid)
 {
-	string q;
-	value where;
+	DBQuery q;
 
 	ALERT->alert("Object create failed (%s), deleting from database"% format(uuid));
 
-	q.printf("DELETE /* reportCreateFailure */ FROM objects WHERE ");
-	where["uuid"]=uuid;
-	q.strcat(escapeforsql("=", " AND ", where));
+	q.add("DELETE /* reportCreateFailure */ FROM objects WHERE uuid=").arg(uuid.sval());
 
+	int localid = findlocalid(uuid);
 	value dbres = dosqlite(q);
+	idcache.remove(uuid);
+	if(localid) dbforgetowner(localid);
 
     return true;
 	
@@ -1981,14 +4628,11 @@ bool DBManager::reportUpdateFailure(const statstring &uuid)
     return true;
 }
 
-// we iterate upwards from our logged-in user to find all
-// applying limits. a smaller limit overrides a bigger one,
-// any limit overrides infinity, infinity never overrides any limit
-int DBManager::getUserQuota(const statstring &ofclass, const statstring &useruuid, int *usage)
+// ==========================================================================
+// METHOD DBManager::_quotauser
+// ==========================================================================
+bool DBManager::_quotauser(const statstring &useruuid, int &lookupid)
 {
-    int lookupid, localid, quota, realuserid;
-    string q;
-
 	int userid = findlocalid(this->useruuid);
 	
 	if(useruuid)
@@ -1997,7 +4641,7 @@ int DBManager::getUserQuota(const statstring &ofclass, const statstring &useruui
 		if(!lookupid)
 		{
 			lasterror = "User not found";
-			return -2;
+			return false;
 		}
 	}
 	else
@@ -2008,48 +4652,79 @@ int DBManager::getUserQuota(const statstring &ofclass, const statstring &useruui
 	if(lookupid != userid && !haspower(lookupid, userid))
 	{
         lasterror = "Permission denied";
-        return -2;
+        return false;
 	}
-    realuserid=lookupid;
-	localid=findclassid(ofclass);
 	
-	quota=-1;
+	return true;
+}
+
+// ==========================================================================
+// METHOD DBManager::_effectivequota
+// ==========================================================================
+// we iterate upwards from the user to find all applying limits, in one
+// query. a smaller limit overrides a bigger one, any limit overrides
+// infinity, infinity never overrides any limit
+value *DBManager::_effectivequota(int lookupid)
+{
+	returnclass (value) res retain;
+	unsigned int gen = __sync_fetch_and_add(&dbquotagen, 0);
+	statstring ukey = "%i" %format (lookupid);
 	
-	while(1)
+	if(gen != quotagen)
 	{
-		int thisquota;
-        q.crop();
-		q.printf("SELECT /* getUserQuota */ quota FROM classquota WHERE userid=%d AND classid=%d", lookupid, localid);
-		value dbres = dosqlite(q);
-		if(!dbres["rows"].count())
-		{
-			thisquota = -1; // no information -> don't limit!
-		}
-		else
+		quotacache.clear();
+		quotagen = gen;
+	}
+	
+	if(quotacache.exists(ukey))
+	{
+		res = quotacache[ukey];
+		return &res;
+	}
+	
+	DBCursor cur (*this);
+	bool ok = cur.open(HQ_QUOTACHAIN, $(lookupid));
+	if(ok)
+	{
+		while(cur.next())
 		{
-			thisquota=dbres["rows"][0]["quota"].ival();
-		}
-		// smaller limit overrides bigger limit
-		// infinity never overrides anything
-		if((thisquota < quota && thisquota != -1)
-		|| (quota == -1 && thisquota != -1))
-			quota=thisquota;
+			statstring ckey = cur.cval(0);
+			int thisquota = cur.ival(1);
 			
-		q.crop();
-        q.printf("SELECT /* getUserQuota */ owner FROM objects WHERE id=%d", lookupid);
-		dbres = dosqlite(q);
-		if(!dbres["rows"].count() || dbres["rows"][0]["owner"].ival() == 0)
-		{
-			break; // we're done looking stuff up
+			if(thisquota == -1) continue; // no limit
+			if(res.exists(ckey) && res[ckey].ival() <= thisquota) continue;
+			res[ckey] = thisquota;
 		}
-		lookupid=dbres["rows"][0]["owner"].ival();
 	}
 	
+	// a failed read is not cached, the next call tries again
+	if(ok && !cur.failed()) quotacache[ukey] = res;
+	return &res;
+}
+
+// ==========================================================================
+// METHOD DBManager::getUserQuota
+// ==========================================================================
+int DBManager::getUserQuota(const statstring &ofclass, const statstring &useruuid, int *usage)
+{
+    int lookupid, localid, quota;
+
+	if(!_quotauser(useruuid, lookupid))
+		return -2;
+	
+	localid=findclassid(ofclass);
+	
+	value eq = _effectivequota(lookupid);
+	statstring ckey = "%i" %format (localid);
+	quota = eq.exists(ckey) ? eq[ckey].ival() : -1;
+	
 	if(usage)
     {
-    	// calculate usage
-        q.crop();
-        q.printf("SELECT /* getUserQuota */ COUNT(DISTINCT(o.id)) FROM objects o, powermirror p WHERE class=%d AND o.owner=p.userid AND p.powerid=%d", localid, realuserid);
+    	// usage is kept per owner by the quotausage triggers, add up
+    	// everything owned by the users below this one
+        DBQuery q ("SELECT /* getUserQuota */ SUM(usage) FROM quotausage WHERE classid=");
+        q.arg(localid).add(" AND userid IN (SELECT userid FROM powermirror WHERE powerid=");
+        q.arg(lookupid).add(")");
         value dbres = dosqlite(q);
         *usage = dbres["rows"][0][0].ival();
 
@@ -2059,10 +4734,44 @@ int DBManager::getUserQuota(const statstring &ofclass, const statstring &useruui
 	return quota;
 }
 
+// ==========================================================================
+// METHOD DBManager::getUserQuotas
+// ==========================================================================
+bool DBManager::getUserQuotas(value &into, const statstring &useruuid)
+{
+	int lookupid;
+	string cname;
+	
+	into.clear();
+	if(!_quotauser(useruuid, lookupid))
+		return false;
+	
+	value eq = _effectivequota(lookupid);
+	foreach(c, eq)
+	{
+		cname = _classNameFromUUID(atoi(c.id().str()));
+		if(cname.strlen()) into[cname]["quota"] = c.ival();
+	}
+	
+	DBQuery q ("SELECT /* getUserQuotas */ classid, SUM(usage) usage FROM quotausage WHERE userid IN (SELECT userid FROM powermirror WHERE powerid=");
+	q.arg(lookupid).add(") GROUP BY classid");
+	
+	DBCursor cur (*this);
+	if(!cur.open(q))
+		return false; // the cursor has reported the error
+	
+	while(cur.next())
+	{
+		cname = _classNameFromUUID(cur.ival(0));
+		if(cname.strlen()) into[cname]["usage"] = cur.ival(1);
+	}
+	
+	return true;
+}
+
 bool DBManager::setUserQuota(const statstring &ofclass, int count, const statstring &useruuid)
 {
 	int uid,classid;
-	string q;
 	
 	uid=findlocalid(useruuid);
 	if(!uid)
@@ -2076,8 +4785,10 @@ bool DBManager::setUserQuota(const statstring &ofclass, int count, const statstr
         return false;
 	}
 	classid=findclassid(ofclass);
-	q.printf("REPLACE /* setUserQuota */ INTO classquota (userid,classid,quota) VALUES(%d,%d,%d)", uid, classid, count);
+	DBQuery q ("REPLACE /* setUserQuota */ INTO classquota (userid,classid,quota) VALUES(");
+	q.arg(uid).add(",").arg(classid).add(",").arg(count).add(")");
 	value dbres = dosqlite(q);
+	if(dbres) __sync_add_and_fetch(&dbquotagen, 1);
 	
 	return (bool) dbres;
 }
@@ -2089,87 +4800,277 @@ bool DBManager::haspower(int oid, int uid)
 	if(oid == uid)  // TODO: remove this and add it in the places that want it
 		return true;
 
-	string q;
-	q.printf("SELECT /* haspower */ owner FROM objects WHERE id=%d", oid);
-	value dbres=dosqlite(q);
-	if(!dbres["rows"].count())
+	owner = objectowner(oid);
+	if(owner < 0)
 		return false;
 		
-	string tmp=dbres.toxml();
-  // CORE->log(log::debug, "DB", "haspower: %s" %format (tmp));
-	
-	owner=dbres["rows"][0]["owner"];
 	if(owner == uid)
 	    return true;
+	
+	// the logged-in user is answered from memory
+	if(uid > 0 && uid == powerset.userid)
+	{
+		syncpowerset();
+		return powerset.contains(owner);
+	}
 
-	q.crop();
-	q.printf("SELECT /* haspower */ userid, powerid FROM powermirror WHERE userid=%d AND powerid=%d", owner, uid);
-    dbres=dosqlite(q);
+    value dbres=dohotquery(HQ_HASPOWER_MIRROR, $(owner)->$(uid));
 	if(!dbres["rows"].count())
 		return false;
 
 	return true;
 }
 
-void DBManager::enableGodMode(void)
+// ==========================================================================
+// METHOD DBManager::objectowner
+// ==========================================================================
+int DBManager::objectowner(int oid)
 {
-	int classid;
-	string q;
+	if(oid <= 0)
+		return -1;
 	
-	useruuid="";
-	god=true;
+	unsigned long long *slot = dbownerslot(oid);
+	unsigned long long cur = __sync_fetch_and_add(slot, 0);
+	
+	if((int) (cur >> 32) == oid)
+		return (int) (cur & 0xffffffffULL);
+	
+	value dbres=dohotquery(HQ_HASPOWER_OWNER, $(oid));
+	if(!dbres["rows"].count())
+		return -1;
+	
+	int owner = dbres["rows"][0]["owner"].ival();
+	
+	// Only fill the slot if nobody replaced it while we were querying;
+	// a chown that raced with us wins.
+	__sync_bool_compare_and_swap(slot, cur, dbownerpack(oid, owner));
+	return owner;
 }
 
-value *DBManager::getClassData(int classid)
+// ==========================================================================
+// METHOD DBManager::loadpowerset
+// ==========================================================================
+void DBManager::loadpowerset(void)
 {
-	static lock<value> cache_getClassData;
-	string idstring;
-	returnclass (value) res retain;
-	string query;
-
-  // CORE->log(log::debug, "DB", "getClassData %i" %format (classid));
+	powerset.clear();
+	if(!useruuid.strlen())
+		return;
+	
+	int uid = findlocalid(useruuid);
+	if(!uid)
+		return;
+	
+	// take the generation before reading, so that changes that land
+	// while we read get replayed on top
+	sharedsection(powergen)
+	{
+		powerset.gen = powergen.o;
+	}
+	
+	DBQuery query ("SELECT /* loadpowerset */ DISTINCT userid FROM powermirror WHERE powerid=");
+	query.arg(uid);
+	
+	DBCursor cur (*this);
+	if(cur.open(query))
+	{
+		while(cur.next())
+			powerset.insert(cur.ival(0));
+	}
+	
+	powerset.insert(uid);
+	powerset.userid = uid;
+}
 
-	idstring.printf("%i", classid);
-	sharedsection(cache_getClassData)
+// ==========================================================================
+// METHOD DBManager::syncpowerset
+// ==========================================================================
+void DBManager::syncpowerset(void)
+{
+	bool reload = false;
+	
+	sharedsection(powergen)
 	{
-		if(cache_getClassData.exists(idstring))
+		if(powerset.gen == powergen.o)
+			breaksection return;
+		
+		if(powergen.o - powerset.gen > DBPOWERLOG_SIZE)
 		{
-			res=cache_getClassData[idstring];
-      // DEBUG.storeFile("DB", "result-fromcache", res, "getClassData");
-			return &res;
+			reload = true;
+		}
+		else
+		{
+			while(powerset.gen != powergen.o)
+			{
+				powerset.gen++;
+				const dbpowerchange &ch = powerlog[powerset.gen % DBPOWERLOG_SIZE];
+				
+				if(ch.removed)
+					powerset.remove(ch.userid);
+				else if(powerset.contains(ch.creator))
+					powerset.insert(ch.userid);
+			}
 		}
 	}
+	
+	if(reload) loadpowerset();
+}
 
-	query.printf("SELECT /* getClassData */ content FROM objects WHERE id=%d", classid);
-	value classdbres = dosqlite(query);
-	value classdata;
-	classdata.fromxml(classdbres["rows"][0]["content"].sval());
-	res = classdata;
+// ==========================================================================
+// STATIC METHOD DBManager::logpowerchange
+// ==========================================================================
+void DBManager::logpowerchange(int userid, int creator, bool removed)
+{
+	exclusivesection(powergen)
+	{
+		powergen.o++;
+		dbpowerchange &ch = powerlog[powergen.o % DBPOWERLOG_SIZE];
+		ch.userid = userid;
+		ch.creator = creator;
+		ch.removed = removed;
+	}
+}
+
+// ==========================================================================
+// CONSTRUCTOR dbpowerset
+// ==========================================================================
+dbpowerset::dbpowerset (void)
+{
+	ids = NULL;
+	size = alloc = 0;
+	userid = -1;
+	gen = 0;
+}
+
+dbpowerset::dbpowerset (const dbpowerset &orig)
+{
+	ids = NULL;
+	size = alloc = 0;
+	*this = orig;
+}
+
+// ==========================================================================
+// DESTRUCTOR dbpowerset
+// ==========================================================================
+dbpowerset::~dbpowerset (void)
+{
+	if (ids) free (ids);
+}
+
+// ==========================================================================
+// METHOD dbpowerset::operator=
+// ==========================================================================
+dbpowerset &dbpowerset::operator= (const dbpowerset &orig)
+{
+	if (this == &orig) return *this;
+	
+	clear ();
+	for (int i=0; i<orig.size; ++i) insert (orig.ids[i]);
+	userid = orig.userid;
+	gen = orig.gen;
+	return *this;
+}
+
+// ==========================================================================
+// METHOD dbpowerset::contains
+// ==========================================================================
+bool dbpowerset::contains (int id) const
+{
+	int lo = 0;
+	int hi = size - 1;
+	
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (ids[mid] == id) return true;
+		if (ids[mid] < id) lo = mid + 1;
+		else hi = mid - 1;
+	}
+	return false;
+}
+
+// ==========================================================================
+// METHOD dbpowerset::insert
+// ==========================================================================
+void dbpowerset::insert (int id)
+{
+	int pos = size;
+	
+	// ids mostly arrive in ascending order, so search from the back
+	while (pos > 0 && ids[pos-1] > id) pos--;
+	if (pos > 0 && ids[pos-1] == id) return;
+	
+	if (size == alloc)
+	{
+		alloc = alloc ? alloc * 2 : 16;
+		ids = (int *) realloc (ids, alloc * sizeof (int));
+	}
+	
+	memmove (ids + pos + 1, ids + pos, (size - pos) * sizeof (int));
+	ids[pos] = id;
+	size++;
+}
 
-	exclusivesection(cache_getClassData)
+// ==========================================================================
+// METHOD dbpowerset::remove
+// ==========================================================================
+void dbpowerset::remove (int id)
+{
+	for (int i=0; i<size; ++i)
 	{
-		cache_getClassData[idstring]=res;
+		if (ids[i] == id)
+		{
+			memmove (ids + i, ids + i + 1, (size - i - 1) * sizeof (int));
+			size--;
+			return;
+		}
 	}
-  // DEBUG.storeFile("DB", "result-fromdb", res, "getClassData");
+}
+
+// ==========================================================================
+// METHOD dbpowerset::clear
+// ==========================================================================
+void dbpowerset::clear (void)
+{
+	size = 0;
+	userid = -1;
+	gen = 0;
+}
+
+
+void DBManager::enableGodMode(void)
+{
+	int classid;
+	string q;
+	
+	useruuid="";
+	god=true;
+	powerset.clear();
+}
+
+value *DBManager::getClassData(int classid)
+{
+	returnclass (value) res retain;
+	const dbclassinfo *ci = getclassinfo(classid);
+	
+	if(ci) res = ci->classdata;
 	return &res;
 }
 
 bool DBManager::classhasattrib(int classid, const statstring attrib)
 {	
-	value classdata;
+	const dbclassinfo *ci = getclassinfo(classid);
 	
-	classdata=getClassData(classid);
-	return classdata.attribexists(attrib);
+	if(!ci) return false;
+	return ci->classdata.attribexists(attrib);
 }
 
 string *DBManager::classgetattrib(int classid, const statstring attrib)
 {	
-	value classdata;
 	returnclass (string) res retain;
+	const dbclassinfo *ci = getclassinfo(classid);
 	
-	classdata=getClassData(classid);
-	if(classdata.attribexists(attrib))
-		res = classdata(attrib);
+	if(ci && ci->classdata.attribexists(attrib))
+		res = ci->classdata(attrib);
 	return &res;
 }
 
@@ -2190,8 +5091,8 @@ bool DBManager::chown(const statstring &objectuuid, const statstring &useruuid)
         return false;
 	}
 	
-	string query;
-	query.printf("SELECT /* chown */ parent FROM objects WHERE id=%d", objid);
+	DBQuery query ("SELECT /* chown */ parent FROM objects WHERE id=");
+	query.arg(objid);
 	value pdbres = dosqlite(query);
 	if(!pdbres)
 		return false;
@@ -2208,20 +5109,23 @@ bool DBManager::chown(const statstring &objectuuid, const statstring &useruuid)
 		return false;
 	}
 
-    query.crop();
-    query.printf("SELECT /* chown */ COUNT(id) FROM objects WHERE parent=%d", objid);
-    value dbres = dosqlite(query);
+    DBQuery cquery ("SELECT /* chown */ COUNT(id) FROM objects WHERE parent=");
+    cquery.arg(objid);
+    value dbres = dosqlite(cquery);
     if(dbres["rows"][0][0].ival())
     {
         lasterror = "Object is parent of other objects, please chown before creating objects under another";
         return false;
     }
     
-	query.crop();
-	query.printf("UPDATE /* chown */ objects SET owner=%d WHERE id=%d", nuserid, objid);
-	value udbres = dosqlite(query);
+	DBQuery uquery ("UPDATE /* chown */ objects SET owner=");
+	uquery.arg(nuserid).add(" WHERE id=").arg(objid);
+	value udbres = dosqlite(uquery);
 	if(!udbres)
 		return false;
+	
+	dbsetowner(objid, nuserid);
+	__sync_add_and_fetch(&dbquotagen, 1);
 
     return true;
 }
@@ -2279,8 +5183,6 @@ bool DBManager::checkfieldlist(value &members, int classid)
 int DBManager::getSpecialQuota (const statstring &tag, const statstring &useruuid)
 {
     int uid;
-	string q;
-    value v;
 
 	uid=findlocalid(useruuid);
 	if(!haspower(uid, this->useruuid))
@@ -2289,10 +5191,8 @@ int DBManager::getSpecialQuota (const statstring &tag, const statstring &useruui
         return -2;
 	}
 	
-    q=("SELECT /* getSpecialQuota */ quota FROM specialquota WHERE ");
-    v["tag"]=tag;
-    v["userid"]=uid;
-    q.strcat(escapeforsql("=", " AND ", v));
+    DBQuery q ("SELECT /* getSpecialQuota */ quota FROM specialquota WHERE tag=");
+    q.arg(tag.sval()).add(" AND userid=").arg(uid);
     value dbres = dosqlite(q);
 
     return dbres["rows"][0]["quota"];
@@ -2303,7 +5203,6 @@ int DBManager::getSpecialQuotaUsage (const statstring &tag, const statstring &us
 {
     // probably easily done with a left join to powermirror, a WHERE on class, and a SUM
     int lookupid;
-    string q;
 	
 	lookupid = findlocalid(useruuid);
 	if(!lookupid)
@@ -2320,11 +5219,8 @@ int DBManager::getSpecialQuotaUsage (const statstring &tag, const statstring &us
 
 	// calculate usage
 	
-    q="SELECT /* getUserQuota */ SUM(squ.usage) FROM specialquotausage squ LEFT JOIN powermirror p ON squ.userid=p.userid WHERE ";
-    value where;
-    where["p.powerid"]=lookupid;
-    where["squ.tag"]=tag;
-	q.strcat(escapeforsql("=", " AND ", where));
+    DBQuery q ("SELECT /* getUserQuota */ SUM(squ.usage) FROM specialquotausage squ LEFT JOIN powermirror p ON squ.userid=p.userid WHERE p.powerid=");
+    q.arg(lookupid).add(" AND squ.tag=").arg(tag.sval());
     value dbres = dosqlite(q);
 
     return dbres["rows"][0][0].ival();
@@ -2334,8 +5230,6 @@ int DBManager::getSpecialQuotaUsage (const statstring &tag, const statstring &us
 int DBManager::getSpecialQuotaWarning (const statstring &tag, const statstring &useruuid)
 {
     int uid;
-	string q;
-    value v;
 
 	uid=findlocalid(useruuid);
 	if(!haspower(uid, this->useruuid))
@@ -2343,20 +5237,56 @@ int DBManager::getSpecialQuotaWarning (const statstring &tag, const statstring &
         lasterror = "permission denied";
         return -2;
 	}
-    q=("SELECT /* getSpecialQuotaWarning */ warning FROM specialquota WHERE ");
-    v["tag"]=tag;
-    v["userid"]=uid;
-    q.strcat(escapeforsql("=", " AND ", v));
+    DBQuery q ("SELECT /* getSpecialQuotaWarning */ warning FROM specialquota WHERE tag=");
+    q.arg(tag.sval()).add(" AND userid=").arg(uid);
     value dbres = dosqlite(q);
 
     return dbres["rows"][0]["warning"];
 }
 
+/// Get quota, warning level and usage of all tags for a user.
+bool DBManager::getSpecialQuotas (value &into, const statstring &useruuid)
+{
+    int uid;
+
+	into.clear();
+	uid=findlocalid(useruuid);
+	if(!haspower(uid, this->useruuid))
+	{
+        lasterror = "permission denied";
+        return false;
+	}
+	
+	DBQuery q ("SELECT /* getSpecialQuotas */ tag, quota, warning FROM specialquota WHERE userid=");
+	q.arg(uid);
+	value dbres = dosqlite(q);
+	if(!dbres)
+		return false;
+	
+	foreach(row, dbres["rows"])
+	{
+		into[row["tag"].sval()]["quota"] = row["quota"].ival();
+		into[row["tag"].sval()]["warning"] = row["warning"].ival();
+	}
+	
+	DBQuery uq ("SELECT /* getSpecialQuotas */ squ.tag tag, SUM(squ.usage) usage FROM specialquotausage squ LEFT JOIN powermirror p ON squ.userid=p.userid WHERE p.powerid=");
+	uq.arg(uid).add(" GROUP BY squ.tag");
+	dbres = dosqlite(uq);
+	if(!dbres)
+		return false;
+	
+	foreach(row, dbres["rows"])
+	{
+		into[row["tag"].sval()]["usage"] = row["usage"].ival();
+	}
+	
+	return true;
+}
+
 /// Set a non-object quota number for a specific tag/user.
 bool DBManager::setSpecialQuota (const statstring &tag, const statstring &useruuid, int quota, int warning, value &phys)
 {
     int uid;
-	string q;
     value v;
 
 	uid=findlocalid(useruuid);
@@ -2380,10 +5310,8 @@ bool DBManager::setSpecialQuota (const statstring &tag, const statstring &useruu
 	{
 	    int subassigned, ownquota;
         
-        q="SELECT /* setSpecialQuota */ owner FROM objects WHERE ";
-        value where;
-        where["id"]=lookupid;
-    	q.strcat(escapeforsql("=", " AND ", where));
+        DBQuery q ("SELECT /* setSpecialQuota */ owner FROM objects WHERE id=");
+        q.arg(lookupid);
         value dbres = dosqlite(q);
         if(!dbres["rows"].count())
         {
@@ -2392,22 +5320,17 @@ bool DBManager::setSpecialQuota (const statstring &tag, const statstring &useruu
         
         lookupid = dbres["rows"][0]["owner"].ival();
     
-        q="SELECT s.q FROM (SELECT /* setSpecialQuota */ sq.quota q FROM specialquota sq JOIN powermirror p ON sq.userid=p.userid WHERE ";
-        where.clear();
-        where["p.powerid"]=lookupid;
-        where["sq.tag"]=tag;
-    	q.strcat(escapeforsql("=", " AND ", where));
-		q.printf(" AND sq.userid!=%d AND sq.userid!=%d GROUP BY sq.id) s", lookupid, uid);
-        dbres = dosqlite(q);
+        DBQuery aq ("SELECT s.q FROM (SELECT /* setSpecialQuota */ sq.quota q FROM specialquota sq JOIN powermirror p ON sq.userid=p.userid WHERE p.powerid=");
+        aq.arg(lookupid).add(" AND sq.tag=").arg(tag.sval());
+        aq.add(" AND sq.userid!=").arg(lookupid);
+        aq.add(" AND sq.userid!=").arg(uid).add(" GROUP BY sq.id) s");
+        dbres = dosqlite(aq);
 
         subassigned=dbres["rows"][0][0].ival();
         
-        q="SELECT /* setSpecialQuota */ sq.quota FROM specialquota sq WHERE ";
-        where.clear();
-        where["sq.userid"]=lookupid;
-        where["sq.tag"]=tag;
-    	q.strcat(escapeforsql("=", " AND ", where));
-        dbres = dosqlite(q);
+        DBQuery oq ("SELECT /* setSpecialQuota */ sq.quota FROM specialquota sq WHERE sq.userid=");
+        oq.arg(lookupid).add(" AND sq.tag=").arg(tag.sval());
+        dbres = dosqlite(oq);
 
         if(dbres["rows"].count())
         {
@@ -2423,12 +5346,12 @@ bool DBManager::setSpecialQuota (const statstring &tag, const statstring &useruu
 	    }
 	}
 	
-    q=("REPLACE /* setSpecialQuota */ INTO specialquota");
+    DBQuery q ("REPLACE /* setSpecialQuota */ INTO specialquota");
     v["tag"]=tag;
     v["userid"]=uid;
     v["quota"]=quota;
     v["warning"]=warning;
-    q.strcat(escapeforinsert(v));
+    q.values(v);
     
 	value dbres = dosqlite(q);
   // DEBUG.storeFile("DB", "phys", phys, "setSpecialQuota");
@@ -2439,7 +5362,6 @@ bool DBManager::setSpecialQuota (const statstring &tag, const statstring &useruu
 bool DBManager::setSpecialQuotaUsage (const statstring &tag, const statstring &useruuid, int amt)
 {
     int uid;
-	string q;
     value v;
     
     if (!god)
@@ -2449,11 +5371,11 @@ bool DBManager::setSpecialQuotaUsage (const statstring &tag, const statstring &u
     }
 
 	uid=findlocalid(useruuid);
-    q=("REPLACE /* setSpecialQuotaUsage */ INTO specialquotausage");
+    DBQuery q ("REPLACE /* setSpecialQuotaUsage */ INTO specialquotausage");
     v["tag"]=tag;
     v["userid"]=uid;
     v["usage"]=amt;
-    q.strcat(escapeforinsert(v));
+    q.values(v);
     
 	value dbres = dosqlite(q);
 
@@ -13,12 +13,137 @@
 
 #include <grace/str.h>
 #include <grace/xmlschema.h>
+#include <grace/thread.h>
 #include <sqlite3.h>
 
 #include "paths.h"
 
 void _dbmanager_sqlite3_trace_rcvr(void *ignore, const char *query); // namespace?
 
+struct dbconnection;
+struct dbwritejob;
+struct dbprofslot;
+struct dbclassinfo;
+
+//  -------------------------------------------------------------------------
+/// Identifiers for the statements kept in the prepared statement cache.
+/// These are the queries that run for nearly every RPC call, so they
+/// are prepared once and then only re-bound and reset.
+//  -------------------------------------------------------------------------
+enum dbhotquery
+{
+	HQ_FINDLOCALID = 0,
+	HQ_FINDCLASSID,
+	HQ_HASPOWER_OWNER,
+	HQ_HASPOWER_MIRROR,
+	HQ_FETCHOBJECT,
+	HQ_FINDMETAID,
+	HQ_FETCHCHAIN,
+	HQ_QUOTACHAIN,
+	HQ_PROTOTREE,
+	HQ_PROTOINSERT,
+	HQ_COUNT
+};
+
+//  -------------------------------------------------------------------------
+/// How searchObjects matches the query text against a field.
+//  -------------------------------------------------------------------------
+enum dbsearchmode
+{
+	DBSEARCH_EXACT = 0, ///< Whole value, case sensitive.
+	DBSEARCH_PREFIX, ///< Value starts with the text, any case.
+	DBSEARCH_SUBSTRING ///< Value contains the text, any case.
+};
+
+//  -------------------------------------------------------------------------
+/// Sorted set of the local user ids that a logged-in user has power
+/// over, including the user itself. This is the in-memory copy of the
+/// user's rows in the powermirror table.
+//  -------------------------------------------------------------------------
+class dbpowerset
+{
+public:
+                    /// Constructor
+                     dbpowerset (void);
+                     dbpowerset (const dbpowerset &orig);
+                    /// Destructor
+                    ~dbpowerset (void);
+
+    dbpowerset     &operator= (const dbpowerset &orig);
+
+                    /// binary search for a user id
+    bool            contains (int id) const;
+
+                    /// add a user id, keeping the set sorted
+    void            insert (int id);
+
+                    /// remove a user id
+    void            remove (int id);
+
+                    /// empty the set and forget the user
+    void            clear (void);
+
+    int             count (void) const { return size; }
+    int             operator[] (int i) const { return ids[i]; }
+
+    int             userid; ///< Local id of the user, or -1 if none.
+    unsigned int    gen; ///< Power generation the set is current with.
+
+protected:
+    int            *ids; ///< Sorted ids.
+    int             size; ///< Number of ids in use.
+    int             alloc; ///< Allocated size of ids.
+};
+
+//  -------------------------------------------------------------------------
+/// A query under construction. Values never go into the query text:
+/// each one adds a ? placeholder and is kept aside with its type, to be
+/// bound after the statement is prepared. The type letters are those of
+/// the hot statement argument strings, 'i' for an integer, 's' for text
+/// and 'c' for object content.
+//  -------------------------------------------------------------------------
+class DBQuery
+{
+public:
+                    /// Constructors
+                     DBQuery (void);
+                     DBQuery (const char *sql);
+                     DBQuery (const string &sql);
+
+                    /// append query text
+    DBQuery        &add (const char *sql);
+    DBQuery        &add (const string &sql);
+
+                    /// append another query, text and values
+    DBQuery        &add (const DBQuery &q);
+
+                    /// append a placeholder for an integer
+    DBQuery        &arg (int i);
+
+                    /// append a placeholder for text
+    DBQuery        &arg (const string &s);
+
+                    /// append a placeholder for object content, which
+                    /// is bound as a blob in the binary format
+    DBQuery        &content (const string &s);
+
+                    /// append a placeholder for the value of a column,
+                    /// named by its label: content for the content
+                    /// column, text for any other
+    DBQuery        &column (const value &v);
+
+                    /// append column=? for every member of vars, joined
+                    /// by sep, for use in WHERE and SET clauses
+    DBQuery        &fields (const char *sep, const value &vars);
+
+                    /// append (column,...) VALUES(?,...) for an INSERT
+    DBQuery        &values (const value &vars);
+
+    string          text; ///< Query text with placeholders.
+    string          types; ///< Type letter of every placeholder.
+    value           args; ///< Values of the placeholders, in order.
+};
+
 //  -------------------------------------------------------------------------
 /// Database manager class for OpenCORE. Offers abstract functions
 /// pertaining to classes and objects. Currently
@@ -26,6 +151,7 @@ void _dbmanager_sqlite3_trace_rcvr(void *ignore, const char *query); // namespac
 //  -------------------------------------------------------------------------
 class DBManager
 {
+friend class DBCursor;
 public:
                     /// Constructor
                      DBManager (void);
@@ -65,7 +191,29 @@ public:
                     
                     /// list objects (of a certain class), within the current context
                     /// \verbinclude db_listObjects.format
-                    bool listObjects(value &into, const statstring &parent=nokey, const value &ofclass=nokey, bool formodule = false, int count=-1, int offset=0);
+                    /// a non-empty whitelist limits the object fields to the ones named
+                    bool listObjects(value &into, const statstring &parent=nokey, const value &ofclass=nokey, bool formodule = false, int count=-1, int offset=0, const value &whitelist=emptyvalue);
+
+                    /// list a page of objects after a continuation token ("" for the
+                    /// first page); next is set to the token for the following page,
+                    /// or left empty when this was the last one
+                    bool listObjectPage(value &into, const statstring &parent, const value &ofclass, int count, const string &after, string &next, const value &whitelist=emptyvalue);
+
+                    /// number of objects listObjects would return without a limit, -1 on error
+                    int countObjects(const statstring &parent=nokey, const value &ofclass=nokey);
+
+                    /// true if the field of the class can be searched in the
+                    /// database: the metaid or id, or a field marked searchable that
+                    /// is not a password
+                    bool isSearchable(const statstring &ofclass, const statstring &field);
+
+                    /// list the objects listObjects would return whose field
+                    /// matches the text, in the same format
+                    bool searchObjects(value &into, const statstring &parent, const statstring &ofclass, const statstring &field, const string &text, dbsearchmode mode, int count=-1, int offset=0);
+
+                    /// number of objects searchObjects would return without a
+                    /// limit, -1 on error
+                    int countSearch(const statstring &parent, const statstring &ofclass, const statstring &field, const string &text, dbsearchmode mode);
                     
                     /// replace a complete set of objects identified by class and perhaps parent
           bool replaceObjects (value &newobjs, const statstring &parent=nokey, const statstring &ofclass=nokey);
@@ -76,8 +224,9 @@ public:
                     /// filter a listObjects resultset according to a whitelist
                     bool applyFieldWhiteList (value &objs, value &whitel);
                     
-                    /// fetch an object by uuid
-                    bool fetchObject(value &into, const statstring &uuid, bool formodule=false);
+                    /// fetch an object by uuid; for users password fields are tagged
+                    /// with a type attribute, or blanked if hidepasswords is set
+                    bool fetchObject(value &into, const statstring &uuid, bool formodule=false, bool hidepasswords=false);
 
                     /// create object, possibly in the current uniqueness context
 					/// returns uuid
@@ -102,6 +251,10 @@ public:
                     /// returns -2 for failure, -1 for unlimited, 0..MAXINT for actual limit
                     int getUserQuota(const statstring &ofclass, const statstring &useruuid=nokey, int *usage=NULL);
                     
+                    /// quota and usage of every class for a user in two queries, as
+                    /// into[classname]["quota"/"usage"]; classes without either are left out
+                    bool getUserQuotas(value &into, const statstring &useruuid=nokey);
+                    
                     /// sets quota for a user
                     bool setUserQuota(const statstring &ofclass, int count, const statstring &useruuid=nokey);
                     
@@ -135,6 +288,10 @@ public:
                     
                     /// Get the quota warning level for a specific tag/user.
                     int getSpecialQuotaWarning (const statstring &tag, const statstring &useruuid);
+
+                    /// Get quota, warning level and usage of all tags for a user, as
+                    /// into[tag]["quota"/"warning"/"usage"].
+                    bool getSpecialQuotas (value &into, const statstring &useruuid);
                 
                     /// Set a non-object quota number for a specific tag/user.
                     bool setSpecialQuota (const statstring &tag, const statstring &useruuid, int quota, int warning, value &phys);
@@ -150,6 +307,56 @@ public:
                     
                     void getCredentials(value &creds);
                     void setCredentials(const value &creds);
+
+                    /// open a transaction scope. Writes up to the matching commit()
+                    /// or rollback() go in as one unit. Scopes nest, only the
+                    /// outermost one touches the database. Holds the writer
+                    /// connection, so keep module calls outside of it.
+                    bool begin(void);
+
+                    /// close a transaction scope, false if it could not be committed
+                    bool commit(void);
+
+                    /// abandon a transaction scope (an inner one fails the outer)
+                    void rollback(void);
+
+                    /// let commits wait up to ms milliseconds for queued writers to
+                    /// share the same fsync; 0 turns group commit off
+                    static void setGroupCommit(int ms);
+
+                    /// hit/miss counters of the prepared statement cache
+                    static value *getStatementStats(void);
+
+                    /// write queue depth, wait times and batch counters
+                    static value *getWriterStats(void);
+
+                    /// calls, rows, timings and failures by query tag
+                    static value *getQueryProfile(void);
+
+                    /// moves after every statement that is not a read, and
+                    /// when a transaction lands; anything read at an older
+                    /// generation may be stale
+                    static unsigned int writeGeneration(void);
+
+                    /// clear the counters of getQueryProfile
+                    static void resetQueryProfile(void);
+
+                    /// run a batch of queued statements in one transaction,
+                    /// for DBWriterThread
+                    void runWriteBatch(dbwritejob **jobs, int count);
+
+                    /// hit/miss counters of the uuid to local id cache
+                    static value *getIdCacheStats(void);
+
+                    /// convert a batch of xml-encoded object rows with an id
+                    /// above lastid to the binary format. lastid is moved
+                    /// forward; returns the number of rows looked at, 0 when
+                    /// the table is done, -1 on error.
+                    int migrateContent(int &lastid, int batchsize);
+
+                    /// time xml against binary encoding of object rows
+                    /// taken from the database
+                    value *benchmarkContent(int maxrows, int rounds);
 protected:
           /// did someone delete/change our user while we were logged in?
           bool userisgone();
@@ -163,21 +370,68 @@ protected:
                     /// validates the database schema
                     bool checkschema(void);
 
-                    /// escapes and joins values for usage in UPDATE/SELECT/DELETE
-                    string *escapeforsql (const statstring &glue, const statstring &sep, value &vars);
-
-                    /// escapes and joins values for usage in INSERT
-                    string *escapeforinsert (const value &vars);
-                    
-                    /// execute query with sqlite, return stuff as value object
-                    value *dosqlite (const statstring &query);
+                    /// execute query with sqlite, return stuff as value object.
+                    /// SELECTs run on a pooled reader connection, everything
+                    /// else on the writer connection.
+                    value *dosqlite (const DBQuery &query);
                     
-                    /// implementation of dosqlite (lockless version)
-                    value *_dosqlite (const statstring &query);
+                    /// execute query on the writer connection (lockless version,
+                    /// caller holds the writer lock)
+                    value *_dosqlite (const DBQuery &query);
+
+                    /// run a write on the writer connection from the calling
+                    /// thread, when there is no writer thread to take it
+                    void _dowriteinline (const DBQuery &query, value &res);
+
+                    /// execute a cached prepared statement on a reader, args are bound in order
+                    value *dohotquery (dbhotquery q, const value &args);
+
+                    /// execute a cached prepared statement on the writer (lockless version)
+                    value *_dohotquery (dbhotquery q, const value &args);
+
+                    /// execute query on a specific connection
+                    value *_runsql (dbconnection *c, const DBQuery &query);
+
+                    /// execute a cached prepared statement on a specific connection
+                    value *_runhotquery (dbconnection *c, dbhotquery q, const value &args);
+
+                    /// fetch a cached prepared statement for a connection and bind args
+                    sqlite3_stmt *_preparehot (dbconnection *c, dbhotquery q, const value &args);
+
+                    /// step a prepared statement to completion, collecting rows into res
+                    void _stepstatement (sqlite3 *h, sqlite3_stmt *qhandle, const char *query, value &res);
+
+                    /// take an idle reader connection from the pool, or open a new one
+                    dbconnection *acquirereader (void);
+
+                    /// return a reader connection to the pool
+                    void releasereader (dbconnection *c);
 
                     /// find local ID for a class, -1 if not found (because Class itself is 0)
                     int findclassid(const statstring &classname);
                     
+                    /// list one level of a listObjects result plus, for formodule
+                    /// listings, all children levels below it with one query each
+                    /// at the top level, page receives the row count and the key of the last row
+                    bool _listObjectLevel (value &level, const DBQuery &base, const DBQuery &tail, const value &wanted, bool formodule, value *page, const value &keep=emptyvalue);
+
+                    /// permission part of the listing WHERE clause; usemirror is set when
+                    /// the query has to join powermirror p
+                    void _listaccess (DBQuery &into, bool &usemirror);
+
+                    /// append the parent and class part of the listing WHERE clause
+                    void _listscope (DBQuery &into, const statstring &parent, const value &ofclass);
+
+                    /// append the sql condition on o for searchObjects, false if the
+                    /// field is not searchable
+                    bool _searchfilter (DBQuery &into, const statstring &ofclass, const statstring &field, const string &text, dbsearchmode mode);
+
+                    /// store the searchable fields of an object in searchkeys
+                    bool _indexsearch (int localid, int classid, const value &members);
+
+                    /// rebuild the searchkeys of all objects of a class
+                    bool _reindexclass (int classid);
+
                     /// list a subtree recursively leaf-first
                     bool _listObjectTree (value &into, int localid);
                     
@@ -196,6 +450,34 @@ protected:
                     /// check owner-wise power over local object id
                     bool haspower(int oid, string useruuid) { return haspower( oid, findlocalid( useruuid ) ); }
                     bool haspower(int oid, int userid);
+
+                    /// owner of a local object id, through the owner cache; -1 if not found
+                    int objectowner(int oid);
+
+                    /// reload the power set for the logged-in user
+                    void loadpowerset(void);
+
+                    /// bring the power set up to date with hierarchy changes
+                    void syncpowerset(void);
+
+                    /// publish a change in the user hierarchy to all sessions
+                    static void logpowerchange(int userid, int creator, bool removed);
+
+                    /// user ids the logged-in user has power over
+                    dbpowerset powerset;
+
+                    /// resolve the user a quota query is about, false if not allowed
+                    bool _quotauser(const statstring &useruuid, int &lookupid);
+
+                    /// effective class quotas for a user along its owner chain,
+                    /// keyed by class id; classes without a limit are left out
+                    value *_effectivequota(int lookupid);
+
+                    /// effective quotas looked up so far, by user id
+                    value quotacache;
+
+                    /// quota generation the cache was filled at
+                    unsigned int quotagen;
                     
                     /// checks class right for (logged-in) user
                     bool _getClassRight(int classid, int uid, const statstring &right);
@@ -217,11 +499,22 @@ protected:
 
                     /// get classdata as value; with caching
                     value *getClassData(int classid);
+
+                    /// look up a class in the registry, loading it from the database on a miss
+                    const dbclassinfo *getclassinfo(int classid);
+
+                    /// decode a class definition and publish it in the registry
+                    const dbclassinfo *loadclassinfo(int classid, const string &name, const string &content);
+
+                    /// fill the registry with all classes in the database
+                    bool loadclassregistry(void);
                     
-                    /// find the local id for a given uuid
-                    int findlocalid(const statstring &uuid);
+                    /// find the local id (and optionally class id) for a given uuid
+                    int findlocalid(const statstring &uuid, int *classid = NULL);
                     /// find the local id for a given uuid (lockless version)
                     int _findlocalid(const statstring &uuid);
+                    /// implementation of findlocalid, with the id cache in front
+                    int _lookupid(const statstring &uuid, int *classid, bool onwriter);
                     
                     /// fill the ancestry mirror for a userid
                     bool setpowermirror(int aid);
@@ -229,32 +522,31 @@ protected:
                     /// fill the ancestry mirror for a userid (lockless version)
                     bool _setpowermirror(int aid);
 
-                    /// to our short xml format
+                    /// to the tagged binary (msgpack) content format; msgpack
+                    /// has no room for attributes, so members that carry any
+                    /// are kept in the short xml format instead
                     string *serialize(const value &members);
                     
-                    /// from our short xml format
+                    /// from either the binary or the old short xml format
                     value *deserialize(const string &content);
 
+                    /// to our short xml format; class definitions carry
+                    /// attributes, so they are never stored as binary
+                    string *serializeclass(const value &classdata);
+
                     /// resolve all references
                     bool deref(value &members, int localclassid);
 
-                    /// handle 'privateformodule' attribute
-                    value *filter(const value &members, int localclassid);
-
-                    /// replace passwords with emptiness
-                    value *hidepasswords(const value &members, int localclassid, bool tagonly=false);
-                
-                    /// correctly escape a string for usage in SQL queries
-                    string *sqlstringescape(const string &s);
-                    
                     /// validate fieldlist against class on create/update
                     bool checkfieldlist(value &members, int classid);
                     
                     /// checks whether one metaid fits into another domainwise
                     bool _checkdomainsuffix(const string &child, const string &parent, const char sep);
                     
-                    /// copy tree from prototype, return uuid of copy root
-                    string *copyprototype(int fromid, int parentid, int ownerid, value &repl, bool rootobj = true, const value &members = emptyvalue);
+                    /// copy tree from prototype, return uuid of copy root; members
+                    /// override fields of the root, idmap receives the new local
+                    /// id for every copied one
+                    string *copyprototype(int fromid, int parentid, int ownerid, value &repl, const value &members = emptyvalue, value *idmap = NULL);
 
                     /// storage for last error condition
                     string lasterror;
@@ -264,6 +556,140 @@ protected:
                     
                     // god boolean
                     bool god;
+
+                    /// transaction scope nesting depth, the writer is held while > 0
+                    int txdepth;
+
+                    /// an inner scope rolled back, the outer one has to follow
+                    bool txfailed;
+
+                    /// an inner scope completed, its cache updates may need undoing
+                    bool txnested;
+
+                    /// group commit the outermost scope belongs to
+                    unsigned int txgroup;
+
+                    /// the outermost scope holds a lease from the writer thread
+                    bool txleased;
+};
+
+//  -------------------------------------------------------------------------
+/// Forward-only cursor over the result of a read query. Columns are
+/// read by index straight from the sqlite statement, so no intermediate
+/// value tree is built. The reader connection is taken from the pool
+/// on open() and handed back by close() or the destructor. Errors are
+/// reported through the DBManager's lasterror/errorcode.
+//  -------------------------------------------------------------------------
+class DBCursor
+{
+public:
+                    /// Constructor
+                     DBCursor (DBManager &pdb);
+
+                    /// Destructor; calls close()
+                    ~DBCursor (void);
+
+                    /// prepare a query on a reader connection
+                    bool open (const DBQuery &query);
+
+                    /// use a cached hot statement on a reader connection
+                    bool open (dbhotquery q, const value &args);
+
+                    /// release the statement and the connection
+                    void close (void);
+
+                    /// advance to the next row, false at the end or on error
+                    bool next (void);
+
+                    /// true if the last next() stopped on an error
+                    bool failed (void) { return error; }
+
+                    /// column accessors for the current row
+                    bool isnull (int col);
+                    int ival (int col);
+                    const char *cval (int col);
+                    string *sval (int col);
+
+protected:
+                    DBManager &db; ///< Owner, receives error reports.
+                    dbconnection *c; ///< Connection we hold, or NULL.
+                    sqlite3_stmt *st; ///< Current statement, or NULL.
+                    const char *sql; ///< Query text, for error messages.
+                    bool hot; ///< True if st is a cached statement.
+                    bool error; ///< Error flag.
+                    dbprofslot *prof; ///< Profile of the query, or NULL.
+                    long long preptime; ///< Usecs spent preparing.
+                    long long steptime; ///< Usecs spent in next().
+                    int rows; ///< Rows returned so far.
+                    int result; ///< Failing step result, or SQLITE_OK.
+};
+
+//  -------------------------------------------------------------------------
+/// Owner of all database writes while it runs. Statements from every
+/// session queue up for it and go to disk together, a transaction scope
+/// queues for a lease on the writer connection. Without this thread
+/// (as in techsupport) callers write on the connection themselves.
+//  -------------------------------------------------------------------------
+class DBWriterThread : public thread
+{
+public:
+				 /// Constructor.
+				 DBWriterThread (void)
+				 	: thread ("DBWriterThread")
+				 {
+				 	spawn ();
+				 }
+				 
+				 /// Destructor.
+				~DBWriterThread (void)
+				 {
+				 }
+				 
+				 /// Run-method. Drains the write queue until
+				 /// shutdown.
+	void		 run (void);
+	
+				 /// Shut down the thread after the queue is
+				 /// empty. Waits for the thread to finish.
+	void		 shutdown (void);
+
+protected:
+	conditional	 shutdownCondition; ///< Will raise on thread shutdown.
+};
+
+//  -------------------------------------------------------------------------
+/// Background thread that rewrites object rows still stored in the old
+/// xml content format to the binary format, a small batch at a time so
+/// the writer connection is never held for long.
+//  -------------------------------------------------------------------------
+class DBContentMigrationThread : public thread
+{
+public:
+				 /// Constructor.
+				 DBContentMigrationThread (void)
+				 	: thread ("DBContentMigrationThread")
+				 {
+				 	spawn ();
+				 }
+				 
+				 /// Destructor.
+				~DBContentMigrationThread (void)
+				 {
+				 }
+				 
+				 /// Run-method. Converts a batch every second until
+				 /// the table is done, then waits for shutdown.
+	void		 run (void);
+	
+				 /// Shut down the thread. Waits for the thread to
+				 /// finish.
+	void		 shutdown (void)
+				 {
+				 	sendevent ("shutdown");
+				 	shutdownCondition.wait();
+				 }
+protected:
+	conditional	 shutdownCondition; ///< Will raise on thread shutdown.
 };
 
 #endif
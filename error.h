@@ -69,6 +69,7 @@
 #define ERR_SESSION_PARENTREALM			0x300a // Class has parent-related indexing constraints, but the parent-id could not be resolved.
 #define ERR_SESSION_CREATEPROTO			0x300b // Cannot create new prototype objects
 #define ERR_SESSION_NOLOGIN				0x300c // No login username provided
+#define ERR_SESSION_BATCH				0x300d // Object not created because another object in the same batch failed
 
 // rpc-specific errors = 0x40xx
 #define ERR_RPC_UNDEFINED				0x4001 // Undefined item or error
@@ -166,16 +166,31 @@ value *QuotaClass::listObjects (CoreSession *s,
 	value cl = s->mdb.listClasses ();
 	statstring cuuid;
 	
+	// Quota and usage of all classes and tags come in one go, not
+	// with a few queries for each of them.
+	value quotas;
+	bool gotquotas = s->db.getUserQuotas (quotas, parentid);
+	value squotas;
+	bool gotsquotas = s->db.getSpecialQuotas (squotas, parentid);
+	
 	foreach (c, cl)
 	{
-		cuuid = getUUID (parentid, c.id());
-		int usage = 0;
-		int quota = s->db.getUserQuota (c.id(), parentid, &usage);
 		CoreClass &cl = s->mdb.getClass (c.id());
 		
 		if (cl.dynamic) continue;
 		if (! cl.capabilities.attribexists ("create")) continue;
 		
+		cuuid = getUUID (parentid, c.id());
+		int usage = 0;
+		int quota = -2;
+		
+		if (gotquotas)
+		{
+			const value &cq = quotas[c.id()];
+			quota = cq.exists ("quota") ? cq["quota"].ival() : -1;
+			usage = cq["usage"].ival();
+		}
+		
 		qres[c.id()] =
 			$("class", "OpenCORE:Quota") ->
 			$("uuid", cuuid) ->
@@ -193,6 +208,8 @@ value *QuotaClass::listObjects (CoreSession *s,
 		statstring qid = q.id();
 		statstring qwarningid = "%s:warning" %format (q.id());
 		string qdesc = "%s (warning level)" %format (q);
+		const value &sq = squotas[qid];
+		int susage = gotsquotas ? sq["usage"].ival() : -2;
 		
 		cuuid = getUUID (parentid, qid);
 		qres << $(qid,
@@ -202,8 +219,8 @@ value *QuotaClass::listObjects (CoreSession *s,
 					$("metaid", qid) ->
 					$("description", q.sval()) ->
 					$("units", "MBytes") ->
-					$("usage", s->db.getSpecialQuotaUsage (qid, parentid)) ->
-					$("quota", s->db.getSpecialQuota (qid, parentid)));
+					$("usage", susage) ->
+					$("quota", gotsquotas ? sq["quota"].ival() : -2));
 		
 		cuuid = getUUID (parentid, qwarningid);
 		qres << $(qwarningid,
@@ -213,8 +230,8 @@ value *QuotaClass::listObjects (CoreSession *s,
 					$("metaid", qwarningid) ->
 					$("description", qdesc) ->
 					$("units", "MBytes") ->
-					$("usage", s->db.getSpecialQuotaUsage (qid, parentid)) ->
-					$("quota", s->db.getSpecialQuotaWarning (qid, parentid)));
+					$("usage", susage) ->
+					$("quota", gotsquotas ? sq["warning"].ival() : -2));
 	}
 	
 	return &res;
@@ -452,6 +469,44 @@ value *ErrorLogClass::listObjects (CoreSession *s, const statstring &pid)
 	return &res;
 }
 
+// ==========================================================================
+// CONSTRUCTOR QueryProfileClass
+// ==========================================================================
+QueryProfileClass::QueryProfileClass (void)
+{
+}
+
+// ==========================================================================
+// DESTRUCTOR QueryProfileClass
+// ==========================================================================
+QueryProfileClass::~QueryProfileClass (void)
+{
+}
+
+// ==========================================================================
+// METHOD QueryProfileClass::listObjects
+// ==========================================================================
+value *QueryProfileClass::listObjects (CoreSession *s, const statstring &pid)
+{
+	returnclass (value) res retain;
+	value &qres = res["OpenCORE:QueryProfile"];
+	
+	if (!s->isAdmin()) return &res;
+	
+	value m = DBManager::getQueryProfile ();
+	
+	foreach (row, m)
+	{
+		qres[row.id()] = $("id", row.id()) ->
+						 $("metaid", row.id()) ->
+						 $("uuid", row.id()) ->
+						 $("class", "OpenCORE:QueryProfile") ->
+						 $merge (row);
+	}
+	
+	return &res;
+}
+
 // ==========================================================================
 // CONSTRUCTOR CoreSystemClass
 // ==========================================================================
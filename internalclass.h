@@ -168,6 +168,19 @@ public:
 	value			*listObjects (CoreSession *s, const statstring &pid);
 };
 
+//  -------------------------------------------------------------------------
+/// Implementation of the OpenCORE:QueryProfile CoreClass. One object
+/// per database query tag, with call counts and timings.
+//  -------------------------------------------------------------------------
+class QueryProfileClass : public InternalClass
+{
+public:
+					 QueryProfileClass (void);
+					~QueryProfileClass (void);
+					
+	value			*listObjects (CoreSession *s, const statstring &pid);
+};
+
 //  -------------------------------------------------------------------------
 /// Implementation of the OpenCORE:ClassList CoreClass.
 //  -------------------------------------------------------------------------
@@ -11,6 +11,7 @@
 #include "version.h"
 #include "debug.h"
 #include "alerts.h"
+#include "paths.h"
 
 #include <grace/defaults.h>
 #include <grace/thread.h>
@@ -155,10 +156,7 @@ int OpenCoreApp::main (void)
 	mdb = new ModuleDB( argv.exists ("--demo") );
 	sdb = new SessionDB (*mdb);
 	
-	if (fs.exists ("/var/openpanel/db/session.xml"))
-	{
-		sdb->loadFromDisk ("/var/openpanel/db/session.xml");
-	}
+	sdb->loadFromDisk (PATH_SESSIONS, PATH_SESSIONLOG, PATH_SESSIONXML);
 	
 	rpc = NULL; // will be initialized by confRpc.
 		
@@ -190,6 +188,12 @@ int OpenCoreApp::main (void)
 	// Set up alert and session expire threads.
 	ALERT = new AlertHandler (conf["alert"]);
 	sexp = new SessionExpireThread (sdb);
+	sjournal = new SessionJournal (sdb, PATH_SESSIONS, PATH_SESSIONLOG,
+								   PATH_SESSIONXML);
+	sdb->setJournal (sjournal);
+	
+	// From here on all database writes go through the writer thread.
+	dbwrite = new DBWriterThread;
 
 	// Get the list of modules that should be reinitialized through their
 	// getconfig.
@@ -204,7 +208,10 @@ int OpenCoreApp::main (void)
 	{
 		log (log::info, "Main", "Shutting down on initialization error");
 		APP_SHOULDRUN = false;
+		sdb->setJournal (NULL);
+		sjournal->shutdown();
 		sexp->shutdown();
+		dbwrite->shutdown();
 		ALERT->shutdown();
 		stoplog();
 		return 0;
@@ -213,6 +220,9 @@ int OpenCoreApp::main (void)
 	// Let authdaemon run through its taskqueue now.
 	runAuthDaemonTaskQueue();
 	
+	// Convert objects still stored as xml in the background.
+	dbmig = new DBContentMigrationThread;
+	
 	if (dconsole)
 	{
 		commandline (); // This will go :)
@@ -234,9 +244,13 @@ int OpenCoreApp::main (void)
 	
 	log (log::info, "Main", "Shutting down");
 
-	sdb->saveToDisk ("/var/openpanel/db/session.xml");
+	// The journal thread writes a final snapshot on its way out.
+	sdb->setJournal (NULL);
+	sjournal->shutdown();
 
+	dbmig->shutdown();
 	sexp->shutdown();
+	dbwrite->shutdown();
 	ALERT->shutdown();
 	stoplog();
 	return 0;
@@ -341,6 +355,18 @@ bool OpenCoreApp::confSystem (config::action act, keypath &kp,
 							  1024*1024);
 			}
 			
+			// Let concurrent database writers share their commits.
+			if (nval.exists ("groupcommit"))
+			{
+				DBManager::setGroupCommit (nval["groupcommit"].ival());
+			}
+			
+			// Idle seconds before a session expires.
+			if (nval.exists ("sessiontimeout"))
+			{
+				sdb->setTimeout (nval["sessiontimeout"].ival());
+			}
+			
 			daemonize(true);
 			return true;
 	}
@@ -399,19 +425,35 @@ void OpenCoreApp::commandline (void)
 	
 	shell.addsrc    ("@sessionid", &OpenCoreApp::srcSessionId);
 	
+	shell.addsyntax ("benchmark content", &OpenCoreApp::cmdBenchmarkContent);
+	shell.addsyntax ("benchmark sessions", &OpenCoreApp::cmdBenchmarkSessions);
 	shell.addsyntax ("show classes", &OpenCoreApp::cmdShowClasses);
+	shell.addsyntax ("show idcache", &OpenCoreApp::cmdShowIdCache);
 	shell.addsyntax ("show session", &OpenCoreApp::cmdShowSessions);
 	shell.addsyntax ("show session @sessionid", &OpenCoreApp::cmdShowSession);
 	
+	shell.addsyntax ("show statements", &OpenCoreApp::cmdShowStatements);
 	shell.addsyntax ("show threads", &OpenCoreApp::cmdShowThreads);
+	shell.addsyntax ("show profile", &OpenCoreApp::cmdShowProfile);
+	shell.addsyntax ("show writer", &OpenCoreApp::cmdShowWriter);
 	shell.addsyntax ("show version", &OpenCoreApp::cmdShowVersion);
+	shell.addsyntax ("reset profile", &OpenCoreApp::cmdResetProfile);
 	shell.addsyntax ("exit", &OpenCoreApp::cmdExit);
 	
+	shell.addhelp ("benchmark", "Run a micro-benchmark");
+	shell.addhelp ("benchmark content", "Object content encoding, xml vs binary");
+	shell.addhelp ("benchmark sessions", "Session database, 100000 sessions");
 	shell.addhelp ("show", "Display information");
 	shell.addhelp ("show classes", "All class registrations");
+	shell.addhelp ("show idcache", "Object id cache statistics");
 	shell.addhelp ("show session", "All active sessions (or specify id)");
+	shell.addhelp ("show statements", "Prepared statement cache statistics");
 	shell.addhelp ("show threads", "Active system threads");
+	shell.addhelp ("show profile", "Database query profile by tag");
+	shell.addhelp ("show writer", "Database write queue statistics");
 	shell.addhelp ("show version", "Version information");
+	shell.addhelp ("reset", "Clear statistics");
+	shell.addhelp ("reset profile", "Clear the database query profile");
 	shell.addhelp ("exit", "Exit admin console and stop OpenCORE");
 	
 	shell.setprompt ("opencore# ");
@@ -521,6 +563,151 @@ int OpenCoreApp::cmdShowThreads (const value &cmdata)
 	return 0;
 }
 
+// ==========================================================================
+// METHOD OpenCoreApp::cmdShowStatements
+// ==========================================================================
+int OpenCoreApp::cmdShowStatements (const value &cmdata)
+{
+	value v = DBManager::getStatementStats ();
+	fout.writeln ("Statement                             Hits      Misses");
+	string out;
+	foreach (st, v)
+	{
+		out = st.id();
+		out.pad (38, ' ');
+		out.strcat ("%-10u%u" %format (st["hits"].uval(), st["misses"].uval()));
+		fout.writeln (out);
+	}
+	return 0;
+}
+
+// ==========================================================================
+// METHOD OpenCoreApp::cmdShowProfile
+// ==========================================================================
+int OpenCoreApp::cmdShowProfile (const value &cmdata)
+{
+	value v = DBManager::getQueryProfile ();
+	fout.writeln ("Tag                       Calls     Rows      "
+				  "Prep/avg  Step/avg  Step/p95  Busy  Errors");
+	string out;
+	foreach (q, v)
+	{
+		out = q.id();
+		out.pad (26, ' ');
+		out.strcat ("%-10u%-10u%-10u%-10u%-10u%-6u%u" %format (
+						q["calls"].uval(), q["rows"].uval(),
+						q["prepavg"].uval(), q["stepavg"].uval(),
+						q["stepp95"].uval(), q["busy"].uval(),
+						q["errors"].uval()));
+		fout.writeln (out);
+	}
+	fout.writeln ("(times in usecs)");
+	return 0;
+}
+
+// ==========================================================================
+// METHOD OpenCoreApp::cmdResetProfile
+// ==========================================================================
+int OpenCoreApp::cmdResetProfile (const value &cmdata)
+{
+	DBManager::resetQueryProfile ();
+	return 0;
+}
+
+// ==========================================================================
+// METHOD OpenCoreApp::cmdShowWriter
+// ==========================================================================
+int OpenCoreApp::cmdShowWriter (const value &cmdata)
+{
+	value v = DBManager::getWriterStats ();
+	
+	fout.writeln ("Running    : %s" %format (v["running"].bval() ? "yes" : "no"));
+	fout.writeln ("Queued     : %u (max %u)" %format (v["depth"].uval(),
+				  v["maxdepth"].uval()));
+	fout.writeln ("Statements : %u in %u batches" %format (
+				  v["statements"].uval(), v["batches"].uval()));
+	fout.writeln ("Scopes     : %u" %format (v["leases"].uval()));
+	fout.writeln ("Timeouts   : %u" %format (v["timeouts"].uval()));
+	fout.writeln ("Queue wait : %i usecs average, %i max" %format (
+				  v["waitavg"].ival(), v["waitmax"].ival()));
+	return 0;
+}
+
+// ==========================================================================
+// METHOD OpenCoreApp::cmdShowIdCache
+// ==========================================================================
+int OpenCoreApp::cmdShowIdCache (const value &cmdata)
+{
+	value v = DBManager::getIdCacheStats ();
+	unsigned int total = v["hits"].uval() + v["misses"].uval();
+	
+	fout.writeln ("Entries  : %i / %i" %format (v["size"], v["capacity"]));
+	fout.writeln ("Hits     : %u" %format (v["hits"].uval()));
+	fout.writeln ("Misses   : %u" %format (v["misses"].uval()));
+	fout.writeln ("Hit rate : %i%%" %format (total ? (int)
+				  ((v["hits"].uval() * 100ULL) / total) : 0));
+	return 0;
+}
+
+// ==========================================================================
+// METHOD OpenCoreApp::cmdBenchmarkContent
+// ==========================================================================
+int OpenCoreApp::cmdBenchmarkContent (const value &cmdata)
+{
+	DBManager db;
+	if (! db.init ())
+	{
+		fout.writeln ("%% Error opening database: %s" %format (db.getLastError()));
+		return 0;
+	}
+	
+	value v = db.benchmarkContent (500, 100);
+	db.deinit ();
+	
+	int n = v["rows"].ival() * v["rounds"].ival();
+	if (! n)
+	{
+		fout.writeln ("% No object rows to work with");
+		return 0;
+	}
+	
+	fout.writeln ("Rows: %i, rounds: %i" %format (v["rows"], v["rounds"]));
+	fout.writeln ("Format      Bytes       Encode ns/row   Decode ns/row");
+	string out;
+	foreach (fmt, v)
+	{
+		if (! fmt.count()) continue;
+		out = fmt.id();
+		out.pad (12, ' ');
+		out.strcat ("%-12i%-16i%i" %format (fmt["bytes"].ival(),
+					(int) ((fmt["encode"].ival() * 1000LL) / n),
+					(int) ((fmt["decode"].ival() * 1000LL) / n)));
+		fout.writeln (out);
+	}
+	return 0;
+}
+
+// ==========================================================================
+// METHOD OpenCoreApp::cmdBenchmarkSessions
+// ==========================================================================
+int OpenCoreApp::cmdBenchmarkSessions (const value &cmdata)
+{
+	value v = SessionDB::benchmark (*mdb, 100000);
+	
+	fout.writeln ("Operation   Sessions    Total usecs     ns/session");
+	string out;
+	foreach (op, v)
+	{
+		int n = op["count"].ival();
+		out = op.id();
+		out.pad (12, ' ');
+		out.strcat ("%-12i%-16i%i" %format (n, op["usecs"].ival(),
+					n ? (int) ((op["usecs"].ival() * 1000LL) / n) : 0));
+		fout.writeln (out);
+	}
+	return 0;
+}
+
 // ==========================================================================
 // METHOD OpenCoreApp::cmdShowClasses
 // ==========================================================================
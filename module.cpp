@@ -683,34 +683,35 @@ corestatus_t CoreModule::action (const statstring &command,
     	// sessionid to have their own little talk with opencore.
     	if (meta["implementation"]["wantsrpc"])
     	{
-            value creds;
             CoreSession *usersession;
-    	    CoreSession *modulesession = NULL;
+    	    CoreSession *modulesession;
     	    
-        	try
-        	{
-        		modulesession = CORE->sdb->create (meta);
-        	}
-        	catch (exception e)
-        	{
-        		CORE->logError ("rpc", "Exception caught while trying"
-                    			"to create modulesession: %s" 
-                    			%format (e.description));
-                    		
-                return status_failed;
-            }
-        
+    	    // The module gets a delegated session with the caller's
+    	    // credentials, valid for the duration of this action.
             usersession = CORE->sdb->get(vin["OpenCORE:Session"]["sessionid"]);
-            usersession->getCredentials(creds);
-            modulesession->setCredentials(creds);
+            if (! usersession)
+            {
+            	// without a caller there are no credentials to hand on
+            	CORE->logError ("rpc", "No session to delegate to "
+            					"module %s" %format (mName));
+            	breaksection return status_failed;
+            }
+            
+            modulesession = CORE->sdb->delegate (usersession, meta);
             CORE->sdb->release(usersession);
+            
+            if (! modulesession)
+            {
+            	CORE->logError ("rpc", "Could not delegate a session "
+            					"to module %s" %format (mName));
+            	breaksection return status_failed;
+            }
         
             vin["OpenCORE:Session"]["sessionid"] = modulesession->id;
             result = API::execute (mName, apitype, path,
             					   "action", vin, returndata);
             					   
-            CORE->sdb->release(modulesession);
-            CORE->sdb->remove(modulesession);
+            CORE->sdb->retire(modulesession);
     	}
     	else
     	{
@@ -38,6 +38,7 @@ ModuleDB::ModuleDB ( bool demo ) : first(NULL), last(NULL), demomode(demo)
 	InternalClasses.set ("OpenCORE:Quota", new QuotaClass);
 	InternalClasses.set ("OpenCORE:ActiveSession", new SessionListClass);
 	InternalClasses.set ("OpenCORE:ErrorLog", new ErrorLogClass);
+	InternalClasses.set ("OpenCORE:QueryProfile", new QueryProfileClass);
 	InternalClasses.set ("OpenCORE:System", new CoreSystemClass);
 	InternalClasses.set ("OpenCORE:ClassList", new ClassListClass);
 	InternalClasses.set ("OpenCORE:Wallpaper", new WallpaperClass);
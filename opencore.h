@@ -89,7 +89,14 @@ protected:
 	int					 cmdShowSession (const value &);
 	int					 cmdShowVersion (const value &);
 	int					 cmdShowThreads (const value &);
+	int					 cmdShowStatements (const value &);
+	int					 cmdShowWriter (const value &);
+	int					 cmdShowProfile (const value &);
+	int					 cmdResetProfile (const value &);
+	int					 cmdShowIdCache (const value &);
 	int					 cmdShowClasses (const value &);
+	int					 cmdBenchmarkContent (const value &);
+	int					 cmdBenchmarkSessions (const value &);
 						 ///}
 						 
 						 /// CLI handler: exit all.
@@ -110,6 +117,9 @@ public: // TODO: temporary hack for module session! FIXME!
 protected:
 	OpenCoreRPC			*rpc; ///< RPC manager.
 	SessionExpireThread	*sexp; ///< Session expire thread.
+	SessionJournal		*sjournal; ///< Session journal thread.
+	DBContentMigrationThread *dbmig; ///< Content format migration thread.
+	DBWriterThread		*dbwrite; ///< Database writer thread.
 	lock<value>			 errors; ///< Logged errors.
 	value				 debugfilter; ///< Filter for debug logging.
 	lock<value>			 regexpdb; /// < Regular expression class definitions.
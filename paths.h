@@ -12,6 +12,9 @@
 #define PATH_MODULES "/var/openpanel/modules"
 #define PATH_DB "/var/openpanel/db/panel/panel.db"
 #define PATH_ALERTQ "/var/openpanel/db/alertq.db"
+#define PATH_SESSIONS "/var/openpanel/db/session.shox"
+#define PATH_SESSIONLOG "/var/openpanel/db/session.journal"
+#define PATH_SESSIONXML "/var/openpanel/db/session.xml"
 #define PATH_DEBUG "/var/openpanel/debug"
 #define PATH_CONF "/var/openpanel/conf"
 #define PATH_TEMPLATES "/var/openpanel/templates"
@@ -22,6 +22,7 @@ RPCHandler::RPCHandler (SessionDB *s) : handler (this), sdb (*s)
 	#define BindCommand(foo,bar) handler.setcmd (#foo, &RPCHandler:: bar )
 	
 	BindCommand (create, createObject);
+	BindCommand (createobjects, createObjects);
 	BindCommand (delete, deleteObject);
 	BindCommand (update, updateObject);
 	AddCommand  (ping);
@@ -151,6 +152,7 @@ value *RPCHandler::bind (const value &v, uid_t uid, const string &origin)
 		if (cs->login (vbody["id"], password, (uid==0)))
 		{
 			string sid = cs->id;
+			sdb.persist (cs);
 			sdb.release (cs);
 			log::write (log::debug, "RPC", "Login: success");
 		
@@ -178,6 +180,7 @@ value *RPCHandler::bind (const value &v, uid_t uid, const string &origin)
 			if (cs->userLogin (username))
 			{
 				string sid = cs->id;
+				sdb.persist (cs);
 				sdb.release (cs);
 				DEBUG.newSession ();
 				log::write (log::debug, "RPC", "Login: success");
@@ -272,6 +275,47 @@ value *RPCHandler::createObject (const value &v, CoreSession &cs)
 	return &res;
 }
 
+// ==========================================================================
+// METHOD RPCHandler::createObjects
+// ==========================================================================
+value *RPCHandler::createObjects (const value &v, CoreSession &cs)
+{
+	RPCRETURN (res);
+	const value &in_objects = v["body"]["objects"];
+	statstring in_immediate = v["body"]["immediate"];
+	value created;
+	
+	if (! in_objects.count())
+	{
+		setError (ERR_RPC_INCOMPLETE, res);
+		return &res;
+	}
+
+	cs.mlockw ("createObjects");
+	
+		created = cs.createObjects (in_objects, in_immediate);
+	
+	cs.munlock ();
+	
+	value &out = res["body"]["data"]["objects"];
+	foreach (c, created)
+	{
+		if (c.exists ("objid"))
+		{
+			out.newval() = $("errorid", ERR_OK) ->
+						   $("error", "OK") ->
+						   $("objid", c["objid"]);
+		}
+		else
+		{
+			out.newval() = $("errorid", c["code"]) ->
+						   $("error", "(%[code]04i) %[message]s" %format (c));
+		}
+	}
+	
+	return &res;
+}
+
 // ==========================================================================
 // METHOD RPCHandler::deleteObject
 // ==========================================================================
@@ -442,21 +486,35 @@ value *RPCHandler::getRecords (const value &v, CoreSession &cs)
 	int count = -1;
 	value &dres = res["body"]["data"];
 	
-	if (vbody.exists ("offset"))
-	{
-		offset = vbody["offset"];
-		count = vbody["count"];
-	}
+	// Without a count the listing is not cut off.
+	if (vbody.exists ("count")) count = vbody["count"];
+	if (vbody.exists ("offset")) offset = vbody["offset"];
 	
 	cs.mlockr ();
 	
-		dres = cs.listObjects (in_parentid, in_class, offset, count);
-		dres["info"]["total"] = dres[0].count ();
-		if (vbody.exists ("whitelist"))
+		// With a continuation token (empty for the first page) the
+		// listing resumes after the last row handed out, instead of
+		// skipping offset rows.
+		// Fields outside the whitelist are dropped as each object is
+		// decoded, instead of from the finished listing.
+		if (vbody.exists ("continuation"))
+		{
+			string next;
+			dres = cs.listObjectPage (in_parentid, in_class, count,
+									  vbody["continuation"].sval(), next,
+									  vbody["whitelist"]);
+			if (next.strlen()) dres["info"]["continuation"] = next;
+		}
+		else
 		{
-			value in_whitel = vbody["whitelist"];
-			cs.applyFieldWhiteList (dres, in_whitel);
+			dres = cs.listObjects (in_parentid, in_class, offset, count,
+								   vbody["whitelist"]);
 		}
+		
+		// Only count separately when the listing was cut off.
+		int total = (count >= 0) ? cs.countObjects (in_parentid, in_class)
+								 : -1;
+		dres["info"]["total"] = (total >= 0) ? total : dres[0].count ();
 	
 	cs.munlock ();
 	return &res;
@@ -473,22 +531,34 @@ value *RPCHandler::queryRecords (const value &v, CoreSession &cs)
 	statstring in_class = vbody["classid"];
 	statstring in_field = vbody["queryfield"];
 	string in_value = vbody["queryvalue"];
+	statstring in_match = vbody["match"];
 	value &dres = res["body"]["data"];
+	dbsearchmode mode = DBSEARCH_EXACT;
+	int offset = 0;
+	int count = -1;
+	int total = 0;
+	
+	caseselector (in_match)
+	{
+		incaseof ("prefix") : mode = DBSEARCH_PREFIX; break;
+		incaseof ("substring") : mode = DBSEARCH_SUBSTRING; break;
+		defaultcase : break;
+	}
+	
+	if (vbody.exists ("count"))
+	{
+		offset = vbody["offset"];
+		count = vbody["count"];
+	}
 	
 	cs.mlockr ();
 	
-		dres = cs.listObjects (in_parentid, in_class, 0, -1);
+		dres = cs.searchObjects (in_parentid, in_class, in_field, in_value,
+								 mode, offset, count, total);
+		dres["info"]["total"] = total;
 	
 	cs.munlock();
 	
-	int pos = dres[0].count() - 1;
-	for (;pos>=0;pos--)
-	{
-		if (dres[0][pos][in_field].sval() != in_value)
-		{
-			dres[0].rmindex (pos);
-		}
-	}
 	return &res;
 }
 
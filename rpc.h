@@ -72,6 +72,7 @@ public:
 
 	value			*ping (const value &v, CoreSession &cs);
 	value			*createObject (const value &v, CoreSession &cs);
+	value			*createObjects (const value &v, CoreSession &cs);
 	value			*deleteObject (const value &v, CoreSession &cs);
 	value			*updateObject (const value &v, CoreSession &cs);
 	value			*chown (const value &v, CoreSession &cs);
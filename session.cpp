@@ -8,7 +8,15 @@
 // section of the OpenPanel website on http://www.openpanel.com/
 
 #include <grace/md5.h>
+#include <grace/filesystem.h>
 #include <assert.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include "session.h"
 #include "moduledb.h"
 #include "error.h"
@@ -19,14 +27,238 @@
 const char *MD5SALT_VALID = "./abcdefghijklmnopqrstuvwxyz"
 							"ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
 
+/// Wall clock in microseconds, for SessionDB::benchmark.
+static long long sessionusecnow (void)
+{
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return ((long long) tv.tv_sec * 1000000LL) + tv.tv_usec;
+}
+
+/// Table slot encoded in a delegated session-id, or -1 for the ids of
+/// normal sessions, which are plain uuids.
+static int delegateslot (const statstring &id)
+{
+	const string &str = id.sval();
+	if ((str.strlen() != 39) || (str[36] != '-')) return -1;
+	
+	int slot = str.mid (37).toint (16);
+	if ((slot < 0) || (slot >= SESSION_DELEGATES)) return -1;
+	return slot;
+}
+
+/// Take the spinlock of a slot in the table of delegated sessions. It
+/// is only ever held for a few instructions.
+static void delegatelock (volatile int &l)
+{
+	while (__sync_lock_test_and_set (&l, 1))
+	{
+		while (l) sched_yield ();
+	}
+}
+
+/// Let go of the spinlock of a slot.
+static void delegateunlock (volatile int &l)
+{
+	__sync_lock_release (&l);
+}
+
+// ==========================================================================
+// CONSTRUCTOR SessionShard
+// ==========================================================================
+SessionShard::SessionShard (void)
+{
+	size = 16;
+	count = 0;
+	buckets = new CoreSession* [size];
+	for (unsigned int i=0; i<size; ++i) buckets[i] = NULL;
+	for (int i=0; i<SESSION_WHEELSLOTS; ++i) wheel[i] = NULL;
+	swept = kernel.time.now() / SESSION_WHEELTICK;
+}
+
+// ==========================================================================
+// DESTRUCTOR SessionShard
+// ==========================================================================
+SessionShard::~SessionShard (void)
+{
+	delete[] buckets;
+}
+
+// ==========================================================================
+// METHOD SessionShard::find
+// ==========================================================================
+CoreSession *SessionShard::find (const statstring &id)
+{
+	CoreSession *crsr = buckets[bucket (id)];
+	while (crsr)
+	{
+		if (crsr->id == id) return crsr;
+		crsr = crsr->next;
+	}
+	return NULL;
+}
+
+// ==========================================================================
+// METHOD SessionShard::link
+// ==========================================================================
+void SessionShard::link (CoreSession *s, time_t due)
+{
+	if (count >= size) grow ();
+	chain (s);
+	count++;
+	schedule (s, due);
+}
+
+// ==========================================================================
+// METHOD SessionShard::chain
+// ==========================================================================
+void SessionShard::chain (CoreSession *s)
+{
+	CoreSession *&head = buckets[bucket (s->id)];
+	s->prev = NULL;
+	s->next = head;
+	if (head) head->prev = s;
+	head = s;
+}
+
+// ==========================================================================
+// METHOD SessionShard::unlink
+// ==========================================================================
+void SessionShard::unlink (CoreSession *s)
+{
+	if (s->prev) s->prev->next = s->next;
+	else buckets[bucket (s->id)] = s->next;
+	if (s->next) s->next->prev = s->prev;
+	s->next = s->prev = NULL;
+	count--;
+	unschedule (s);
+}
+
+// ==========================================================================
+// METHOD SessionShard::schedule
+// ==========================================================================
+void SessionShard::schedule (CoreSession *s, time_t due)
+{
+	// Anything due in a tick that was already swept goes into the next
+	// one, so it is looked at by the next sweep rather than a full turn
+	// of the wheel later.
+	time_t tick = due / SESSION_WHEELTICK;
+	if (tick <= swept) tick = swept + 1;
+	
+	int slot = tick & (SESSION_WHEELSLOTS-1);
+	s->wslot = slot;
+	s->wprev = NULL;
+	s->wnext = wheel[slot];
+	if (wheel[slot]) wheel[slot]->wprev = s;
+	wheel[slot] = s;
+}
+
+// ==========================================================================
+// METHOD SessionShard::unschedule
+// ==========================================================================
+void SessionShard::unschedule (CoreSession *s)
+{
+	if (s->wslot < 0) return;
+	if (s->wprev) s->wprev->wnext = s->wnext;
+	else wheel[s->wslot] = s->wnext;
+	if (s->wnext) s->wnext->wprev = s->wprev;
+	s->wnext = s->wprev = NULL;
+	s->wslot = -1;
+}
+
+// ==========================================================================
+// METHOD SessionShard::sweep
+// ==========================================================================
+int SessionShard::sweep (time_t now, int timeout, CoreSession *&dead)
+{
+	int result = 0;
+	time_t tick = now / SESSION_WHEELTICK;
+	
+	// After a long pause one turn of the wheel covers everything.
+	if (tick - swept > SESSION_WHEELSLOTS) swept = tick - SESSION_WHEELSLOTS;
+	
+	while (swept < tick)
+	{
+		swept++;
+		int slot = swept & (SESSION_WHEELSLOTS-1);
+		
+		// Detach the slot first, sessions that are not due yet (they
+		// were used, or are a full turn of the wheel away) are put back
+		// by their due time.
+		CoreSession *s = wheel[slot];
+		wheel[slot] = NULL;
+		
+		while (s)
+		{
+			CoreSession *ns = s->wnext;
+			s->wnext = s->wprev = NULL;
+			s->wslot = -1;
+			
+			time_t due = s->heartbeat + timeout;
+			if ((! s->inuse) && (due <= now))
+			{
+				unlink (s);
+				s->next = dead;
+				dead = s;
+				result++;
+			}
+			else
+			{
+				if (s->inuse && (due < now + timeout)) due = now + timeout;
+				log::write (log::debug, "Expire", "Passing <%S> "
+							"inuse=<%i> heartbeat=%i due=%i"
+							%format (s->id, s->inuse,
+									 (int) s->heartbeat, (int) due));
+				schedule (s, due);
+			}
+			
+			s = ns;
+		}
+	}
+	
+	return result;
+}
+
+// ==========================================================================
+// METHOD SessionShard::grow
+// ==========================================================================
+void SessionShard::grow (void)
+{
+	CoreSession **old = buckets;
+	unsigned int oldsize = size;
+	
+	size = size * 2;
+	buckets = new CoreSession* [size];
+	for (unsigned int i=0; i<size; ++i) buckets[i] = NULL;
+	
+	for (unsigned int i=0; i<oldsize; ++i)
+	{
+		CoreSession *crsr = old[i];
+		while (crsr)
+		{
+			CoreSession *n = crsr->next;
+			chain (crsr);
+			crsr = n;
+		}
+	}
+	
+	delete[] old;
+}
+
 // ==========================================================================
 // CONSTRUCTOR SessionDB
 // ==========================================================================
 SessionDB::SessionDB (ModuleDB &pmdb)
 	: mdb (pmdb)
 {
-	first = last = NULL;
-	lck.o = 0;
+	timeout = SESSION_TIMEOUT;
+	journal = NULL;
+	spare.o = NULL;
+	for (int i=0; i<SESSION_DELEGATES; ++i)
+	{
+		delegates[i] = NULL;
+		delegatelocks[i] = 0;
+	}
 }
 
 // ==========================================================================
@@ -34,51 +266,148 @@ SessionDB::SessionDB (ModuleDB &pmdb)
 // ==========================================================================
 SessionDB::~SessionDB (void)
 {
+	while (spare.o)
+	{
+		CoreSession *n = spare.o->next;
+		delete spare.o;
+		spare.o = n;
+	}
 }
 
 // ==========================================================================
-// METHOD ::saveToDisk
+// STATIC METHOD SessionDB::saveSnapshot
 // ==========================================================================
-void SessionDB::saveToDisk (const string &path)
+bool SessionDB::saveSnapshot (const value &sessions, const string &path)
 {
-	value serialized;
+	// Write next to the old snapshot and move it in place, a crash
+	// halfway leaves the old one intact. The new one has to be on disk
+	// before the rename, or a crash could leave an empty file in place.
+	string tmppath = "%s.new" %format (path);
+	bool ok = sessions.saveshox (tmppath);
 	
-	sharedsection (lck)
+	if (ok)
 	{
-		CoreSession *crsr = first;
-		while (crsr)
+		int fd = ::open (tmppath.str(), O_RDONLY);
+		ok = (fd >= 0) && (::fsync (fd) == 0);
+		if (fd >= 0) ::close (fd);
+	}
+	
+	if (ok) ok = (::rename (tmppath.str(), path.str()) == 0);
+	
+	if (! ok)
+	{
+		CORE->logError ("Session", "Could not write session snapshot "
+						"%s" %format (path));
+	}
+	
+	return ok;
+}
+
+// ==========================================================================
+// STATIC METHOD SessionDB::applyRecord
+// ==========================================================================
+bool SessionDB::applyRecord (value &sessions, const value &rec)
+{
+	statstring id = rec["id"];
+	if (! id) return false;
+	
+	// Heartbeats are not journaled, replayed sessions get a fresh one.
+	if (rec["op"] == "set")
+	{
+		timestamp now = kernel.time.now();
+		sessions[id] = $("meta",rec["meta"])->
+					   $("quotamap",rec["quotamap"])->
+					   $("heartbeat",now);
+		return true;
+	}
+	
+	if (rec["op"] == "remove")
+	{
+		sessions.rmval (id);
+		return true;
+	}
+	
+	return false;
+}
+
+// ==========================================================================
+// STATIC METHOD SessionDB::readFromDisk
+// ==========================================================================
+int SessionDB::readFromDisk (const string &path, const string &journalpath,
+							 const string &legacypath, value &sessions)
+{
+	int replayed = 0;
+	
+	sessions.clear();
+	
+	if (fs.exists (path)) sessions.loadshox (path);
+	else if (legacypath.strlen() && fs.exists (legacypath))
+	{
+		// Sessions saved before there was a journal.
+		sessions.loadxml (legacypath);
+	}
+	
+	// Replay the journal on the snapshot before any session is made,
+	// so sessions that were logged out since are never set up.
+	if (fs.exists (journalpath))
+	{
+		string data = fs.load (journalpath);
+		value records = strutil::split (data, '\036');
+		
+		foreach (rec, records)
 		{
-			crsr->spinlock.lockr();
-			
-			timestamp t = crsr->heartbeat;
-			
-			serialized[crsr->id] =
-				$("meta",crsr->meta)->
-				$("errors",crsr->errors)->
-				$("quotamap",crsr->quotamap)->
-				$("heartbeat",t);
+			if (! rec.sval().strlen()) continue;
 			
-			crsr->spinlock.unlock();
-			
-			crsr = crsr->next;
+			value r;
+			r.fromjson (rec.sval());
+			if (applyRecord (sessions, r)) replayed++;
 		}
 	}
 	
-	serialized.savexml (path);
+	return replayed;
 }
 
 // ==========================================================================
 // METHOD ::loadFromDisk
 // ==========================================================================
-void SessionDB::loadFromDisk (const string &path)
+void SessionDB::loadFromDisk (const string &path, const string &journalpath,
+							  const string &legacypath)
 {
 	value serialized;
+	bool imported = (! fs.exists (path)) && legacypath.strlen() &&
+					fs.exists (legacypath);
+	
+	int replayed = readFromDisk (path, journalpath, legacypath, serialized);
 	
-	serialized.loadxml (path);
 	foreach (s, serialized)
 	{
 		createFromSerialized (s);
 	}
+	
+	log::write (log::info, "Session", "Restored %i sessions, %i journal "
+				"records" %format (serialized.count(), replayed));
+	
+	// The old file is only read once, the snapshot takes over from it.
+	if (imported && saveSnapshot (serialized, path))
+	{
+		log::write (log::info, "Session", "Imported sessions from %s"
+					%format (legacypath));
+		::unlink (legacypath.str());
+	}
+}
+
+// ==========================================================================
+// METHOD SessionDB::persist
+// ==========================================================================
+void SessionDB::persist (CoreSession *s)
+{
+	if (! journal) return;
+	
+	s->journaled = true;
+	journal->write ($("op","set")->
+					$("id",s->id)->
+					$("meta",s->meta)->
+					$("quotamap",s->quotamap));
 }
 
 // ==========================================================================
@@ -87,38 +416,89 @@ void SessionDB::loadFromDisk (const string &path)
 CoreSession *SessionDB::get (const statstring &id)
 {
 	CoreSession *res;
+	lock<SessionShard> &sh = shard (id);
+	
+	if (! id)
+	{
+		log::write (log::warning, "Session", "Find on empty key");
+	}
+	
+	res = findDelegate (id);
+	if (res) return res;
 	
-	sharedsection (lck)
+	// The claim is taken before the stripe is let go, so expire() can
+	// not pick the session in between.
+	sharedsection (sh)
 	{
-		res = find (id);
-		if (res) res->inuse++;
+		res = sh.o.find (id);
+		if (res) __sync_add_and_fetch (&res->inuse, 1);
 	}
 	
-	if (res) log::write (log::debug, "Session", "SDB Open <%S>" %format (id));
+	if (! res)
+	{
+		log::write (log::warning, "Session", "Session <%S> not "
+				    "found" %format (id));
+		return NULL;
+	}
+	
+	// Sessions restored at startup log in on first use.
+	if (res->restored)
+	{
+		exclusivesection (res->pendinguser)
+		{
+			if (res->restored)
+			{
+				if (! res->db.userLogin (res->pendinguser.o))
+				{
+					CORE->logError ("Session", "Failed restoring login "
+									"user <%S> (%S)" %format (
+										res->pendinguser.o,
+										res->db.getLastError()));
+				}
+				res->pendinguser.o.crop ();
+				res->restored = false;
+			}
+		}
+	}
+	
+	log::write (log::debug, "Session", "SDB Open <%S>" %format (id));
 	return res;
 }
 
+// ==========================================================================
+// METHOD SessionDB::add
+// ==========================================================================
+void SessionDB::add (CoreSession *s)
+{
+	lock<SessionShard> &sh = shard (s->id);
+	
+	exclusivesection (sh)
+	{
+		sh.o.link (s, s->heartbeat + timeout);
+	}
+}
+
 // ==========================================================================
 // METHOD SessionDB::create
 // ==========================================================================
 CoreSession *SessionDB::create (const value &meta)
 {
-	CoreSession *s;
+	CoreSession *s = NULL;
 	statstring id = strutil::uuid();
 	
-	exclusivesection (lck)
+	// The session is set up before anybody can find it, ids are fresh
+	// so there is nothing to collide with.
+	try
 	{
-		try
-		{
-			lck = 1;
-			s = demand (id);
-			s->meta = meta;
-		}
-		catch (...)
-		{
-			CORE->logError ("Session", "Software bug in session "
-					    	"database, exception caught");
-		}
+		s = new CoreSession (id, mdb);
+		s->meta = meta;
+		s->inuse = 1;
+		add (s);
+	}
+	catch (...)
+	{
+		CORE->logError ("Session", "Software bug in session "
+				    	"database, exception caught");
 	}
 	log::write (log::debug, "Session", "SDB Create <%S>" %format (id));
 	
@@ -130,29 +510,30 @@ CoreSession *SessionDB::create (const value &meta)
 // ==========================================================================
 CoreSession *SessionDB::createFromSerialized (const value &ser)
 {
-	CoreSession *s;
+	CoreSession *s = NULL;
 	statstring id = ser.id();
 	
-	exclusivesection (lck)
+	if (exists (id)) return NULL;
+	
+	try
 	{
-		try
-		{
-			lck = 1;
-			s = demand (id);
-			s->meta = ser["meta"];
-			s->errors = ser["errors"];
-			s->quotamap = ser["quotamap"];
-			
-			timestamp t = ser["heartbeat"];
-			s->heartbeat = t.unixtime();
-			s->inuse = 0;
-			s->db.userLogin (ser["meta"]["user"]);
-		}
-		catch (...)
-		{
-			CORE->logError ("Session", "Software bug in session "
-					    	"database, exception caught");
-		}
+		s = new CoreSession (id, mdb);
+		s->meta = ser["meta"];
+		s->errors = ser["errors"];
+		s->quotamap = ser["quotamap"];
+		
+		timestamp t = ser["heartbeat"];
+		s->heartbeat = t.unixtime();
+		s->inuse = 0;
+		s->journaled = true;
+		s->pendinguser.o = ser["meta"]["user"].sval();
+		s->restored = (s->pendinguser.o.strlen() > 0);
+		add (s);
+	}
+	catch (...)
+	{
+		CORE->logError ("Session", "Software bug in session "
+				    	"database, exception caught");
 	}
 	return s;
 }
@@ -162,13 +543,23 @@ CoreSession *SessionDB::createFromSerialized (const value &ser)
 // ==========================================================================
 void SessionDB::release (CoreSession *s)
 {
-	sharedsection (lck)
+	s->heartbeat = kernel.time.now();
+	
+	// never below zero, a stray release must not hand out a claim
+	int cur = s->inuse;
+	while (cur > 0)
 	{
-		s->heartbeat = kernel.time.now();
-		if (s->inuse > 0) s->inuse--;
-		log::write (log::debug, "Session", "SDB Release <%S> "
-				    "inuse <%i>" %format (s->id, s->inuse));
+		int was = __sync_val_compare_and_swap (&s->inuse, cur, cur-1);
+		if (was == cur)
+		{
+			cur--;
+			break;
+		}
+		cur = was;
 	}
+	
+	log::write (log::debug, "Session", "SDB Release <%S> "
+			    "inuse <%i>" %format (s->id, cur));
 }
 
 // ==========================================================================
@@ -176,187 +567,163 @@ void SessionDB::release (CoreSession *s)
 // ==========================================================================
 void SessionDB::remove (CoreSession *s)
 {
-	if (! first) return;
+	lock<SessionShard> &sh = shard (s->id);
+	bool found = false;
+	
+	log::write (log::debug, "Session", "SDB Remove <%S>" %format (s->id));
 	
-	exclusivesection (lck)
+	// A delegate belongs to the action that leased it, a logout only
+	// gives up the claim.
+	if (s->delegated)
 	{
-		try
-		{
-			lck = 1;
-			CoreSession *crsr = first;
-			CoreSession *parent = NULL;
-			
-			log::write (log::debug, "Session", "SDB Remove <%S>" %format (s->id));
-						
-			while (crsr)
-			{
-				if (crsr->id == s->id)
-				{
-					if (parent)
-					{
-						if (parent->lower == s) parent->lower = NULL;
-						else if (parent->higher == s) parent->higher = NULL;
-						else
-						{
-							breaksection throw (sessionUnlinkException());
-						}
-					}
-					
-					if (s->prev)
-					{
-						if (s->next)
-						{
-							s->prev->next = s->next;
-							s->next->prev = s->prev;
-						}
-						else
-						{
-							s->prev->next = NULL;
-							last = s->prev;
-						}
-					}
-					else
-					{
-						if (s->next)
-						{
-							s->next->prev = NULL;
-							first = s->next;
-						}
-						else
-						{
-							first = last = NULL;
-							s->higher = s->lower = NULL;
-						}
-					}
-					
-					crsr = first;
-					while (crsr)
-					{
-						crsr->lower = crsr->higher = NULL;
-						if (crsr != first) link (crsr);
-						crsr = crsr->next;
-					}
-					
-					delete s;
-					breaksection return;
-				}
-				
-				parent = crsr;
-				
-				if (crsr->id.key() <= s->id.key()) crsr = crsr->higher;
-				else crsr = crsr->lower;
-			}
-		}
-		catch (...)
+		release (s);
+		return;
+	}
+	
+	exclusivesection (sh)
+	{
+		if (sh.o.find (s->id) == s)
 		{
-			CORE->logError ("Session", "Software bug in session "
-							"database, exception caught.");
+			sh.o.unlink (s);
+			found = true;
 		}
 	}
+	
+	if (! found) return;
+	
+	if (journal && s->journaled)
+	{
+		journal->write ($("op","remove")->$("id",s->id));
+	}
+	delete s;
 }
 
 // ==========================================================================
-// METHOD SessionDB::find
+// METHOD SessionDB::delegate
 // ==========================================================================
-CoreSession *SessionDB::find (const statstring &key, bool noreport)
+CoreSession *SessionDB::delegate (CoreSession *from, const value &meta)
 {
-	if (! first)
+	CoreSession *s = NULL;
+	value creds;
+	
+	exclusivesection (spare)
 	{
-		return NULL;
+		s = spare.o;
+		if (s) spare.o = s->next;
 	}
 	
-	if (! key)
+	// The pool only grows when more actions run at once than ever
+	// before, the database setup is paid once per delegate.
+	if (! s)
 	{
-		log::write (log::warning, "Session", "Find on empty key");
+		try
+		{
+			s = new CoreSession (strutil::uuid(), mdb);
+		}
+		catch (...)
+		{
+			CORE->logError ("Session", "Could not set up delegated "
+							"session");
+			return NULL;
+		}
+		s->delegated = true;
 	}
 	
-	CoreSession *crsr = first;
-	while (crsr)
+	// Nobody can see the session yet, it is set up before it is put
+	// in the table. Its claims are left alone: retire() let it go only
+	// after the last one was released.
+	s->next = NULL;
+	s->meta = meta;
+	s->errors.clear();
+	s->quotamap.clear();
+	s->rcache.clear();
+	s->heartbeat = kernel.time.now();
+	
+	if (from) from->getCredentials (creds);
+	s->setCredentials (creds);
+	
+	// The id carries its slot, so get() looks at a single entry of
+	// the table. It is set under the lock of the slot, together with
+	// publishing the session.
+	string uuid = strutil::uuid();
+	for (int slot=0; slot<SESSION_DELEGATES; ++slot)
 	{
-		assert (crsr->lower != crsr);
-		assert (crsr->higher != crsr);
+		if (delegates[slot]) continue;
+		
+		bool taken = false;
+		delegatelock (delegatelocks[slot]);
+		if (! delegates[slot])
+		{
+			s->id = "%s-%02x" %format (uuid, slot);
+			delegates[slot] = s;
+			taken = true;
+		}
+		delegateunlock (delegatelocks[slot]);
 		
-		if (crsr->id == key) return crsr;
-		if (crsr->id.key() <= key.key()) crsr = crsr->higher;
-		else crsr = crsr->lower;
+		if (taken)
+		{
+			log::write (log::debug, "Session", "SDB Delegate <%S>"
+						%format (s->id));
+			return s;
+		}
 	}
 	
-	if (! noreport)
+	CORE->logError ("Session", "Table of delegated sessions is full");
+	exclusivesection (spare)
 	{
-		log::write (log::warning, "Session", "Session <%S> not "
-				    "found" %format (key));
+		s->next = spare.o;
+		spare.o = s;
 	}
 	return NULL;
 }
 
 // ==========================================================================
-// METHOD SessionDB::demand
+// METHOD SessionDB::retire
 // ==========================================================================
-CoreSession *SessionDB::demand (const statstring &key)
+void SessionDB::retire (CoreSession *s)
 {
-	CoreSession *res;
+	log::write (log::debug, "Session", "SDB Retire <%S>" %format (s->id));
 	
-	res = find (key, true);
-	if (res)
+	int slot = delegateslot (s->id);
+	if (slot >= 0)
 	{
-		res->heartbeat = kernel.time.now();
-		res->inuse++;
+		delegatelock (delegatelocks[slot]);
+		if (delegates[slot] == s) delegates[slot] = NULL;
+		delegateunlock (delegatelocks[slot]);
 	}
-	else
-	{
-		res = new CoreSession (key, mdb);
-		if (! res)
-		{
-			return NULL;
-		}
-		if (! last)
-		{
-			first = last = res;
-			res->prev = res->next = NULL;
-			res->higher = res->lower = NULL;
-			return res;
-		}
-		
-		res->prev = last;
-		last->next = res;
-		last = res;
-		res->inuse = 1;
 	
-		link (res);
+	// Lookups that got hold of the session before it left the table
+	// finish first, new ones can no longer find it.
+	while (s->inuse > 0) usleep (1000);
+	
+	exclusivesection (spare)
+	{
+		s->next = spare.o;
+		spare.o = s;
 	}
-	return res;
 }
 
 // ==========================================================================
-// METHOD SessionDB::link
+// METHOD SessionDB::findDelegate
 // ==========================================================================
-void SessionDB::link (CoreSession *cs)
+CoreSession *SessionDB::findDelegate (const statstring &id)
 {
-	assert (lck.o == 1);
-	CoreSession *crsr = first;
-	while (crsr)
-	{
-		assert (crsr != cs);
-		if (crsr->id.key() <= cs->id.key())
-		{
-			if (crsr->higher) crsr = crsr->higher;
-			else
-			{
-				crsr->higher = cs;
-				return;
-			}
-		}
-		else
-		{
-			if (crsr->lower) crsr = crsr->lower;
-			else
-			{
-				crsr->lower = cs;
-				return;
-			}
-		}
-	}
-	return;
+	int slot = delegateslot (id);
+	if (slot < 0) return NULL;
+	
+	if (! delegates[slot]) return NULL;
+	
+	// The session in the slot is checked and claimed under the lock of
+	// the slot, so it can not be retired and leased again in between.
+	// Once claimed, retire() waits for us.
+	CoreSession *s;
+	delegatelock (delegatelocks[slot]);
+	s = delegates[slot];
+	if (s && (s->id == id)) __sync_add_and_fetch (&s->inuse, 1);
+	else s = NULL;
+	delegateunlock (delegatelocks[slot]);
+	
+	return s;
 }
 
 // ==========================================================================
@@ -365,10 +732,11 @@ void SessionDB::link (CoreSession *cs)
 bool SessionDB::exists (const statstring &id)
 {
 	CoreSession *s;
+	lock<SessionShard> &sh = shard (id);
 
-	sharedsection (lck)
+	sharedsection (sh)
 	{
-		s = find (id);
+		s = sh.o.find (id);
 	}
 	
 	if (s == NULL) return false;
@@ -382,16 +750,24 @@ value *SessionDB::list (void)
 {
 	returnclass (value) res retain;
 	
-	sharedsection (lck)
+	for (int i=0; i<SESSIONDB_SHARDS; ++i)
 	{
-		CoreSession *c = first;
-		while (c)
+		sharedsection (shards[i])
 		{
-			res[c->id] = $("heartbeat", (unsigned int) c->heartbeat) ->
-						 $("inuse", c->inuse) ->
-						 $merge (c->meta);
+			for (unsigned int b=0; b<shards[i].o.size; ++b)
+			{
+				CoreSession *c = shards[i].o.buckets[b];
+				while (c)
+				{
+					value cstats = c->rcache.stats ();
+					res[c->id] = $("heartbeat", (unsigned int) c->heartbeat) ->
+								 $("inuse", c->inuse) ->
+								 $merge (cstats) ->
+								 $merge (c->meta);
 
-			c = c->next;
+					c = c->next;
+				}
+			}
 		}
 	}
 	return &res;
@@ -401,44 +777,216 @@ value *SessionDB::list (void)
 // METHOD SessionDB::expire
 // ==========================================================================
 int SessionDB::expire (void)
+{
+	return expire (kernel.time.now());
+}
+
+int SessionDB::expire (time_t now)
 {
 	int result = 0;
-	time_t cutoff = kernel.time.now() - 600;
-	exclusivesection (lck)
+	
+	for (int i=0; i<SESSIONDB_SHARDS; ++i)
 	{
-		try
+		CoreSession *dead = NULL;
+		
+		// Unlink under the stripe lock, tear down outside of it.
+		exclusivesection (shards[i])
+		{
+			result += shards[i].o.sweep (now, timeout, dead);
+		}
+		
+		while (dead)
 		{
-			lck = 1;
-			CoreSession *s, *ns;
-			s = first;
-			while (s)
+			CoreSession *n = dead->next;
+			log::write (log::debug, "Session", "SDB Expire <%S>"
+						%format (dead->id));
+			if (journal && dead->journaled)
 			{
-				ns = s->next;
-				if ((! s->inuse) && (s->heartbeat < cutoff))
-				{
-					result++;
-					breaksection remove (s);
-				}
-				else
-				{
-					log::write (log::debug, "Expire", "Passing <%S> inuse=<%i> "
-							    "heartbeat=%i cutoff=%i" %format (s->id,
-							   		s->inuse,
-							   		(int) s->heartbeat,
-							   		(int) cutoff));
-				}
-					
-				s = ns;
+				journal->write ($("op","remove")->$("id",dead->id));
 			}
+			delete dead;
+			dead = n;
 		}
-		catch (...)
+	}
+	
+	return result;
+}
+
+// ==========================================================================
+// METHOD SessionDB::setTimeout
+// ==========================================================================
+void SessionDB::setTimeout (int secs)
+{
+	if (secs < SESSION_WHEELTICK) secs = SESSION_WHEELTICK;
+	timeout = secs;
+}
+
+// ==========================================================================
+// STATIC METHOD SessionDB::benchmark
+// ==========================================================================
+value *SessionDB::benchmark (ModuleDB &mdb, int count)
+{
+	returnclass (value) res retain;
+	SessionDB sdb (mdb);
+	CoreSession **all = new CoreSession* [count];
+	statstring *ids = new statstring [count];
+	long long t1, t2, t3, t4, t5, t6;
+	
+	t1 = sessionusecnow ();
+	for (int i=0; i<count; ++i)
+	{
+		all[i] = sdb.create (emptyvalue);
+		ids[i] = all[i]->id;
+		sdb.release (all[i]);
+	}
+	
+	t2 = sessionusecnow ();
+	for (int i=0; i<count; ++i) all[i] = sdb.get (ids[i]);
+	
+	t3 = sessionusecnow ();
+	for (int i=0; i<count; ++i) sdb.release (all[i]);
+	
+	// Half of them log out, the others are left to time out.
+	t4 = sessionusecnow ();
+	for (int i=0; i<count; i+=2) sdb.remove (all[i]);
+	
+	t5 = sessionusecnow ();
+	int expired = sdb.expire (kernel.time.now() + sdb.timeout +
+							  SESSION_WHEELTICK);
+	t6 = sessionusecnow ();
+	
+	res["create"] = $("usecs", (int) (t2-t1)) -> $("count", count);
+	res["get"] = $("usecs", (int) (t3-t2)) -> $("count", count);
+	res["release"] = $("usecs", (int) (t4-t3)) -> $("count", count);
+	res["remove"] = $("usecs", (int) (t5-t4)) -> $("count", (count+1)/2);
+	res["expire"] = $("usecs", (int) (t6-t5)) -> $("count", expired);
+	
+	delete[] all;
+	delete[] ids;
+	return &res;
+}
+
+// ==========================================================================
+// CONSTRUCTOR RecordCache
+// ==========================================================================
+RecordCache::RecordCache (void)
+{
+	gen = 0;
+	bytes = 0;
+	hits = misses = 0;
+}
+
+// ==========================================================================
+// DESTRUCTOR RecordCache
+// ==========================================================================
+RecordCache::~RecordCache (void)
+{
+}
+
+// ==========================================================================
+// METHOD RecordCache::get
+// ==========================================================================
+bool RecordCache::get (const string &key, value &into, string &next,
+					   unsigned int &pgen)
+{
+	pgen = DBManager::writeGeneration ();
+	
+	exclusivesection (entries)
+	{
+		// Any write may show up in any listing, a new generation
+		// leaves nothing worth keeping.
+		if (gen != pgen)
 		{
-			CORE->logError ("Session", "Software bug in session "
-							"database expiration, exception caught.");
+			entries.o.clear ();
+			bytes = 0;
+			gen = pgen;
 		}
+		
+		if (entries.o.exists (key))
+		{
+			// Move to the back, the front is evicted first.
+			value e = entries.o[key];
+			entries.o.rmval (key);
+			entries.o[key] = e;
+			
+			into = e["res"];
+			next = e["next"].sval();
+			hits++;
+			breaksection return true;
+		}
+		
+		misses++;
 	}
 	
-	return result;
+	return false;
+}
+
+// ==========================================================================
+// METHOD RecordCache::put
+// ==========================================================================
+void RecordCache::put (const string &key, unsigned int pgen,
+					   const value &res, const string &next)
+{
+	// Something was written while the result was read.
+	if (DBManager::writeGeneration () != pgen) return;
+	
+	string packed = res.tomsgpack ();
+	int sz = packed.strlen() + key.strlen() + next.strlen();
+	if (sz > SESSION_CACHEBYTES/4) return;
+	
+	exclusivesection (entries)
+	{
+		if (gen != pgen) breaksection return;
+		
+		if (entries.o.exists (key))
+		{
+			bytes -= entries.o[key]["bytes"].ival();
+			entries.o.rmval (key);
+		}
+		
+		while (entries.o.count() && (bytes + sz > SESSION_CACHEBYTES))
+		{
+			bytes -= entries.o[0]["bytes"].ival();
+			entries.o.rmindex (0);
+		}
+		
+		entries.o[key] = $("res", res) ->
+						 $("next", next) ->
+						 $("bytes", sz);
+		bytes += sz;
+	}
+}
+
+// ==========================================================================
+// METHOD RecordCache::clear
+// ==========================================================================
+void RecordCache::clear (void)
+{
+	exclusivesection (entries)
+	{
+		entries.o.clear ();
+		bytes = 0;
+	}
+}
+
+// ==========================================================================
+// METHOD RecordCache::stats
+// ==========================================================================
+value *RecordCache::stats (void)
+{
+	returnclass (value) res retain;
+	
+	sharedsection (entries)
+	{
+		unsigned int total = hits + misses;
+		res = $("cachehits", hits) ->
+			  $("cachemisses", misses) ->
+			  $("cachehitrate", total ? (int) ((hits * 100ULL) / total) : 0) ->
+			  $("cacheentries", entries.o.count()) ->
+			  $("cachebytes", bytes);
+	}
+	
+	return &res;
 }
 
 // ==========================================================================
@@ -447,9 +995,14 @@ int SessionDB::expire (void)
 CoreSession::CoreSession (const statstring &myid, class ModuleDB &pmdb)
 	: id (myid), mdb (pmdb)
 {
-	next = prev = higher = lower = NULL;
+	next = prev = NULL;
+	wnext = wprev = NULL;
+	wslot = -1;
 	heartbeat = kernel.time.now();
 	inuse = 0;
+	delegated = false;
+	journaled = false;
+	restored = false;
 	if (! db.init ())
 	{
 		CORE->logError ("Session", "Error initializing the sqlite3 "
@@ -559,8 +1112,6 @@ string *CoreSession::createObject (const statstring &parentid,
 								   bool immediate)
 {
 	string uuid;
-	string err; // normalization error text.
-	value nparam; // normalized parameters.
 	value withparam = _withparam;
 	statstring withid = _withid;
 	statstring owner;
@@ -586,13 +1137,147 @@ string *CoreSession::createObject (const statstring &parentid,
 		return r;
 	}
 
+	if (! prepareCreate (parentid, ofclass, withparam, withid)) return NULL;
+	
+	CoreClass &cl = mdb.getClass (ofclass);
+
+	value ctx;
+	value parm;
+
+	if (mdb.classIsDynamic (ofclass))
+	{
+		uuid = strutil::uuid();
+		
+		ctx = $("OpenCORE:Context", ofclass) ->
+			  $("OpenCORE:Session",
+					$("sessionid", id.sval()) ->
+					$("classid", ofclass) ->
+					$("objectid", withid ? withid.sval() : uuid)
+			   )->
+			  $(ofclass,withparam);
+		
+		if (cl.requires && parentid)
+		{
+			value par;
+			if (mdb.classIsDynamic (cl.requires))
+			{
+				ctx << syncDynamicObjects (nokey, cl.requires, 0, -1, parentid);
+			}
+			else
+			{
+				statstring puuid;
+				puuid = db.findObject (nokey, ofclass, parentid, nokey);
+				if (! puuid) puuid = db.findObject (nokey, ofclass, nokey, parentid);
+				
+				value pv;
+				if (db.fetchObject (pv, puuid, false))
+				{
+					ctx << pv;
+				}
+			}
+		}
+		
+		DEBUG.storeFile ("Session","dynamic-ctx", ctx, "createObject");
+	}
+	else
+	{
+		// create the object in the database, it will be marked as wanted.
+		// The object and its change of owner are committed together,
+		// before the module gets to see it.
+		if (! db.begin ())
+		{
+			setError (db.getLastErrorCode(), db.getLastError());
+			return NULL;
+		}
+		
+		uuid = db.createObject(parentid, withparam, ofclass, withid, false, immediate);
+		if (! uuid)
+		{
+			CORE->logError ("Session", "Database error: %s"
+							%format (db.getLastError()));
+			setError (db.getLastErrorCode(), db.getLastError());
+			db.rollback ();
+			return NULL;
+		}
+		
+		if (owner)
+		{
+			if (! chown (uuid, owner))
+			{
+				db.rollback ();
+				setError (ERR_SESSION_CHOWN);
+				return NULL;
+			}
+		}
+		
+		if (! db.commit ())
+		{
+			CORE->logError ("Session", "Database error: %s"
+							%format (db.getLastError()));
+			setError (db.getLastErrorCode(), db.getLastError());
+			return NULL;
+		}
+
+		if (immediate)
+		{
+			return new (memory::retainable::onstack) string (uuid);
+		}
+
+		// Get the parameters for the module action.
+		if (! db.fetchObject (parm, uuid, true /* formodule */))
+		{
+			log::write (log::critical, "Session", "Database failure getting object-"
+					   "related data for '%S': %s" %format (uuid,
+						db.getLastError()));
+					   
+			ALERT->alert ("Session error on object-related data\n"
+						  "uuid=<%S> error=<%s>" %format (uuid,
+						  db.getLastError()));
+			return NULL;
+		}
+	
+		// Bring them into a larger context.
+		ctx = $("OpenCORE:Context", parm[0].id()) ->
+			  $("OpenCORE:Session",
+					$("sessionid", id.sval()) ->
+					$("classid", ofclass) ->
+					$("objectid", withid ? withid.sval() : uuid)
+			   );
+		
+		// Merge the parameters
+		ctx << parm;
+	}
+	
+	// Perform the moduleaction.
+	string moderr;
+	corestatus_t res = mdb.createObject (ofclass, withid, ctx, moderr);
+	if (! finishCreate (res, ofclass, uuid, parm, moderr)) return NULL;
+
+	if (ofclass && mdb.getClass (ofclass).cascades)
+	{
+		handleCascade (parentid, ofclass, uuid);
+	}
+	
+	return new (memory::retainable::onstack) string (uuid);
+}
+
+// ==========================================================================
+// METHOD CoreSession::prepareCreate
+// ==========================================================================
+bool CoreSession::prepareCreate (const statstring &parentid,
+								 const statstring &ofclass,
+								 value &withparam,
+								 statstring &withid)
+{
+	string err; // normalization error text.
+	
 	// Check for the class.
 	if (! mdb.classExists (ofclass))
 	{
 		CORE->logError ("Session", "Create request for class <%S> "
 				    	"which does not exist" %format (ofclass));
 		setError (ERR_SESSION_CLASS_UNKNOWN);
-		return NULL;
+		return false;
 	}
 	
 	// Resolve to a CoreClass reference.
@@ -607,7 +1292,7 @@ string *CoreSession::createObject (const statstring &parentid,
 		CORE->logError ("Session", "Create request with manual id "
 				    	"on class <%S> with autoindex" %format (ofclass));
 		setError (ERR_SESSION_INDEX);
-		return NULL;
+		return false;
 	}
 	
 	if (cl.manualindex && (! withid))
@@ -615,7 +1300,7 @@ string *CoreSession::createObject (const statstring &parentid,
 		CORE->logError ("Session", "Create request with no required "
 				    	"manual id on class <%S>" %format (ofclass));
 		setError (ERR_SESSION_NOINDEX);
-		return NULL;
+		return false;
 	}
 	
 	if (cl.parentrealm)
@@ -628,7 +1313,7 @@ string *CoreSession::createObject (const statstring &parentid,
 			CORE->logError ("Session", "Lookup failed for "
 							"fetchObject on parentid=<%S>" %format (parentid));
 			setError (ERR_SESSION_PARENTREALM);
-			return NULL;
+			return false;
 		}
 		
 		pmid = vparent[0]["metaid"];
@@ -637,7 +1322,7 @@ string *CoreSession::createObject (const statstring &parentid,
 			CORE->logError ("Session", "Error getting metaid "
 							"from resolved parent object: %J" %format (vparent));
 			setError (ERR_SESSION_PARENTREALM, "Error finding metaid");
-			return NULL;
+			return false;
 		}
 		
 		if ((! cl.hasprototype) && (pmid.strstr ("$prototype$") >= 0))
@@ -646,7 +1331,7 @@ string *CoreSession::createObject (const statstring &parentid,
 					    	"create new prototype records under"
 					    	" id=%S" %format (pmid));
 			setError (ERR_SESSION_CREATEPROTO);
-			return NULL;
+			return false;
 		}
 		
 		if (cl.parentrealm == "domainsuffix")
@@ -683,162 +1368,331 @@ string *CoreSession::createObject (const statstring &parentid,
 				withid = "%s@%s" %format (withid, pmid);
 			}
 		}
-
-		if (withparam.exists ("id")) withparam["id"] = withid;
+
+		if (withparam.exists ("id")) withparam["id"] = withid;
+	}
+	
+	DEBUG.storeFile ("Session", "normalize-pre", withparam, "createObject");
+	
+	if (! cl.normalize (withparam, err))
+	{
+		CORE->logError ("Session", "Input data validation "
+				    "error: %s " %format (err));
+		setError (ERR_SESSION_VALIDATION, err);
+		return false;
+	}
+
+	DEBUG.storeFile ("Session", "normalize-post", withparam, "createObject");
+	
+	// Handle any module-bound crypting voodoo on the fields.
+	if (! handleCrypts (parentid, ofclass, withid, withparam))
+	{
+		CORE->logError ("Session", "Create failed due to crypt error");
+		// handleCrypts already sets the error
+		return false;
+	}
+
+	return true;
+}
+
+// ==========================================================================
+// METHOD CoreSession::finishCreate
+// ==========================================================================
+bool CoreSession::finishCreate (corestatus_t res, const statstring &ofclass,
+								const string &uuid, const value &parm,
+								string &moderr)
+{
+	// Handle the result.
+	switch (res)
+	{
+		case status_ok:
+			// Report success to the database.
+			if (! db.reportSuccess (uuid))
+			{
+				// Failed. Not sure if this is what we want.
+				setError (db.getLastErrorCode(), db.getLastError());
+				CORE->logError ("session ", "Database failure on marking "
+						    	"record: %s" %format (db.getLastError()));
+				
+				// The module gets the data of this very object to undo.
+				value ownparm = parm;
+				if ((! ownparm.count()) &&
+					(! db.fetchObject (ownparm, uuid, true /* formodule */)))
+				{
+					log::write (log::critical, "Session", "Database failure "
+								"getting object-related data for '%S': %s"
+								%format (uuid, db.getLastError()));
+					return false;
+				}
+				
+				(void) mdb.deleteObject (ofclass, uuid, ownparm, moderr);
+				return false;
+			}
+			break;
+		
+		case status_failed:
+			setError (ERR_MDB_ACTION_FAILED, moderr);
+			
+			if (! db.reportCreateFailure (uuid))
+			{
+				string err = db.getLastError();
+				CORE->logError ("session ", "Database failure on "
+						    	"marking delete %s" %format (err));
+			}
+			return false;
+			
+		case status_postponed:
+			break;
+	}
+	
+	return true;
+}
+
+// ==========================================================================
+// METHOD CoreSession::createObjects
+// ==========================================================================
+value *CoreSession::createObjects (const value &items, bool immediate)
+{
+	returnclass (value) res retain;
+	value batch; // validated objects that go into the database.
+	value deferred; // internal and dynamic objects, created afterwards.
+	bool failed = false;
+	
+	// Validate everything before the database gets involved. Internal
+	// and dynamic classes keep their objects elsewhere and can only be
+	// validated by creating them, so those wait until the database
+	// part of the batch is committed.
+	for (int i=0; i<items.count(); ++i)
+	{
+		const value &item = items[i];
+		statstring parentid = item["parentid"];
+		statstring ofclass = item["classid"];
+		statstring withid = item["objectid"];
+		value withparam = item["data"];
+		statstring owner;
+		value &r = res.newval();
+		
+		if (mdb.isInternalClass (ofclass) || mdb.classIsDynamic (ofclass))
+		{
+			deferred.newval() = i;
+			continue;
+		}
+		
+		if (withparam.exists ("owner"))
+		{
+			if (withparam["owner"] != "Select ...")
+			{
+				owner = withparam["owner"];
+			}
+			withparam.rmval ("owner");
+		}
+		
+		if (withid) withparam["id"] = withid;
+		
+		if (! prepareCreate (parentid, ofclass, withparam, withid))
+		{
+			r = errors;
+			failed = true;
+			continue;
+		}
+		
+		batch.newval() = $("index", i) ->
+						 $("parentid", parentid) ->
+						 $("classid", ofclass) ->
+						 $("objectid", withid) ->
+						 $("owner", owner) ->
+						 $("data", withparam);
+	}
+	
+	// The whole batch goes into the database as one transaction. If one
+	// object does not make it, none of them do.
+	if ((! failed) && batch.count())
+	{
+		if (! db.begin ())
+		{
+			setError (db.getLastErrorCode(), db.getLastError());
+			failed = true;
+		}
+		else
+		{
+			foreach (b, batch)
+			{
+				statstring parentid = b["parentid"];
+				statstring ofclass = b["classid"];
+				statstring withid = b["objectid"];
+				statstring owner = b["owner"];
+				string uuid;
+				
+				uuid = db.createObject (parentid, b["data"], ofclass, withid,
+										false, immediate);
+				if (! uuid)
+				{
+					CORE->logError ("Session", "Database error: %s"
+									%format (db.getLastError()));
+					setError (db.getLastErrorCode(), db.getLastError());
+				}
+				else if (owner && (! chown (uuid, owner)))
+				{
+					setError (ERR_SESSION_CHOWN);
+					uuid.crop ();
+				}
+				
+				if (! uuid)
+				{
+					res[b["index"].ival()] = errors;
+					failed = true;
+					break;
+				}
+				
+				b["uuid"] = uuid;
+			}
+			
+			if (failed) db.rollback ();
+			else if (! db.commit ())
+			{
+				CORE->logError ("Session", "Database error: %s"
+								%format (db.getLastError()));
+				setError (db.getLastErrorCode(), db.getLastError());
+				failed = true;
+			}
+		}
+	}
+	
+	if (failed)
+	{
+		value batcherr = errors;
+		setError (ERR_SESSION_BATCH);
+		
+		for (int i=0; i<res.count(); ++i)
+		{
+			if (! res[i].count()) res[i] = errors;
+		}
+		
+		errors = batcherr;
+		return &res;
 	}
 	
-	DEBUG.storeFile ("Session", "normalize-pre", withparam, "createObject");
-	
-	if (! cl.normalize (withparam, err))
+	// Internal and dynamic objects go in once the rest is safely in the
+	// database, each one on its own.
+	foreach (d, deferred)
 	{
-		CORE->logError ("Session", "Input data validation "
-				    "error: %s " %format (err));
-		setError (ERR_SESSION_VALIDATION, err);
-		return NULL;
+		const value &item = items[d.ival()];
+		statstring parentid = item["parentid"];
+		statstring ofclass = item["classid"];
+		statstring withid = item["objectid"];
+		value &r = res[d.ival()];
+		string uuid;
+		
+		uuid = createObject (parentid, ofclass, item["data"], withid,
+							 immediate);
+		
+		if (uuid) r["objid"] = uuid;
+		else r = errors;
 	}
-
-	DEBUG.storeFile ("Session", "normalize-post", withparam, "createObject");
 	
-	// Handle any module-bound crypting voodoo on the fields.
-	if (! handleCrypts (parentid, ofclass, withid, withparam))
+	if (immediate)
 	{
-		CORE->logError ("Session", "Create failed due to crypt error");
-		// handleCrypts already sets the error
-		return NULL;
+		foreach (b, batch) res[b["index"].ival()]["objid"] = b["uuid"];
+		return &res;
 	}
-
-	value ctx;
-	value parm;
-
-	if (mdb.classIsDynamic (ofclass))
+	
+	// Children of an allchildren parent that lives in the same module
+	// reach the module as one block with all of their siblings, so one
+	// action for the last of them covers the whole group. Anything else
+	// gets an action of its own.
+	value groups;
+	value parentclass;
+	
+	for (int i=0; i<batch.count(); ++i)
 	{
-		uuid = strutil::uuid();
-		
-		ctx = $("OpenCORE:Context", ofclass) ->
-			  $("OpenCORE:Session",
-					$("sessionid", id.sval()) ->
-					$("classid", ofclass) ->
-					$("objectid", withid ? withid.sval() : uuid)
-			   )->
-			  $(ofclass,withparam);
+		const value &b = batch[i];
+		statstring parentid = b["parentid"];
+		statstring ofclass = b["classid"];
+		CoreClass &cl = mdb.getClass (ofclass);
+		statstring key = b["uuid"];
 		
-		if (cl.requires && parentid)
+		if (parentid)
 		{
-			value par;
-			if (mdb.classIsDynamic (cl.requires))
+			if (! parentclass.exists (parentid))
 			{
-				ctx << syncDynamicObjects (nokey, cl.requires, 0, -1, parentid);
+				statstring pc;
+				pc = db.classNameFromUUID (parentid);
+				parentclass[parentid] = pc.sval();
 			}
-			else
+			
+			statstring pclass = parentclass[parentid];
+			if (pclass && mdb.classExists (pclass))
 			{
-				statstring puuid;
-				puuid = db.findObject (nokey, ofclass, parentid, nokey);
-				if (! puuid) puuid = db.findObject (nokey, ofclass, nokey, parentid);
-				
-				value pv;
-				if (db.fetchObject (pv, puuid, false))
+				CoreClass &pcl = mdb.getClass (pclass);
+				if (pcl.allchildren && (&pcl.module == &cl.module))
 				{
-					ctx << pv;
+					key = "%s/%s" %format (ofclass, parentid);
 				}
 			}
 		}
 		
-		DEBUG.storeFile ("Session","dynamic-ctx", ctx, "createObject");
+		groups[key].newval() = i;
 	}
-	else
+	
+	foreach (g, groups)
 	{
-		// create the object in the database, it will be marked as wanted.
-		uuid = db.createObject(parentid, withparam, ofclass, withid, false, immediate);
-		if (! uuid)
-		{
-			CORE->logError ("Session", "Database error: %s"
-							%format (db.getLastError()));
-			setError (db.getLastErrorCode(), db.getLastError());
-			return NULL;
-		}
+		const value &last = batch[g[g.count()-1].ival()];
+		statstring ofclass = last["classid"];
+		statstring withid = last["objectid"];
+		string uuid = last["uuid"];
+		value parm;
+		value ctx;
+		string moderr;
+		corestatus_t st;
 		
-		if (owner)
-		{
-			if (! chown (uuid, owner))
-			{
-				db.reportCreateFailure (uuid);
-				setError (ERR_SESSION_CHOWN);
-				return NULL;
-			}
-		}
-
-		if (immediate)
+		if (db.fetchObject (parm, uuid, true /* formodule */))
 		{
-			return new (memory::retainable::onstack) string (uuid);
+			ctx = $("OpenCORE:Context", parm[0].id()) ->
+				  $("OpenCORE:Session",
+						$("sessionid", id.sval()) ->
+						$("classid", ofclass) ->
+						$("objectid", withid ? withid.sval() : uuid)
+				   );
+			
+			ctx << parm;
+			st = mdb.createObject (ofclass, withid, ctx, moderr);
 		}
-
-		// Get the parameters for the module action.
-		if (! db.fetchObject (parm, uuid, true /* formodule */))
+		else
 		{
-			log::write (log::critical, "Session", "Database failure getting object-"
-					   "related data for '%S': %s" %format (uuid,
+			log::write (log::critical, "Session", "Database failure getting "
+					    "object-related data for '%S': %s" %format (uuid,
 						db.getLastError()));
-					   
-			ALERT->alert ("Session error on object-related data\n"
-						  "uuid=<%S> error=<%s>" %format (uuid,
-						  db.getLastError()));
-			return NULL;
+			
+			moderr = db.getLastError();
+			st = status_failed;
 		}
-	
-		// Bring them into a larger context.
-		ctx = $("OpenCORE:Context", parm[0].id()) ->
-			  $("OpenCORE:Session",
-					$("sessionid", id.sval()) ->
-					$("classid", ofclass) ->
-					$("objectid", withid ? withid.sval() : uuid)
-			   );
 		
-		// Merge the parameters
-		ctx << parm;
-	}
-	
-	// Perform the moduleaction.
-	string moderr;
-	corestatus_t res = mdb.createObject (ofclass, withid, ctx, moderr);
-
-	// Handle the result.
-	switch (res)
-	{
-		case status_ok:
-			// Report success to the database.
-			if (! db.reportSuccess (uuid))
+		foreach (idx, g)
+		{
+			const value &b = batch[idx.ival()];
+			value &r = res[b["index"].ival()];
+			string buuid = b["uuid"];
+			
+			// parm holds the data of the last object only, the others
+			// have theirs fetched if the module needs to undo them
+			const value &bparm = (buuid == uuid) ? parm : emptyvalue;
+			
+			if (! finishCreate (st, ofclass, buuid, bparm, moderr))
 			{
-				// Failed. Not sure if this is what we want.
-				setError (db.getLastErrorCode(), db.getLastError());
-				CORE->logError ("session ", "Database failure on marking "
-						    	"record: %s" %format (db.getLastError()));
-				
-				(void) mdb.deleteObject (ofclass, uuid, parm, moderr);
-				return NULL;
+				r = errors;
+				continue;
 			}
-			break;
-		
-		case status_failed:
-			setError (ERR_MDB_ACTION_FAILED, moderr);
 			
-			if (! db.reportCreateFailure (uuid))
+			if (mdb.getClass (ofclass).cascades)
 			{
-				string err = db.getLastError();
-				CORE->logError ("session ", "Database failure on "
-						    	"marking delete %s" %format (err));
+				handleCascade (b["parentid"].sval(), ofclass, b["uuid"].sval());
 			}
-			return NULL;
 			
-		case status_postponed:
-			break;
-	}
-
-	if (ofclass && mdb.getClass (ofclass).cascades)
-	{
-		handleCascade (parentid, ofclass, uuid);
+			r["objid"] = b["uuid"];
+		}
 	}
 	
-	return new (memory::retainable::onstack) string (uuid);
+	return &res;
 }
 
 // ==========================================================================
@@ -1578,6 +2432,9 @@ statstring *CoreSession::getQuotaUUID (const statstring &userid,
 		res = strutil::uuid ();
 		quotamap["metaid"][userid][name] = res;
 		quotamap["uuid"][res] = name;
+		
+		// the uuid was handed out, it has to survive a restart
+		if (journaled) CORE->sdb->persist (this);
 	}
 	
 	return &res;
@@ -1748,7 +2605,8 @@ value *CoreSession::listMeta (const statstring &parentid,
 // ==========================================================================
 value *CoreSession::listObjects (const statstring &parentid,
 							     const statstring &ofclass,
-							     int offset, int count)
+							     int offset, int count,
+							     const value &whitelist)
 {
 	returnclass (value) res retain;
 	
@@ -1765,6 +2623,7 @@ value *CoreSession::listObjects (const statstring &parentid,
 		InternalClass &cl = mdb.getInternalClass (ofclass);
 		res = cl.listObjects (this, parentid);
 		if (! res.count()) setError (ERR_ICLASS, cl.error());
+		else if (whitelist.count()) applyFieldWhiteList (res, whitelist);
 		return &res;
 	}
 
@@ -1779,6 +2638,7 @@ value *CoreSession::listObjects (const statstring &parentid,
 	if (ofclass && mdb.classIsMetaBase (ofclass))
 	{
 		res = listMeta (parentid, ofclass, offset, count);
+		if (whitelist.count()) applyFieldWhiteList (res, whitelist);
 		return &res;
 	}
 
@@ -1790,23 +2650,172 @@ value *CoreSession::listObjects (const statstring &parentid,
 		log::write (log::debug, "Session", "Class is dynamic");
 		
 		res = syncDynamicObjects (parentid, ofclass, offset, count);
+		if (whitelist.count()) applyFieldWhiteList (res, whitelist);
 		return &res;
 	}
 	
+	// The GUI asks for the same listing on every tab switch.
+	string wl = whitelist.tojson ();
+	string key = "list/%s/%s/%i/%i/%s" %format (parentid, ofclass, offset,
+												count, wl);
+	string next;
+	unsigned int gen;
+	if (rcache.get (key, res, next, gen)) return &res;
+	
 	// Get the list out of the database. Either pure, or through or
 	// just-in-time-insertion super-secret techniques above.
 	if (! db.listObjects (res, parentid, $(ofclass), false /* not formodule */,
-						   count, offset))
+						   count, offset, whitelist))
 	{
 		res.clear();
 		setError (db.getLastErrorCode(), db.getLastError());
 	}
+	else rcache.put (key, gen, res, next);
 	
 	DEBUG.storeFile ("Session", "res", res, "listObjects");
 
 	return &res;
 }
 
+// ==========================================================================
+// METHOD CoreSession::listObjectPage
+// ==========================================================================
+value *CoreSession::listObjectPage (const statstring &parentid,
+									const statstring &ofclass,
+									int count, const string &after,
+									string &next, const value &whitelist)
+{
+	returnclass (value) res retain;
+	
+	next.crop();
+	
+	// Only plain database classes can continue from a token, the
+	// others are produced in one go anyway.
+	if (mdb.isInternalClass (ofclass) || (! mdb.classExists (ofclass)) ||
+		(ofclass && mdb.classIsMetaBase (ofclass)) ||
+		mdb.classIsDynamic (ofclass))
+	{
+		res = listObjects (parentid, ofclass, 0, count, whitelist);
+		return &res;
+	}
+	
+	string wl = whitelist.tojson ();
+	string key = "page/%s/%s/%i/%s/%s" %format (parentid, ofclass, count,
+												after, wl);
+	unsigned int gen;
+	if (rcache.get (key, res, next, gen)) return &res;
+	
+	if (! db.listObjectPage (res, parentid, $(ofclass), count, after, next,
+							 whitelist))
+	{
+		res.clear();
+		setError (db.getLastErrorCode(), db.getLastError());
+	}
+	else rcache.put (key, gen, res, next);
+	
+	return &res;
+}
+
+// ==========================================================================
+// METHOD CoreSession::countObjects
+// ==========================================================================
+int CoreSession::countObjects (const statstring &parentid,
+							   const statstring &ofclass)
+{
+	if (mdb.isInternalClass (ofclass) || (! mdb.classExists (ofclass)) ||
+		(ofclass && mdb.classIsMetaBase (ofclass)) ||
+		mdb.classIsDynamic (ofclass))
+	{
+		return -1;
+	}
+	
+	// Asked for along with every page, so it is cached like the pages
+	// and goes stale with them.
+	string key = "count/%s/%s" %format (parentid, ofclass);
+	value cached;
+	string next;
+	unsigned int gen;
+	if (rcache.get (key, cached, next, gen)) return cached["total"].ival();
+	
+	int res = db.countObjects (parentid, $(ofclass));
+	if (res >= 0) rcache.put (key, gen, $("total", res), next);
+	return res;
+}
+
+// ==========================================================================
+// METHOD CoreSession::searchObjects
+// ==========================================================================
+value *CoreSession::searchObjects (const statstring &parentid,
+								   const statstring &ofclass,
+								   const statstring &field,
+								   const string &text, dbsearchmode mode,
+								   int offset, int count, int &total)
+{
+	returnclass (value) res retain;
+	
+	bool indb = (! mdb.isInternalClass (ofclass)) &&
+				mdb.classExists (ofclass) &&
+				(! (ofclass && mdb.classIsMetaBase (ofclass))) &&
+				(! mdb.classIsDynamic (ofclass)) &&
+				db.isSearchable (ofclass, field);
+	
+	if (indb)
+	{
+		if (! db.searchObjects (res, parentid, ofclass, field, text, mode,
+								count, offset))
+		{
+			res.clear();
+			setError (db.getLastErrorCode(), db.getLastError());
+			total = 0;
+			return &res;
+		}
+		
+		total = (count >= 0) ? db.countSearch (parentid, ofclass, field,
+											   text, mode)
+							 : res[0].count();
+		return &res;
+	}
+	
+	// Not in the search index, filter the complete listing.
+	res = listObjects (parentid, ofclass, 0, -1);
+	
+	for (int pos = res[0].count() - 1; pos>=0; pos--)
+	{
+		string v = res[0][pos][field].sval();
+		bool match;
+		
+		switch (mode)
+		{
+			case DBSEARCH_PREFIX:
+				match = (strncasecmp (v.str(), text.str(), text.strlen()) == 0);
+				break;
+			
+			case DBSEARCH_SUBSTRING:
+				match = (strcasestr (v.str(), text.str()) != NULL);
+				break;
+			
+			default:
+				match = (v == text);
+				break;
+		}
+		
+		if (! match) res[0].rmindex (pos);
+	}
+	
+	total = res[0].count();
+	
+	if (offset > 0 || count >= 0)
+	{
+		for (int pos = total - 1; pos>=0; pos--)
+		{
+			if ((pos < offset) || ((count >= 0) && (pos >= offset+count)))
+				res[0].rmindex (pos);
+		}
+	}
+	
+	return &res;
+}
+
 // ==========================================================================
 // METHOD CoreSession::applyFieldWhiteList
 // ==========================================================================
@@ -1844,6 +2853,11 @@ value *CoreSession::getObject (const statstring &parentid,
 		return &res;
 	}
 	
+	string key = "get/%s/%s/%s" %format (parentid, ofclass, withid);
+	string next;
+	unsigned int gen;
+	if (rcache.get (key, res, next, gen)) return &res;
+	
 	// Find the object, either by uuid or by metaid.
 	uuid = db.findObject (parentid, ofclass, withid, nokey);
 	if (! uuid) uuid = db.findObject (parentid, ofclass, nokey, withid);
@@ -1859,7 +2873,8 @@ value *CoreSession::getObject (const statstring &parentid,
 		return &res;
 	}
 	
-	if (! db.fetchObject (res, uuid, false /* formodule */))
+	if (! db.fetchObject (res, uuid, false /* formodule */,
+						  true /* hidepasswords */))
 	{
 		log::write (log::critical, "Session", "Database failure getting object-"
 				    "related data for '%s': %S" %format (uuid,
@@ -1873,14 +2888,8 @@ value *CoreSession::getObject (const statstring &parentid,
 		return NULL;
 	}
 		
-	foreach (field, res[0])
-	{
-		if (field.attribexists ("type"))
-		{
-			if (field("type") == "password") field = "";
-		}
-	}
 	res[0]["class"] = ofclass;
+	rcache.put (key, gen, res, next);
 
 	DEBUG.storeFile ("Session","res", res, "getObject");
 	return &res; 
@@ -1905,8 +2914,12 @@ void SessionExpireThread::run (void)
 		
 		while (true)
 		{
-			// Wait either 60 seconds or until the next event.
-			value ev = waitevent (60000);
+			// Wait a quarter of the session timeout, so sessions do not
+			// linger much past it, or until the next event.
+			int secs = sdb->getTimeout() / 4;
+			if (secs < 1) secs = 1;
+			if (secs > 60) secs = 60;
+			value ev = waitevent (secs * 1000);
 			if (ev)
 			{
 				// A 'die' event is a shutdown request.
@@ -1941,6 +2954,90 @@ void SessionExpireThread::run (void)
 	}
 }
 
+// ==========================================================================
+// METHOD SessionJournal::run
+// ==========================================================================
+void SessionJournal::run (void)
+{
+	try
+	{
+		// The snapshot is made from what was sent here, live sessions
+		// are never looked at from this thread.
+		SessionDB::readFromDisk (snappath, journalpath, legacypath,
+								 sessions);
+		
+		fd = ::open (journalpath.str(), O_WRONLY|O_APPEND|O_CREAT, 0600);
+		records = 0;
+		if (fd < 0)
+		{
+			log::write (log::error, "journal", "Could not open %s"
+						%format (journalpath));
+		}
+		
+		log::write (log::info, "journal", "Thread started");
+		
+		while (true)
+		{
+			value ev = waitevent ();
+			
+			if (ev["cmd"] == "die")
+			{
+				log::write (log::info, "journal", "Thread shutting down");
+				compact ();
+				if (fd >= 0) ::close (fd);
+				shutdownCondition.broadcast();
+				return;
+			}
+			
+			if (ev["cmd"] == "write")
+			{
+				SessionDB::applyRecord (sessions, ev["data"]);
+				
+				string json = ev["data"].tojson ();
+				string rec = "\036";
+				rec.strcat (json);
+				rec.strcat ("\n");
+				
+				if ((fd >= 0) &&
+					(::write (fd, rec.str(), rec.strlen()) < 0))
+				{
+					log::write (log::error, "journal", "Error writing to "
+								"%s" %format (journalpath));
+				}
+				
+				if (++records >= SESSION_JOURNALMAX) compact ();
+			}
+		}
+	}
+	catch (...)
+	{
+		log::write (log::error, "journal", "Thread exited on unknown "
+					"exception.");
+		shutdownCondition.broadcast();
+	}
+}
+
+// ==========================================================================
+// METHOD SessionJournal::compact
+// ==========================================================================
+void SessionJournal::compact (void)
+{
+	// The snapshot holds every record written so far, records still
+	// queued go to the new journal.
+	// Without a snapshot the journal is all there is, so it stays and
+	// the next attempt waits for another round of records.
+	if (! SessionDB::saveSnapshot (sessions, snappath))
+	{
+		records = 0;
+		return;
+	}
+	
+	if (fd >= 0) ::close (fd);
+	fd = ::open (journalpath.str(), O_WRONLY|O_APPEND|O_CREAT|O_TRUNC,
+				 0600);
+	records = 0;
+}
+
 // ==========================================================================
 // METHOD CoreSession::getModuleForClass
 // ==========================================================================
@@ -14,14 +14,119 @@
 #include <grace/thread.h>
 #include "api.h"
 #include "dbmanager.h"
+#include "status.h"
 
 $exception (sqliteInitException, "Error initializing sqlite");
-$exception (sessionUnlinkException, "Error unlinking session node");
+
+/// Number of lock stripes in the SessionDB, a power of two.
+#define SESSIONDB_SHARDS 64
+
+/// Slots in the expiry wheel of each stripe, a power of two.
+#define SESSION_WHEELSLOTS 256
+
+/// Seconds covered by one slot of the expiry wheel.
+#define SESSION_WHEELTICK 4
+
+/// Default idle time in seconds before a session expires.
+#define SESSION_TIMEOUT 600
+
+/// Slots in the table of delegated sessions, a power of two.
+#define SESSION_DELEGATES 256
+
+/// Journal records written before the journal is folded into a new
+/// snapshot.
+#define SESSION_JOURNALMAX 4096
+
+/// Bytes of getRecords/getRecord results each session keeps around.
+#define SESSION_CACHEBYTES (256*1024)
+
+//  -------------------------------------------------------------------------
+/// One stripe of the SessionDB hash table. Sessions are chained per
+/// bucket through their next/prev links, so a session is unlinked
+/// without walking anything. The bucket array doubles once there are
+/// more sessions than buckets. Callers hold the stripe's lock.
+///
+/// Every session also sits in one slot of a timer wheel, by the time it
+/// is due to expire. A sweep only looks at the slots that came due since
+/// the last one. Sessions that were used in the meantime move on to the
+/// slot of their new due time, the others are unlinked.
+//  -------------------------------------------------------------------------
+class SessionShard
+{
+public:
+									 /// Constructor.
+									 SessionShard (void);
+									 
+									 /// Destructor.
+									~SessionShard (void);
+	
+									 /// Find a session by id.
+									 /// \return The session or NULL.
+	class CoreSession				*find (const statstring &id);
+	
+									 /// Add a session to its bucket.
+									 /// \param s The session.
+									 /// \param due Time it expires if
+									 ///            nobody uses it.
+	void							 link (class CoreSession *s, time_t due);
+	
+									 /// Take a session out of its bucket
+									 /// and out of the wheel.
+	void							 unlink (class CoreSession *s);
+	
+									 /// Unlink the idle sessions that are
+									 /// due in the slots up to now.
+									 /// \param now The current time.
+									 /// \param timeout Idle seconds.
+									 /// \param dead Receives the unlinked
+									 ///             sessions, chained
+									 ///             through next.
+									 /// \return Number of sessions.
+	int								 sweep (time_t now, int timeout,
+											class CoreSession *&dead);
+	
+	class CoreSession			   **buckets; ///< Chain heads.
+	unsigned int					 size; ///< Number of buckets.
+	unsigned int					 count; ///< Number of sessions.
+
+protected:
+									 /// Double the bucket array.
+	void							 grow (void);
+	
+									 /// Add to a bucket chain.
+	void							 chain (class CoreSession *s);
+	
+									 /// Put a session in the wheel slot
+									 /// for its due time.
+	void							 schedule (class CoreSession *s,
+											   time_t due);
+	
+									 /// Take a session out of the wheel.
+	void							 unschedule (class CoreSession *s);
+	
+									 /// Bucket index of a session-id.
+	unsigned int					 bucket (const statstring &id)
+									 {
+									 	return (id.key() / SESSIONDB_SHARDS)
+									 			& (size-1);
+									 }
+	
+	class CoreSession				*wheel[SESSION_WHEELSLOTS]; ///< Slot heads.
+	time_t							 swept; ///< Last tick swept.
+};
 
 //  -------------------------------------------------------------------------
 /// Collection class for CoreSession objects.
 /// This class is responsible for creating new sessions and giving
 /// access to sessions created earlier through their unique session-id.
+/// Sessions are spread over SESSIONDB_SHARDS hash tables by the hash of
+/// their id, each with a lock of its own. Claims on a session are
+/// counted atomically, so release() takes no lock at all.
+///
+/// Modules that call back into opencore during an action get a delegated
+/// session instead of a full one. These are recycled from a pool, carry
+/// the credentials of the calling session and live in a separate table
+/// with a spinlock per slot, for as long as the action runs.
 //  -------------------------------------------------------------------------
 class SessionDB
 {
@@ -39,8 +144,68 @@ public:
 									 /// Destructor.
 									~SessionDB (void);
 
-	void							 saveToDisk (const string &path);
-	void							 loadFromDisk (const string &path);
+									 /// Write a snapshot of sessions. The
+									 /// file is synced to disk and
+									 /// replaced atomically.
+									 /// \param sessions Serialized
+									 ///                 sessions by id.
+									 /// \param path The snapshot file.
+									 /// \return False if the snapshot
+									 ///         could not be written.
+	static bool						 saveSnapshot (const value &sessions,
+												   const string &path);
+	
+									 /// Read a snapshot, or the xml file
+									 /// of older versions if there is no
+									 /// snapshot, and replay the journal
+									 /// on it.
+									 /// \param path The snapshot file.
+									 /// \param journal The journal file.
+									 /// \param legacy The old xml file.
+									 /// \param sessions Receives the
+									 ///                 serialized sessions.
+									 /// \return Journal records replayed.
+	static int						 readFromDisk (const string &path,
+												   const string &journal,
+												   const string &legacy,
+												   value &sessions);
+	
+									 /// Apply a journal record to a set
+									 /// of serialized sessions.
+									 /// \param sessions The sessions.
+									 /// \param rec The record.
+									 /// \return False if the record was
+									 ///         not understood.
+	static bool						 applyRecord (value &sessions,
+												  const value &rec);
+	
+									 /// Restore sessions from a snapshot,
+									 /// then replay the journal written
+									 /// since. Logins are not redone here,
+									 /// but on the first get() of each
+									 /// session. Without a snapshot, the
+									 /// xml file of older versions is
+									 /// imported once and removed.
+									 /// \param path The snapshot file.
+									 /// \param journal The journal file.
+									 /// \param legacy The old xml file.
+	void							 loadFromDisk (const string &path,
+												   const string &journal,
+												   const string &legacy);
+	
+									 /// Record the state of a session in
+									 /// the journal, if there is one. Call
+									 /// after a successful login.
+									 /// \param s The session.
+	void							 persist (class CoreSession *s);
+	
+									 /// Set the journal that sessions are
+									 /// recorded in.
+									 /// \param j The journal, or NULL.
+	void							 setJournal (class SessionJournal *j)
+									 {
+									 	journal = j;
+									 }
 
 									 /// Find a CoreSession by its
 									 /// session-id. A pointer is
@@ -66,7 +231,8 @@ public:
 	class CoreSession 				*create (const value &meta);
 	
 									 /// Create a new session from data that
-									 /// was serialized earlier.
+									 /// was serialized earlier. The login
+									 /// is left to the first get().
 									 /// \param ser The serialized structure.
 	class CoreSession				*createFromSerialized (const value &ser);
 	
@@ -90,15 +256,45 @@ public:
 									 ///          to remove.
 	void							 remove (class CoreSession *s);
 	
-									 /// Expire any unlocked sessions that
-									 /// are past their due time, or
-									 /// locked sessions that have been
-									 /// in a locked state beyond reasonable
-									 /// limits.
+									 /// Lease a delegated session that
+									 /// acts with the credentials of
+									 /// another one. It is found by get()
+									 /// under a fresh id until it is
+									 /// retired.
+									 /// \param from The calling session.
+									 /// \param meta Session metadata.
+									 /// \return The session, or NULL if
+									 ///         the table is full.
+	class CoreSession				*delegate (class CoreSession *from,
+											   const value &meta);
+	
+									 /// Take a delegated session out of
+									 /// the table and back to the pool.
+									 /// Waits for callers that still
+									 /// hold it.
+									 /// \param s The session.
+	void							 retire (class CoreSession *s);
+	
+									 /// Expire the sessions that nobody
+									 /// holds and that were not used for
+									 /// the timeout. Only the wheel slots
+									 /// that came due are looked at.
+									 /// \param now The current time.
 									 /// \return Number of sessions
 									 ///         cleaned.
+	int								 expire (time_t now);
 	int								 expire (void);
 	
+									 /// Set the idle time before a session
+									 /// expires. Sessions pick it up the
+									 /// next time their slot comes due.
+									 /// \param secs Seconds.
+	void							 setTimeout (int secs);
+	
+									 /// The idle time before a session
+									 /// expires, in seconds.
+	int								 getTimeout (void) { return timeout; }
+	
 									 /// Report if a session exists.
 									 /// \param id The session-id.
 									 /// \return True if session exists.
@@ -109,25 +305,39 @@ public:
 									 ///         the active sessions.
 	value							*list (void);
 	
+									 /// Time the session operations on a
+									 /// scratch database.
+									 /// \param count Number of sessions.
+									 /// \return Microseconds and number of
+									 ///         sessions handled, keyed
+									 ///         by operation.
+	static value					*benchmark (class ModuleDB &mdb,
+												int count);
+	
 protected:
-									 /// Find a CoreSession by id,
-									 /// returns NULL if not found.
-									 /// \param id The session-id.
-									 /// \param noreport If true, don't
-									 ///        report an error on failure.
-	class CoreSession				*find (const statstring &id,
-										   bool noreport = false);
+									 /// The stripe a session-id lives in.
+	lock<SessionShard>				&shard (const statstring &id)
+									 {
+									 	return shards[id.key() &
+									 				  (SESSIONDB_SHARDS-1)];
+									 }
 	
-									 /// Find or create a CoreSession.
+									 /// Put a new session in its stripe.
+									 /// \param s The session.
+	void							 add (class CoreSession *s);
+	
+									 /// Look up and claim a delegated
+									 /// session.
 									 /// \param id The session-id.
-	class CoreSession				*demand (const statstring &id);
-	
-									 /// Add a created session to the
-									 /// linked list.
-	void							 link (class CoreSession *);
-	lock<int>						 lck; //< Lock on the dictionary.
-	class CoreSession				*first; ///< Linked list
-	class CoreSession				*last; ///< Linked list.
+									 /// \return The session or NULL.
+	class CoreSession				*findDelegate (const statstring &id);
+	
+	lock<SessionShard>				 shards[SESSIONDB_SHARDS]; ///< Stripes.
+	class CoreSession * volatile	 delegates[SESSION_DELEGATES]; ///< Leased delegates.
+	volatile int					 delegatelocks[SESSION_DELEGATES]; ///< Slot spinlocks.
+	lock<class CoreSession *>		 spare; ///< Pool of retired delegates.
+	class SessionJournal			*journal; ///< Journal, or NULL.
+	int								 timeout; ///< Idle seconds before expiry.
 	class ModuleDB					&mdb; ///< Reference to the global ModuleDB.
 };
 
@@ -167,6 +377,131 @@ protected:
 	SessionDB	*sdb; ///< Link back to the session database.
 };
 
+//  -------------------------------------------------------------------------
+/// Thread that keeps the session journal. Logins and removals are sent
+/// here as events and appended to the journal, so a crash loses no
+/// sessions and no session call waits for the disk. Once the journal
+/// grows past SESSION_JOURNALMAX records it is folded into a fresh
+/// snapshot. The thread keeps its own copy of the sessions as they were
+/// journaled and writes the snapshot from that, so it never reads a
+/// session another thread may be changing.
+///
+/// Records are JSON texts, each preceded by an ASCII record separator
+/// (RFC 7464). A record torn by a crash fails to parse and is skipped.
+//  -------------------------------------------------------------------------
+class SessionJournal : public thread
+{
+public:
+				 /// Constructor.
+				 /// \param psdb The SessionDB to record.
+				 /// \param psnap Path of the snapshot.
+				 /// \param pjournal Path of the journal.
+				 /// \param plegacy Path of the xml file of older
+				 ///                versions.
+				 SessionJournal (SessionDB *psdb, const string &psnap,
+				 				 const string &pjournal,
+				 				 const string &plegacy)
+				 	: thread ("SessionJournal")
+				 {
+				 	sdb = psdb;
+				 	snappath = psnap;
+				 	journalpath = pjournal;
+				 	legacypath = plegacy;
+				 	spawn ();
+				 }
+				 
+				 /// Destructor.
+				~SessionJournal (void)
+				 {
+				 }
+				 
+				 /// Queue a record for the journal.
+				 /// \param rec The record.
+	void		 write (const value &rec)
+				 {
+				 	value ev;
+				 	ev["cmd"] = "write";
+				 	ev["data"] = rec;
+				 	sendevent (ev);
+				 }
+				 
+				 /// Run-method. Appends queued records, accepts
+				 /// cmd="die" events.
+	void		 run (void);
+	
+				 /// Shut down the thread. The queue is written out and
+				 /// folded into a final snapshot.
+	void		 shutdown (void)
+				 {
+				 	value ev;
+				 	ev["cmd"] = "die";
+				 	sendevent (ev);
+				 	shutdownCondition.wait();
+				 }
+
+protected:
+				 /// Write a snapshot and start an empty journal.
+	void		 compact (void);
+	
+	conditional	 shutdownCondition; ///< Will raise on thread shutdown.
+	SessionDB	*sdb; ///< Link back to the session database.
+	string		 snappath; ///< Path of the snapshot.
+	string		 journalpath; ///< Path of the journal.
+	string		 legacypath; ///< Path of the old xml file.
+	value		 sessions; ///< Sessions as journaled, by id.
+	int			 fd; ///< Journal file, opened for append.
+	int			 records; ///< Records since the last snapshot.
+};
+
+//  -------------------------------------------------------------------------
+/// Results of record listings a session asked for earlier, by the
+/// arguments of the call. All entries are read at one write generation
+/// of the DBManager and the lot is dropped as soon as the generation
+/// moves. The least recently used entries make way once the cache holds
+/// more than SESSION_CACHEBYTES.
+//  -------------------------------------------------------------------------
+class RecordCache
+{
+public:
+						 /// Constructor.
+						 RecordCache (void);
+						 
+						 /// Destructor.
+						~RecordCache (void);
+	
+						 /// Look up a result.
+						 /// \param key The call arguments.
+						 /// \param into Receives the result.
+						 /// \param next Receives the page token.
+						 /// \param gen Receives the generation to
+						 ///            pass to put() on a miss.
+						 /// \return True on a hit.
+	bool				 get (const string &key, value &into, string &next,
+							  unsigned int &gen);
+	
+						 /// Store a result. Dropped if the database
+						 /// was written since get() handed out gen.
+						 /// \param key The call arguments.
+						 /// \param gen Generation from get().
+						 /// \param res The result.
+						 /// \param next The page token.
+	void				 put (const string &key, unsigned int gen,
+							  const value &res, const string &next);
+	
+						 /// Drop all entries.
+	void				 clear (void);
+	
+						 /// Hits, misses, hit rate and size.
+	value				*stats (void);
+
+protected:
+	lock<value>			 entries; ///< Results by key, oldest first.
+	unsigned int		 gen; ///< Write generation of the entries.
+	int					 bytes; ///< Size of the entries.
+	unsigned int		 hits; ///< Lookups answered.
+	unsigned int		 misses; ///< Lookups that went to the database.
+};
+
 //  -------------------------------------------------------------------------
 /// Keeps track of a session between a user interface and the opencore
 /// system. This object is kept around to have a unique security context
@@ -235,11 +570,62 @@ public:
 						 /// \param ofclass Restrict to a specific class
 						 /// \param offset An offset if you want a range.
 						 /// \param count Maximum size of resultset.
+						 /// \param whitelist If not empty, the only
+						 ///                  object fields to return.
 						 /// \return data in the following format:
 						 /// \verbinclude db_listObjects.format
 	value				*listObjects (const statstring &parentid,
 										const statstring &ofclass = nokey,
-										int offset=0, int count=-1);
+										int offset=0, int count=-1,
+										const value &whitelist=emptyvalue);
+
+						 /// Get one page of objects, continuing after
+						 /// a token handed out with the previous page.
+						 /// \param parentid The context, nokey for root.
+						 /// \param ofclass Restrict to a specific class
+						 /// \param count Maximum size of the page.
+						 /// \param after Continuation token, empty for
+						 ///              the first page.
+						 /// \param next Receives the token for the next
+						 ///             page, empty after the last one.
+						 ///             Internal, meta and dynamic classes
+						 ///             always come back in one page.
+						 /// \param whitelist If not empty, the only
+						 ///                  object fields to return.
+	value				*listObjectPage (const statstring &parentid,
+										 const statstring &ofclass,
+										 int count, const string &after,
+										 string &next,
+										 const value &whitelist=emptyvalue);
+	
+						 /// Count the objects listObjects would return
+						 /// without a limit. Cached like the listings.
+						 /// \return The count, or -1 if the class is
+						 ///         not kept in the database.
+	int					 countObjects (const statstring &parentid,
+									   const statstring &ofclass);
+	
+						 /// List the objects whose field matches a text.
+						 /// Searchable fields are matched in the
+						 /// database, other fields by listing the
+						 /// class and filtering the result.
+						 /// \param parentid The context, nokey for root.
+						 /// \param ofclass The class to search.
+						 /// \param field The field to match.
+						 /// \param text The text to match.
+						 /// \param mode Exact, prefix or substring match.
+						 /// \param offset An offset if you want a range.
+						 /// \param count Maximum size of resultset.
+						 /// \param total Receives the number of matches
+						 ///              without offset and count.
+						 /// \return data in the listObjects format.
+	value				*searchObjects (const statstring &parentid,
+										const statstring &ofclass,
+										const statstring &field,
+										const string &text,
+										dbsearchmode mode,
+										int offset, int count,
+										int &total);
 	
 						 /// Filter a listObjects resultset through a fieldname
 						 /// whitelist
@@ -287,6 +673,22 @@ public:
 									   const statstring &withid = nokey,
 									   bool immediate = false);
 						 
+						 /// Create a batch of objects. All of them are
+						 /// validated first, then inserted in a single
+						 /// transaction; if one fails, none are created.
+						 /// Objects of internal or dynamic classes are
+						 /// created one by one after that transaction.
+						 /// Children of the same allchildren parent
+						 /// share a single module action.
+						 /// \param items Array of objects with parentid,
+						 ///              classid, objectid and data.
+						 /// \param immediate Skip the module actions.
+						 /// \return Array with one node per item, holding
+						 ///         either the objid or the error code
+						 ///         and message.
+	value				*createObjects (const value &items,
+										bool immediate = false);
+						 
 						 /// Update records for an instance.
 						 /// \param parentid The object parent's uuid, or
 						 ///                 nokey if the object is at the
@@ -431,10 +833,11 @@ public:
 	statstring			 id; ///< The session-id
 	value				 meta; ///< Meta data from SessionDB::create.
 
-	CoreSession			*next; ///< List link.
-	CoreSession			*prev; ///< List link.
-	CoreSession			*higher; ///< Hash link.
-	CoreSession			*lower; ///< Hash link.
+	CoreSession			*next; ///< Hash chain link.
+	CoreSession			*prev; ///< Hash chain link.
+	CoreSession			*wnext; ///< Expiry wheel link.
+	CoreSession			*wprev; ///< Expiry wheel link.
+	int					 wslot; ///< Expiry wheel slot, or -1.
 	
 	void				 mlockr (void); ///< Lock module access.
 	void				 mlockw (const string &plocker); /// Write-lock module access.
@@ -455,6 +858,36 @@ protected:
 									   const statstring &withid,
 									   value &param);
 
+						 /// Check and normalize the parameters for a new
+						 /// object, up to the point where it can go
+						 /// into the database.
+						 /// \param parentid The parent-id.
+						 /// \param ofclass The class name.
+						 /// \param withparam (in/out) object parameters.
+						 /// \param withid (in/out) the object-id.
+						 /// \return False on failure, the error is set.
+	bool				 prepareCreate (const statstring &parentid,
+										const statstring &ofclass,
+										value &withparam,
+										statstring &withid);
+	
+						 /// Report the outcome of a module create action
+						 /// for an object to the database.
+						 /// \param res The module result.
+						 /// \param ofclass The class name.
+						 /// \param uuid The object uuid.
+						 /// \param parm The module parameters of this
+						 ///             object, or empty to have them
+						 ///             fetched when the module has to
+						 ///             undo the create.
+						 /// \param moderr (in/out) The module error text.
+						 /// \return False on failure, the error is set.
+	bool				 finishCreate (corestatus_t res,
+									   const statstring &ofclass,
+									   const string &uuid,
+									   const value &parm,
+									   string &moderr);
+
 						 /// Handles synchronization of dynamic classes.
 						 /// These get their object list through the
 						 /// module API, which is synchronized against
@@ -496,7 +929,12 @@ protected:
 	class DBManager		 db; ///< Local DBManager instance.
 	value				 errors; ///< Details of error.
 	time_t				 heartbeat; ///< Timeout tracker.
-	int					 inuse; ///< Flags status.
+	int					 inuse; ///< Claims from get(), changed atomically.
+	bool				 delegated; ///< Leased through SessionDB::delegate().
+	bool				 journaled; ///< Has a record in the journal.
+	volatile bool		 restored; ///< Restored, login still pending.
+	lock<string>		 pendinguser; ///< User to log in on first use.
+	RecordCache			 rcache; ///< Earlier getRecords/getRecord results.
 	string				 locker; ///< Tag owning the ModuleDB write lock.
 	lock<bool>			 spinlock; ///< Serialize access to each session.
 	value				 quotamap; ///< Mapping between generated uuids and quotas.
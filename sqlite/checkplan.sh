@@ -0,0 +1,58 @@
+#!/bin/sh
+# This file is part of OpenPanel - The Open Source Control Panel
+# OpenPanel is free software: you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation, using version 3 of the License.
+#
+# Please note that use of the OpenPanel trademark may be subject to additional
+# restrictions. For more information, please visit the Legal Information
+# section of the OpenPanel website on http://www.openpanel.com/
+
+# usage: checkplan.sh <source> <planfile> <database>
+#
+# Checks that every tagged query in <source> has a section in <planfile>
+# and the other way around, then fails if any plan in <planfile> scans
+# the objects table.
+
+src="$1"
+plans="$2"
+db="$3"
+tmp="${TMPDIR:-/tmp}/checkplan.$$"
+fail=0
+
+trap 'rm -f "$tmp".*' EXIT
+
+# tags of the statements in the code, commented out code left aside
+grep -v '^[[:space:]]*//' "$src" | \
+	grep -oE '(SELECT|INSERT|UPDATE|DELETE|REPLACE) /\* [^*]+ \*/' | \
+	sed -E 's@^[A-Z]+ /\* (.*) \*/$@\1@' | sort -u > "$tmp.code"
+
+# tags with a plan section, or explicitly left unchecked
+{
+	grep -E '^SELECT "% [^"]+";' "$plans" | \
+		sed -E 's/^SELECT "% (.*)";$/\1/'
+	grep -E '^-- unchecked: ' "$plans" | sed -e 's/^-- unchecked: //'
+} | sort -u > "$tmp.plan"
+
+comm -23 "$tmp.code" "$tmp.plan" > "$tmp.missing"
+comm -13 "$tmp.code" "$tmp.plan" > "$tmp.stale"
+
+if [ -s "$tmp.missing" ]; then
+	echo "% queries without an expected plan in $plans:"
+	sed -e 's/^/  /' "$tmp.missing"
+	fail=1
+fi
+
+if [ -s "$tmp.stale" ]; then
+	echo "% plans in $plans for queries no longer in $src:"
+	sed -e 's/^/  /' "$tmp.stale"
+	fail=1
+fi
+
+if sqlite3 "$db" < "$plans" | \
+	grep -E "SCAN (TABLE )?(objects|o[0-9]*)( AS o[0-9]*)?( |$)"; then
+	echo "% full scan of objects in query plan"
+	fail=1
+fi
+
+exit $fail